@@ -55,6 +55,9 @@ typedef void (*blcall)(void);
 __attribute__((unused))
 static char brom_getc(void)
 {
+	while (readl(VUART_BASE + VUART_RX_COUNT) == 0)
+		;
+
 	return (char) readl(VUART_BASE + VUART_READ);
 }
 
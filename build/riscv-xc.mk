@@ -26,5 +26,5 @@ OBJCOPY   = riscv64-linux-gnu-objcopy
 NM        = riscv64-linux-gnu-nm
 
 # Add some special R5 options!
-CFLAGS    += -ffreestanding -march=rv32im -mabi=ilp32 -O2 -fno-omit-frame-pointer
+CFLAGS    += -ffreestanding -march=rv32ima -mabi=ilp32 -O2 -fno-omit-frame-pointer
 LDFLAGS   = -melf32lriscv -nostartfiles -nostdlib -nodefaultlibs
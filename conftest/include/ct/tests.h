@@ -79,8 +79,10 @@ const struct ct_test *ct_env(void);
 const struct ct_test *ct_system(void);
 const struct ct_test *ct_load_store(void);
 const struct ct_test *ct_muldiv(void);
+const struct ct_test *ct_atomics(void);
 const struct ct_test *ct_op(void);
 const struct ct_test *ct_traps(void);
+const struct ct_test *ct_virtio(void);
 const struct ct_test *ct_sv_traps(void);
 
 #endif
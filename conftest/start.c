@@ -30,8 +30,10 @@ static ct_test_list_fn submodules[] = {
 	ct_system,
 	ct_load_store,
 	ct_muldiv,
+	ct_atomics,
 	ct_op,
 	ct_traps,
+	ct_virtio,
 	NULL
 };
 
@@ -0,0 +1,170 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Tests for the A extension: AMOs and LR/SC.
+ */
+
+#include <ct/conftest.h>
+#include <ct/tests.h>
+
+/*
+ * For AMOs a is the word in memory and b the register operand; answer is
+ * what memory should hold afterwards. The AMO must also return a.
+ */
+#define test_amo_func(op)					\
+	static int ct_test_##op(void *data)			\
+	{							\
+		struct ct_op *test = data;			\
+		u32 mem = test->a;				\
+		u32 res;					\
+								\
+		asm volatile(#op ".w	%0, %2, (%1)\n\t"	\
+			     : "=r" (res)			\
+			     : "r" (&mem), "r" (test->b)	\
+			     : "memory");			\
+								\
+		return res == test->a && mem == test->answer;	\
+	}
+
+test_op(amoadd1,	1,		2,		3);
+test_op(amoadd2,	0xffffffff,	1,		0);
+
+test_op(amoswap1,	1,		2,		2);
+
+test_op(amoand1,	0xf0f0,		0xff00,		0xf000);
+test_op(amoor1,		0xf0f0,		0xff00,		0xfff0);
+test_op(amoxor1,	0xf0f0,		0xff00,		0x0ff0);
+
+test_op(amomin1,	-2,		1,		-2);
+test_op(amomin2,	5,		3,		3);
+test_op(amomax1,	-2,		1,		1);
+test_op(amomax2,	5,		3,		5);
+test_op(amominu1,	-2,		1,		1);
+test_op(amomaxu1,	-2,		1,		-2);
+
+test_amo_func(amoadd)
+test_amo_func(amoswap)
+test_amo_func(amoand)
+test_amo_func(amoor)
+test_amo_func(amoxor)
+test_amo_func(amomin)
+test_amo_func(amomax)
+test_amo_func(amominu)
+test_amo_func(amomaxu)
+
+static u32 lr_word;
+
+/*
+ * An LR followed directly by an SC to the same word must succeed.
+ */
+static int
+ct_test_lr_sc(void *data)
+{
+	u32 old, fail;
+
+	lr_word = 10;
+
+	asm volatile("lr.w	%0, (%2)\n\t"
+		     "sc.w	%1, %3, (%2)\n\t"
+		     : "=&r" (old), "=&r" (fail)
+		     : "r" (&lr_word), "r" (11)
+		     : "memory");
+
+	return old == 10 && fail == 0 && lr_word == 11;
+}
+
+/*
+ * An SC without a reservation, or to a different word than the LR, must
+ * fail and leave memory alone.
+ */
+static int
+ct_test_sc_fail(void *data)
+{
+	u32 other = 5;
+	u32 old, fail1, fail2;
+
+	lr_word = 10;
+
+	asm volatile("lr.w	%0, (%3)\n\t"
+		     "sc.w	%1, %5, (%4)\n\t"
+		     "sc.w	%2, %5, (%3)\n\t"
+		     : "=&r" (old), "=&r" (fail1), "=&r" (fail2)
+		     : "r" (&lr_word), "r" (&other), "r" (11)
+		     : "memory");
+
+	return old == 10 && fail1 != 0 && fail2 != 0 &&
+		lr_word == 10 && other == 5;
+}
+
+/*
+ * An AMO to the reserved word in between the LR and SC breaks the
+ * reservation, even though it puts the same value back.
+ */
+static int
+ct_test_sc_amo(void *data)
+{
+	u32 old, tmp, fail;
+
+	lr_word = 10;
+
+	asm volatile("lr.w	%0, (%3)\n\t"
+		     "amoadd.w	%1, zero, (%3)\n\t"
+		     "sc.w	%2, %4, (%3)\n\t"
+		     : "=&r" (old), "=&r" (tmp), "=&r" (fail)
+		     : "r" (&lr_word), "r" (11)
+		     : "memory");
+
+	return old == 10 && fail != 0 && lr_word == 10;
+}
+
+static const struct ct_test atomics_tests[] = {
+	CT_TEST(ct_test_amoadd,			&amoadd1,		"amoadd1"),
+	CT_TEST(ct_test_amoadd,			&amoadd2,		"amoadd2"),
+
+	CT_TEST(ct_test_amoswap,		&amoswap1,		"amoswap1"),
+
+	CT_TEST(ct_test_amoand,			&amoand1,		"amoand1"),
+
+	CT_TEST(ct_test_amoor,			&amoor1,		"amoor1"),
+
+	CT_TEST(ct_test_amoxor,			&amoxor1,		"amoxor1"),
+
+	CT_TEST(ct_test_amomin,			&amomin1,		"amomin1"),
+	CT_TEST(ct_test_amomin,			&amomin2,		"amomin2"),
+
+	CT_TEST(ct_test_amomax,			&amomax1,		"amomax1"),
+	CT_TEST(ct_test_amomax,			&amomax2,		"amomax2"),
+
+	CT_TEST(ct_test_amominu,		&amominu1,		"amominu1"),
+
+	CT_TEST(ct_test_amomaxu,		&amomaxu1,		"amomaxu1"),
+
+	CT_TEST(ct_test_lr_sc,			NULL,			"lr_sc"),
+	CT_TEST(ct_test_sc_fail,		NULL,			"sc_fail"),
+	CT_TEST(ct_test_sc_amo,			NULL,			"sc_amo"),
+
+	/*
+	 * NULL terminate.
+	 */
+	CT_TEST(NULL,				NULL,			NULL),
+};
+
+const struct ct_test *
+ct_atomics(void)
+{
+	return atomics_tests;
+}
@@ -70,10 +70,42 @@ ct_test_rdtime(void *data)
 	return diff.lo != 0;
 }
 
+/*
+ * A TIME read that doesn't directly follow a TIMEH read must not return
+ * the low half latched by that TIMEH read. Latch the time, spin, then
+ * read TIME twice back to back: the two reads should be much closer
+ * together than the length of the spin.
+ */
+static int
+ct_test_rdtime_unlatched(void *data)
+{
+	u32 hi, first, second, start, end;
+	int i;
+
+	asm volatile("rdtimeh	%0\n\t" : "=r" (hi));
+
+	for (i = 0; i < 10000; i++)
+		barrier();
+
+	asm volatile("rdtime	%0\n\t"
+		     "rdtime	%1\n\t"
+		     : "=r" (first), "=r" (second));
+
+	asm volatile("rdtime	%0\n\t" : "=r" (start));
+
+	for (i = 0; i < 10000; i++)
+		barrier();
+
+	asm volatile("rdtime	%0\n\t" : "=r" (end));
+
+	return second - first < (end - start) / 2;
+}
+
 static const struct ct_test system_tests[] = {
 	CT_TEST(ct_test_rdcycle,		NULL,			"system_rdcycle"),
 	CT_TEST(ct_test_rdinstret,		NULL,			"system_rdinstret"),
 	CT_TEST(ct_test_rdtime,			NULL,			"system_rdtime"),
+	CT_TEST(ct_test_rdtime_unlatched,	NULL,			"system_rdtime_unlatched"),
 
 	/*
 	 * NULL terminate.
@@ -0,0 +1,182 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Tests for the virtio-blk device. These only run if the simulator was
+ * started with a virtio-blk disk (-k); otherwise they pass trivially.
+ */
+
+#include <r5sim/hw/virtio.h>
+
+#include <ct/conftest.h>
+#include <ct/tests.h>
+
+#define VBLK_BASE	0x4010000
+#define VBLK_QSIZE	4
+
+#define vblk_readl(offs)	readl(VBLK_BASE + (offs))
+#define vblk_writel(offs, val)	writel(VBLK_BASE + (offs), val)
+
+/*
+ * Ring memory; the trailing u16 of each ring is the event index.
+ */
+static struct virtq_desc vblk_desc[VBLK_QSIZE] __attribute__((aligned(16)));
+static u16 vblk_avail[2 + VBLK_QSIZE + 1] __attribute__((aligned(2)));
+static u32 vblk_used[1 + 2 * VBLK_QSIZE + 1] __attribute__((aligned(4)));
+
+static struct virtio_blk_req_hdr vblk_hdr;
+static volatile u8 vblk_status;
+
+static int
+vblk_present(void)
+{
+	return vblk_readl(VIRTIO_MMIO_MAGIC_VALUE) == VIRTIO_MMIO_MAGIC &&
+		vblk_readl(VIRTIO_MMIO_DEVICE_ID) == VIRTIO_ID_BLOCK;
+}
+
+static int
+vblk_setup(void)
+{
+	u32 status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+	vblk_writel(VIRTIO_MMIO_STATUS, 0);
+	vblk_writel(VIRTIO_MMIO_STATUS, status);
+
+	vblk_writel(VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+	vblk_writel(VIRTIO_MMIO_DRIVER_FEATURES, 0);
+	vblk_writel(VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+	vblk_writel(VIRTIO_MMIO_DRIVER_FEATURES,
+		    1 << (VIRTIO_F_VERSION_1 - 32));
+
+	status |= VIRTIO_STATUS_FEATURES_OK;
+	vblk_writel(VIRTIO_MMIO_STATUS, status);
+	if (!(vblk_readl(VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+		return -1;
+
+	vblk_writel(VIRTIO_MMIO_QUEUE_SEL, 0);
+	vblk_writel(VIRTIO_MMIO_QUEUE_NUM, VBLK_QSIZE);
+	vblk_writel(VIRTIO_MMIO_QUEUE_DESC_LOW, (u32)vblk_desc);
+	vblk_writel(VIRTIO_MMIO_QUEUE_DESC_HIGH, 0);
+	vblk_writel(VIRTIO_MMIO_QUEUE_DRIVER_LOW, (u32)vblk_avail);
+	vblk_writel(VIRTIO_MMIO_QUEUE_DRIVER_HIGH, 0);
+	vblk_writel(VIRTIO_MMIO_QUEUE_DEVICE_LOW, (u32)vblk_used);
+	vblk_writel(VIRTIO_MMIO_QUEUE_DEVICE_HIGH, 0);
+	vblk_writel(VIRTIO_MMIO_QUEUE_READY, 1);
+	if (!vblk_readl(VIRTIO_MMIO_QUEUE_READY))
+		return -1;
+
+	vblk_writel(VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+
+	return 0;
+}
+
+/*
+ * Read into a data buffer whose address wraps around the end of the 64
+ * bit physical address space. The device must fail the request rather
+ * than touch the buffer.
+ */
+static int
+ct_test_vblk_bad_desc(void *data)
+{
+	volatile u16 *used_idx = (volatile u16 *)vblk_used + 1;
+	int ok;
+
+	if (!vblk_present())
+		return 1;
+
+	if (vblk_setup())
+		return 0;
+
+	vblk_hdr.type = VIRTIO_BLK_T_IN;
+	vblk_hdr.sector = 0;
+	vblk_status = 0xff;
+
+	vblk_desc[0].addr  = (u32)&vblk_hdr;
+	vblk_desc[0].len   = sizeof(vblk_hdr);
+	vblk_desc[0].flags = VIRTQ_DESC_F_NEXT;
+	vblk_desc[0].next  = 1;
+
+	vblk_desc[1].addr  = 0xfffffffffffff000ULL;
+	vblk_desc[1].len   = 0x2000;
+	vblk_desc[1].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
+	vblk_desc[1].next  = 2;
+
+	vblk_desc[2].addr  = (u32)&vblk_status;
+	vblk_desc[2].len   = 1;
+	vblk_desc[2].flags = VIRTQ_DESC_F_WRITE;
+	vblk_desc[2].next  = 0;
+
+	vblk_avail[2] = 0;
+	barrier();
+	vblk_avail[1] = 1;
+	barrier();
+
+	vblk_writel(VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+
+	while (*used_idx != 1)
+		;
+
+	ok = vblk_status == VIRTIO_BLK_S_IOERR;
+
+	vblk_writel(VIRTIO_MMIO_STATUS, 0);
+
+	return ok;
+}
+
+/*
+ * A ring above 4GB can't be in DRAM; the device must refuse to make the
+ * queue ready rather than drop the high word and use the low one.
+ */
+static int
+ct_test_vblk_ring_high(void *data)
+{
+	int ok;
+
+	if (!vblk_present())
+		return 1;
+
+	if (vblk_setup())
+		return 0;
+
+	vblk_writel(VIRTIO_MMIO_QUEUE_READY, 0);
+	vblk_writel(VIRTIO_MMIO_QUEUE_DESC_HIGH, 1);
+	vblk_writel(VIRTIO_MMIO_QUEUE_READY, 1);
+	ok = !vblk_readl(VIRTIO_MMIO_QUEUE_READY);
+
+	vblk_writel(VIRTIO_MMIO_QUEUE_DESC_HIGH, 0);
+	vblk_writel(VIRTIO_MMIO_QUEUE_READY, 1);
+	ok = ok && vblk_readl(VIRTIO_MMIO_QUEUE_READY);
+
+	vblk_writel(VIRTIO_MMIO_STATUS, 0);
+
+	return ok;
+}
+
+static const struct ct_test virtio_tests[] = {
+	CT_TEST(ct_test_vblk_bad_desc,		NULL,			"vblk_bad_desc"),
+	CT_TEST(ct_test_vblk_ring_high,		NULL,			"vblk_ring_high"),
+
+	/*
+	 * NULL terminate.
+	 */
+	CT_TEST(NULL,				NULL,			NULL),
+};
+
+const struct ct_test *
+ct_virtio(void)
+{
+	return virtio_tests;
+}
@@ -22,13 +22,26 @@
 #ifndef __R5SIM_APP_H__
 #define __R5SIM_APP_H__
 
+#include <r5sim/machine.h>
+
+#include <r5sim/hw/vdisk.h>
+
 struct r5sim_app_args {
 	int         help;
 	int         verbose;
 	int         itrace;
 	const char *bootrom;
-	const char *disk_file;
+	const char *disk_files[VDISK_MAX_DISKS];
+	int         nr_disks;
+	const char *vblk_file;
+	const char *uart;
+	int         io_cpu;
+	unsigned    time_quantum;
+	double      virtual_time;
 	const char *script;
+	unsigned    nr_harts;
+	unsigned    hart_quantum;
+	unsigned    hart_weights[R5SIM_MAX_HARTS];
 };
 
 struct r5sim_app_args *
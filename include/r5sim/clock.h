@@ -0,0 +1,83 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Simulator clock: nanoseconds since the simulator started. This is the
+ * timebase for mtime (and the TIME CSRs) so it has to be cheap to read;
+ * where the host has an invariant TSC it's read straight from the TSC,
+ * otherwise from the vDSO's CLOCK_MONOTONIC. Neither makes a syscall.
+ *
+ * Alternatively the clock can be virtual: see r5sim_vclock below.
+ */
+
+#ifndef __R5SIM_CLOCK_H__
+#define __R5SIM_CLOCK_H__
+
+#include <stdbool.h>
+
+#include <r5sim/env.h>
+
+/*
+ * Virtual time: rather than follow the host the clock is moved by the
+ * core. Each instruction the core executes advances it by step ns (32.32
+ * fixed point) and an idle core jumps it forward to the next event (see
+ * event.h). Only the core thread moves the clock; anyone may read it.
+ */
+struct r5sim_vclock {
+	bool              enabled;
+	u64               ns;
+	u32               frac;
+	u64               step;
+};
+
+extern struct r5sim_vclock r5sim_vclock;
+
+void r5sim_clock_init(void);
+void r5sim_clock_init_virtual(double insns_per_ns);
+
+u64  r5sim_clock_ns(void);
+
+static inline bool r5sim_clock_virtual(void)
+{
+	return r5sim_vclock.enabled;
+}
+
+/*
+ * Account for one executed instruction; returns the new virtual time.
+ */
+static inline u64 r5sim_clock_tick(void)
+{
+	u64 frac = (u64)r5sim_vclock.frac + (r5sim_vclock.step & 0xffffffff);
+	u64 ns = r5sim_vclock.ns + (r5sim_vclock.step >> 32) + (frac >> 32);
+
+	r5sim_vclock.frac = (u32)frac;
+	__atomic_store_n(&r5sim_vclock.ns, ns, __ATOMIC_RELAXED);
+
+	return ns;
+}
+
+/*
+ * Move virtual time forward to ns; the clock never goes backwards.
+ */
+void r5sim_clock_skip(u64 ns);
+
+/*
+ * Convert a simulator time to a CLOCK_MONOTONIC time in ns; e.g for
+ * arming an absolute timerfd. Only meaningful on the host clock.
+ */
+u64  r5sim_clock_to_mono(u64 ns);
+
+#endif
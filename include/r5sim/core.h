@@ -23,12 +23,14 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <pthread.h>
 
 #include <r5sim/isa.h>
 #include <r5sim/csr.h>
 #include <r5sim/mmu.h>
 #include <r5sim/list.h>
+#include <r5sim/event.h>
 
 /*
  * A max depth of 4 seems like a reasonable place to start; if this needs
@@ -36,11 +38,31 @@
  */
 #define R5SIM_TRAP_DEPTH_MAX		4
 
+/*
+ * Exit status when the core is found spinning in a loop that nothing can
+ * ever break it out of; the same status timeout(1) uses.
+ */
+#define R5SIM_EXIT_HUNG			124
+
 struct r5sim_machine;
 
+/*
+ * What a host thread running harts sleeps on. Kicks bump seq and, if
+ * waiting is set, wake the thread.
+ */
+struct r5sim_waker {
+	u32                   seq;
+	u32                   waiting;
+};
+
 struct r5sim_core {
 	const char           *name;
 
+	/*
+	 * This core's mhartid.
+	 */
+	u32                   hartid;
+
 	/*
 	 * Set to non-zero if instruction tracing should be enabled.
 	 */
@@ -51,7 +73,19 @@ struct r5sim_core {
 
 	struct r5sim_csr      csr_file[4096];
 
-	struct timespec	      start;
+	/*
+	 * TIME/TIMEH state. time_ns is the last simulator clock sample and
+	 * time_cycle the CYCLE count when it was taken; the sample is reused
+	 * until time_quantum instructions have retired (0: sample on every
+	 * read). A TIMEH read latches the sample so that a TIME read by the
+	 * very next instruction returns the low half of the same 64 bit
+	 * value; time_latch_instret is INSTRET at the TIMEH read.
+	 */
+	u64                   time_ns;
+	u32                   time_cycle;
+	u32                   time_quantum;
+	u32                   time_latched;
+	u32                   time_latch_instret;
 
 	/*
 	 * Priv level for this core.
@@ -66,14 +100,98 @@ struct r5sim_core {
 	 * all we support, so that's all there is.
 	 *
 	 * To signal an interrupt an external device should call the
-	 * r5sim_core_signal_intr() function. This will handle signaling
+	 * r5sim_core_intr_signal() function. This will handle signaling
 	 * the relevant core.
+	 *
+	 * mip is only ever touched by the core thread. Other threads post
+	 * changes to intr_post instead: the low word holds bits to set,
+	 * the high word bits to clear, with the latest post to a bit
+	 * winning. The core folds the posts into mip between instructions
+	 * if intr_post is non-zero.
 	 */
 	u32                   mie;
 	u32                   mip;
+	u64                   intr_post;
+
+	/*
+	 * MTI and MSI can each be driven by both the CLINT and the VSYS.
+	 * For such bits every device drives its own level (a bit per
+	 * R5SIM_INTR_DEV_*) and mip holds the OR of them, so one device
+	 * dropping the line can't lose the other's interrupt. See
+	 * r5sim_core_intr_level().
+	 */
+	u32                   intr_levels[32];
+#define R5SIM_INTR_DEV_CLINT	0x1
+#define R5SIM_INTR_DEV_VSYS	0x2
+
+	/*
+	 * WFI sleeps on a futex on waker->seq; r5sim_core_intr_signal()
+	 * bumps it after posting and, if waker->waiting is set, wakes the
+	 * thread. waker is the core's own wake unless the harts share one
+	 * host thread, in which case every hart uses hart 0's.
+	 */
+	struct r5sim_waker    wake;
+	struct r5sim_waker   *waker;
+
+	/*
+	 * Set if the harts share one host thread (see sched.c). The hart
+	 * then never blocks: where it would wait it sets yield instead,
+	 * which ends the quantum it's running, and leaves the waiting to
+	 * the scheduler.
+	 */
+	u32                   shared;
+	u32                   yield;
+#define R5SIM_YIELD_NONE      0
+#define R5SIM_YIELD_PAUSE     1	/* Spin hint; let the others run. */
+#define R5SIM_YIELD_IDLE      2	/* Idle loop or WRS. */
+#define R5SIM_YIELD_WFI	      3	/* Waiting for mip. */
+#define R5SIM_YIELD_HUNG      4	/* Stuck for good. */
+
+	/*
+	 * LR reservation: the word LR loaded and the generation of its
+	 * granule at the time. WRS.NTO/WRS.STO wait for the reserved word
+	 * to change from resv_value.
+	 */
+	u32                   resv_valid;
+	u32                   resv_addr;
+	u32                   resv_value;
+	u32                   resv_gen;
+
+	/*
+	 * Idle loop detection (see core_idle.c). Every so many backward
+	 * branches the core snapshots its registers at a loop head; the
+	 * exec functions set dirty for anything with a side effect and
+	 * loaded for loads. If the next pass round the loop comes back to
+	 * the same registers with nothing dirty the loop can't make
+	 * progress until something outside the core changes. nap_ns is
+	 * how long the next nap is; it grows while the loop stays idle.
+	 */
+	struct {
+		u32           countdown;
+		u32           armed;
+		u32           from;
+		u32           to;
+		u32           seq;
+		u32           dirty;
+		u32           loaded;
+		u32           nap_ns;
+		u32           regs[32];
+	} idle;
+
 	u32                   medeleg;
 	u32                   mideleg;
 
+	/*
+	 * Sstc. With menvcfgh.STCE set STIP follows time >= stimecmp and
+	 * the stimer event raises it on time. Written by the core, read by
+	 * the event; the lock makes sure the event is always left scheduled
+	 * for the latest stimecmp.
+	 */
+	u32                   menvcfgh;
+	u64                   stimecmp;
+	pthread_mutex_t       stimer_lock;
+	struct r5sim_event    stimer;
+
 	u32                   mstatus;
 
 	/*
@@ -139,11 +257,40 @@ void r5sim_core_describe(struct r5sim_core *core);
 
 void r5sim_core_incr(struct r5sim_core *core);
 void r5sim_core_wfi(struct r5sim_core *core);
+void r5sim_core_hung(struct r5sim_core *core);
+void r5sim_core_wrs(struct r5sim_core *core, u32 sto);
 int  r5sim_core_handle_intr(struct r5sim_core *core);
 void r5sim_core_intr_signal(struct r5sim_core *core, u32 src);
+void r5sim_core_intr_clear(struct r5sim_core *core, u32 src);
+void r5sim_core_intr_level(struct r5sim_core *core, u32 src,
+			   u32 dev, bool level);
+void r5sim_core_intr_ack(struct r5sim_core *core, u32 bits);
+void r5sim_core_kick(struct r5sim_core *core);
+void __r5sim_core_intr_fold(struct r5sim_core *core);
+void __r5sim_core_idle_check(struct r5sim_core *core, u32 from);
 void __r5sim_core_push_trap(struct r5sim_core *core,
 			    u32 priv, u32 code, u32 intr);
 
+/*
+ * Bring mip up to date with any posted interrupt changes. Core thread
+ * only.
+ */
+static inline void r5sim_core_intr_sync(struct r5sim_core *core)
+{
+	if (__atomic_load_n(&core->intr_post, __ATOMIC_RELAXED))
+		__r5sim_core_intr_fold(core);
+}
+
+/*
+ * Called by the exec loop for every taken backward branch or jump; only
+ * every so often is it worth looking for an idle loop.
+ */
+static inline void r5sim_core_backedge(struct r5sim_core *core, u32 from)
+{
+	if (!--core->idle.countdown)
+		__r5sim_core_idle_check(core, from);
+}
+
 const char *r5sim_reg_to_abi_str(u32 reg);
 const char *r5sim_reg_to_str(u32 reg);
 const char *r5sim_load_func3_to_str(u32 func3);
@@ -153,5 +300,6 @@ const char *r5sim_op_i_func3_to_str(u32 func3, u32 func7);
 const char *r5sim_op_m_func3_to_str(u32 func3);
 const char *r5sim_branch_func3_to_str(u32 func3);
 const char *r5sim_system_func3_to_str(u32 func3, u32 csr);
+const char *r5sim_amo_func5_to_str(u32 func5);
 
 #endif
@@ -0,0 +1,89 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * Per machine discrete event queue. A device schedules an event for an
+ * absolute simulator time (ns, see clock.h) and the event's func is called
+ * once that time has been reached; e.g timer expiry or the end of a
+ * modeled device latency.
+ *
+ * The queue is a binary min-heap so the soonest event is always to hand
+ * and rescheduling costs O(log n). Where func runs depends on the clock:
+ *
+ *   - Host clock: the queue keeps one timerfd on the machine's IO loop
+ *     armed for the soonest event; func runs on the loop thread.
+ *
+ *   - Virtual time: the clock is a function of executed instructions, so
+ *     the core compares the clock against the soonest deadline after each
+ *     instruction - a single compare - and runs events on the core thread
+ *     when it's reached. An idle core jumps the clock straight to the next
+ *     deadline.
+ *
+ * Either way func may be called a little late - or, with the host clock,
+ * a hair early - so it should look at the clock rather than assume.
+ */
+
+#ifndef __R5SIM_EVENT_H__
+#define __R5SIM_EVENT_H__
+
+#include <r5sim/env.h>
+
+struct r5sim_machine;
+struct r5sim_event_queue;
+
+/*
+ * Scheduling an event for R5SIM_EVENT_NEVER, or anything at or past
+ * R5SIM_EVENT_MAX (about 146 years), cancels it.
+ */
+#define R5SIM_EVENT_NEVER	(~0ULL)
+#define R5SIM_EVENT_MAX		(1ULL << 62)
+
+struct r5sim_event {
+	void                 (*func)(struct r5sim_event *ev);
+	void                  *priv;
+
+	/*
+	 * Private to the queue: the deadline and the event's slot in the
+	 * heap (R5SIM_EVENT_IDLE when it isn't queued).
+	 */
+	struct r5sim_machine  *mach;
+	u64                    when;
+	u32                    slot;
+#define R5SIM_EVENT_IDLE       (~0U)
+};
+
+struct r5sim_event_queue *r5sim_event_queue_new(struct r5sim_machine *mach);
+
+void r5sim_event_init(struct r5sim_machine *mach, struct r5sim_event *ev,
+		      void (*func)(struct r5sim_event *ev), void *priv);
+
+/*
+ * (Re)schedule ev for simulator time when (ns); replaces any earlier
+ * deadline. May be called from any thread, including from func.
+ */
+void r5sim_event_schedule(struct r5sim_event *ev, u64 when);
+void r5sim_event_cancel(struct r5sim_event *ev);
+
+/*
+ * Run every event whose deadline has passed. r5sim_event_skip() is for
+ * an idle core on virtual time: it first moves the clock to the next
+ * deadline, and returns 0 if there's no event to skip to.
+ */
+void r5sim_event_run(struct r5sim_machine *mach);
+int  r5sim_event_skip(struct r5sim_machine *mach);
+
+#endif
@@ -0,0 +1,59 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * CLINT shared defines for the HW and for the "driver".
+ */
+
+#ifndef __R5SIM_HW_CLINT_H__
+#define __R5SIM_HW_CLINT_H__
+
+/*
+ * Core local interruptor, laid out like the SiFive CLINT that most RISC-V
+ * software expects. Each hart h has its own MSIP and MTIMECMP at
+ * CLINT_MSIP(h) and CLINT_MTIMECMP_LO/HI(h); MTIME is shared.
+ *
+ * MTIME counts in nanoseconds (a 1GHz timebase) since the simulator
+ * started; it's the same clock the TIME CSRs read and can't be written.
+ * The machine timer interrupt is pending whenever MTIME >= MTIMECMP;
+ * write a time in the future to MTIMECMP to clear it. The vsys timers
+ * also raise MTI, so software using both has to check which fired.
+ *
+ * Bit 0 of MSIP is the machine software interrupt pending bit. Any hart
+ * may set another's; this is how harts send each other inter-processor
+ * interrupts.
+ *
+ * All registers are accessed as 32 bit words. To update MTIMECMP without
+ * a spurious interrupt write all 1s to the low word first, then the high
+ * word, then the low word.
+ */
+#define CLINT_MSIP(h)		(0x0 + 4 * (h))
+#define CLINT_MSIP_PENDING	0:0
+
+#define CLINT_MTIMECMP_LO(h)	(0x4000 + 8 * (h))
+#define CLINT_MTIMECMP_HI(h)	(0x4004 + 8 * (h))
+
+#define CLINT_MTIME_LO		0xbff8
+#define CLINT_MTIME_HI		0xbffc
+
+#define CLINT_SIZE		0x10000
+
+/*
+ * Where the CLINT lives in the default machine's IO aperture.
+ */
+#define CLINT_IO_OFFSET		0x20000
+
+#endif
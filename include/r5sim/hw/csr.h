@@ -50,12 +50,16 @@
 #define CSR_MIDELEG		0x303
 
 #define CSR_MIE			0x304
+#define CSR_MIE_MEIE		11:11
+#define CSR_MIE_SEIE		9:9
 #define CSR_MIE_MTIE		7:7
 #define CSR_MIE_STIE		5:5
 #define CSR_MIE_MSIE		3:3
 #define CSR_MIE_SSIE		1:1
 
 #define CSR_MIP			0x344
+#define CSR_MIP_MEIP		11:11
+#define CSR_MIP_SEIP		9:9
 #define CSR_MIP_MTIP		7:7
 #define CSR_MIP_STIP		5:5
 #define CSR_MIP_MSIP		3:3
@@ -67,6 +71,10 @@
 #define CSR_MTVEC_MODE_DIRECT	0
 #define CSR_MTVEC_MODE_VECTORED	1
 
+#define CSR_MENVCFG		0x30A
+#define CSR_MENVCFGH		0x31A
+#define CSR_MENVCFGH_STCE	31:31
+
 #define CSR_MSCRATCH		0x340
 #define CSR_MEPC		0x341
 #define CSR_MCAUSE		0x342
@@ -148,6 +156,12 @@
 
 #define CSR_STVAL		0x143
 
+/*
+ * Sstc; only accessible from S-mode if menvcfgh.STCE is set.
+ */
+#define CSR_STIMECMP		0x14D
+#define CSR_STIMECMPH		0x15D
+
 /*
  * Custom CSRs.
  */
@@ -0,0 +1,67 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * PLIC shared defines for the HW and for the "driver".
+ */
+
+#ifndef __R5SIM_HW_PLIC_H__
+#define __R5SIM_HW_PLIC_H__
+
+/*
+ * Platform level interrupt controller, laid out like the SiFive PLIC.
+ * Devices drive the PLIC's sources; the PLIC drives the external
+ * interrupt lines of each context. Context 2h is hart h's M-mode (MEI)
+ * and context 2h + 1 its S-mode (SEI).
+ *
+ * Source 0 doesn't exist. Each other source has a priority from 0 to
+ * PLIC_PRIORITY_MAX; a priority of 0 means never interrupt. A context
+ * takes an interrupt when an enabled source is pending with a priority
+ * above the context's threshold.
+ *
+ * Reading a context's PLIC_CLAIM returns the highest priority pending
+ * enabled source (ties go to the lowest source number) and clears its
+ * pending bit, or 0 if there's nothing to claim. Write the source back
+ * to PLIC_CLAIM once it has been serviced. Sources are level triggered:
+ * a source still asserted by its device when completed goes pending
+ * again. Until it's completed a claimed source won't go pending.
+ *
+ * The MEIP and SEIP bits in the core follow the PLIC; software never
+ * needs to clear them.
+ */
+#define PLIC_NR_SOURCES		64
+#define PLIC_PRIORITY_MAX	7
+
+#define PLIC_PRIORITY(src)	(0x0 + 4 * (src))
+#define PLIC_PENDING(word)	(0x1000 + 4 * (word))
+#define PLIC_ENABLE(ctx, word)	(0x2000 + 0x80 * (ctx) + 4 * (word))
+#define PLIC_THRESHOLD(ctx)	(0x200000 + 0x1000 * (ctx))
+#define PLIC_CLAIM(ctx)		(0x200004 + 0x1000 * (ctx))
+
+#define PLIC_SIZE		0x400000
+
+/*
+ * Where the PLIC lives in the default machine's IO aperture and which
+ * source each of the default machine's devices drives.
+ */
+#define PLIC_IO_OFFSET		0x400000
+
+#define PLIC_IRQ_VUART		1
+#define PLIC_IRQ_VDISK(n)	(2 + (n))
+#define PLIC_IRQ_VBLK		17
+
+#endif
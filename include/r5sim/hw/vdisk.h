@@ -23,21 +23,61 @@
 
 /*
  * Disk device "registers". These are the offsets divided by 4 (so that
- * we can easily access the dev_state array. This provides a model that
- * theoretically could someday be asynchronous to the rest of the
- * simulator. For now, since that support doesn't exist, part of this
- * sequence is not necessary (e.g polling on the op being done).
+ * we can easily access the dev_state array.
  *
- * The basic usage of this device is really quite simple.
+ * Disk operations are executed asynchronously to the core by a host
+ * worker thread. The basic usage of this device is really quite simple.
  *
- *   1. Place an address in the VDISK_DRAM_ADDR and a page aligned
- *      offset in VDISK_PAGE_START.
+ *   1. Place an address in the VDISK_DRAM_ADDR and a page offset in
+ *      VDISK_PAGE_START (and VDISK_PAGE_START_HI for big disks).
  *   2. Specify a number of pages to copy.
  *   3. Specify an op to execute: COPY_TO_DISK or COPY_TO_DRAM.
- *   4. Make sure VDISK_BUSY is not set.
  *   4. Write to VDISK_EXEC.
- *   5. Poll/check that VDISK_BUSY is 0.
+ *   5. Poll/check that VDISK_BUSY is 0, or wait for the completion
+ *      interrupt.
  *
+ * The op registers are latched when VDISK_EXEC is written, so software
+ * may program and execute further ops while earlier ones are still in
+ * flight. Ops complete in the order they were executed. VDISK_BUSY
+ * reads as non-zero until every executed op has completed.
+ *
+ * If VDISK_IRQ_ENABLE is set then each completed op sets the DONE bit
+ * in VDISK_IRQ_STATUS and asserts the disk's PLIC source (see plic.h).
+ * Write a 1 to the DONE bit to clear it and deassert the source, then
+ * complete the interrupt in the PLIC.
+ *
+ * Instead of copying, a window of the disk may be mapped directly into
+ * the physical address space as an aperture with the MAP_RO or MAP_RW
+ * ops. For these VDISK_DRAM_ADDR holds the page aligned physical
+ * address at which to place the aperture; it must not overlap DRAM, the
+ * BROM, the IO aperture, or another aperture. Loads (and for MAP_RW,
+ * stores) to the aperture access the disk in place - code can even be
+ * executed from it. Each disk has a single aperture; mapping a new one
+ * replaces the old one and UNMAP removes it. Map ops take effect
+ * immediately rather than being queued, so wait for VDISK_BUSY to clear
+ * first if previously executed ops must complete beforehand.
+ *
+ * FLUSH and DISCARD are queued like copies and act on the pages given
+ * by VDISK_PAGE_START(_HI) and VDISK_PAGES; VDISK_DRAM_ADDR is unused.
+ * FLUSH makes all completed writes to those pages (including stores to
+ * an aperture) durable; zero pages flushes the whole disk. Since ops
+ * complete in order, a FLUSH after some writes is a write barrier.
+ * DISCARD tells the device the pages are no longer needed: they read
+ * back as zeros and the host may free the space backing them.
+ *
+ * The SG op runs a list of copy, flush and discard ops from DRAM as a
+ * single op: VDISK_DRAM_ADDR holds the (4 byte aligned) address of an
+ * array of VDISK_SG_DESC_SIZE byte descriptors and VDISK_PAGES the
+ * number of descriptors. The descriptors are read when the device gets
+ * to the SG op, so they must not be changed until it completes. They
+ * are run in order; VDISK_BUSY stays set, and DONE is raised once, for
+ * the list as a whole. Descriptors with any other op are skipped, as is
+ * the whole list if it doesn't lie in DRAM.
+ *
+ * VDISK_APERTURE_STATUS reports the result of the last map op. On
+ * success MAPPED is set and VDISK_APERTURE_ADDR/SIZE describe the
+ * aperture; otherwise ERROR is set. Disks attached with a file backed
+ * overlay (see the -d option) can't be mapped.
  */
 #define VDISK_PRESENT		0x0
 #define VDISK_PAGE_SIZE		0x4
@@ -50,10 +90,62 @@
 #define VDISK_OP		0x1c
 #define VDISK_OP_COPY_TO_DRAM	0x1
 #define VDISK_OP_COPY_TO_DISK	0x2
+#define VDISK_OP_MAP_RO		0x4
+#define VDISK_OP_MAP_RW		0x8
+#define VDISK_OP_UNMAP		0x10
+#define VDISK_OP_FLUSH		0x20
+#define VDISK_OP_DISCARD	0x40
+#define VDISK_OP_SG		0x80
 
 #define VDISK_EXEC		0x20
 #define VDISK_BUSY		0x24
 
-#define VDISK_MAX_REG		0x30
+#define VDISK_IRQ_ENABLE	0x28
+#define VDISK_IRQ_ENABLE_DONE	0:0
+
+#define VDISK_IRQ_STATUS	0x2c
+#define VDISK_IRQ_STATUS_DONE	0:0
+
+#define VDISK_APERTURE_ADDR	0x30
+#define VDISK_APERTURE_SIZE	0x34
+#define VDISK_APERTURE_STATUS	0x38
+#define VDISK_APERTURE_STATUS_MAPPED	0:0
+#define VDISK_APERTURE_STATUS_WRITABLE	1:1
+#define VDISK_APERTURE_STATUS_ERROR	2:2
+
+/*
+ * Upper 32 bits of the page offset for disks larger than 16TB; latched
+ * along with VDISK_PAGE_START.
+ */
+#define VDISK_PAGE_START_HI	0x3c
+
+/*
+ * The number of VDISKs attached to the machine; the same in every disk.
+ */
+#define VDISK_NR_DISKS		0x40
+
+#define VDISK_MAX_REG		0x50
+
+/*
+ * Scatter-gather descriptor layout; each field is a little endian word.
+ * CTRL_OP takes the same values as VDISK_OP and CTRL_PAGE_START_HI is
+ * bits 47:32 of the page offset.
+ */
+#define VDISK_SG_DESC_DRAM_ADDR		0x0
+#define VDISK_SG_DESC_PAGE_START	0x4
+#define VDISK_SG_DESC_PAGES		0x8
+#define VDISK_SG_DESC_CTRL		0xc
+#define VDISK_SG_DESC_CTRL_OP		7:0
+#define VDISK_SG_DESC_CTRL_PAGE_START_HI	31:16
+
+#define VDISK_SG_DESC_SIZE		0x10
+
+/*
+ * Disks are attached in consecutive IO windows: disk n lives at IO base +
+ * VDISK_IO_OFFSET + n * VDISK_IO_STRIDE.
+ */
+#define VDISK_IO_OFFSET		0x1000
+#define VDISK_IO_STRIDE		0x1000
+#define VDISK_MAX_DISKS		15
 
 #endif
@@ -0,0 +1,169 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * VIRTIO shared defines for the HW and for the "driver". This follows the
+ * VIRTIO 1.1 spec: the MMIO transport (version 2), split virtqueues, and
+ * the block device.
+ */
+
+#ifndef __R5SIM_HW_VIRTIO_H__
+#define __R5SIM_HW_VIRTIO_H__
+
+#include <stdint.h>
+
+/*
+ * virtio-mmio transport registers. Any register not listed here reads
+ * as 0 and ignores writes. The device specific config space starts at
+ * VIRTIO_MMIO_CONFIG.
+ *
+ * Only 32 bit physical addresses are supported, so the *_HIGH queue
+ * address registers must be written with 0.
+ *
+ * The device asserts its PLIC source (see plic.h) while any bit of
+ * VIRTIO_MMIO_INTERRUPT_STATUS is set.
+ */
+#define VIRTIO_MMIO_MAGIC_VALUE		0x000
+#define VIRTIO_MMIO_MAGIC		0x74726976 /* "virt" */
+#define VIRTIO_MMIO_VERSION		0x004
+#define VIRTIO_MMIO_DEVICE_ID		0x008
+#define VIRTIO_MMIO_VENDOR_ID		0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES	0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL	0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES	0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL	0x024
+#define VIRTIO_MMIO_QUEUE_SEL		0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX	0x034
+#define VIRTIO_MMIO_QUEUE_NUM		0x038
+#define VIRTIO_MMIO_QUEUE_READY		0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY	0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS	0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK	0x064
+#define VIRTIO_MMIO_STATUS		0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW	0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH	0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW	0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH	0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW	0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION	0x0fc
+#define VIRTIO_MMIO_CONFIG		0x100
+
+#define VIRTIO_MMIO_INT_VRING		0x1
+#define VIRTIO_MMIO_INT_CONFIG		0x2
+
+/*
+ * Device status bits.
+ */
+#define VIRTIO_STATUS_ACKNOWLEDGE	0x1
+#define VIRTIO_STATUS_DRIVER		0x2
+#define VIRTIO_STATUS_DRIVER_OK		0x4
+#define VIRTIO_STATUS_FEATURES_OK	0x8
+#define VIRTIO_STATUS_NEEDS_RESET	0x40
+#define VIRTIO_STATUS_FAILED		0x80
+
+/*
+ * Device independent feature bits.
+ */
+#define VIRTIO_RING_F_INDIRECT_DESC	28
+#define VIRTIO_RING_F_EVENT_IDX		29
+#define VIRTIO_F_VERSION_1		32
+
+#define VIRTIO_ID_BLOCK			2
+
+/*
+ * Split virtqueue layout.
+ */
+#define VIRTQ_DESC_F_NEXT		0x1
+#define VIRTQ_DESC_F_WRITE		0x2
+#define VIRTQ_DESC_F_INDIRECT		0x4
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT	0x1
+
+/*
+ * If VIRTIO_RING_F_EVENT_IDX is negotiated then ring[num] is used_event:
+ * the driver wants an interrupt once the used index passes it.
+ */
+struct virtq_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+#define VIRTQ_USED_F_NO_NOTIFY		0x1
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+/*
+ * If VIRTIO_RING_F_EVENT_IDX is negotiated then the u16 after ring[num]
+ * is avail_event: the device wants a notify once the avail index passes
+ * it.
+ */
+struct virtq_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct virtq_used_elem ring[];
+};
+
+/*
+ * Block device feature bits, config space, and requests. A request is a
+ * descriptor chain: a read-only header, the data buffers, and finally a
+ * single device writable status byte.
+ */
+#define VIRTIO_BLK_F_SIZE_MAX		1
+#define VIRTIO_BLK_F_SEG_MAX		2
+#define VIRTIO_BLK_F_RO			5
+#define VIRTIO_BLK_F_BLK_SIZE		6
+#define VIRTIO_BLK_F_FLUSH		9
+
+#define VIRTIO_BLK_CFG_CAPACITY_LO	0x00
+#define VIRTIO_BLK_CFG_CAPACITY_HI	0x04
+#define VIRTIO_BLK_CFG_SIZE_MAX		0x08
+#define VIRTIO_BLK_CFG_SEG_MAX		0x0c
+#define VIRTIO_BLK_CFG_GEOMETRY		0x10
+#define VIRTIO_BLK_CFG_BLK_SIZE		0x14
+#define VIRTIO_BLK_CFG_MAX		0x18
+
+#define VIRTIO_BLK_SECTOR_SIZE		512
+
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+#define VIRTIO_BLK_T_GET_ID		8
+
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_BLK_S_IOERR		1
+#define VIRTIO_BLK_S_UNSUPP		2
+
+#define VIRTIO_BLK_ID_BYTES		20
+
+struct virtio_blk_req_hdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+#endif
@@ -30,13 +30,23 @@
 #define VSYS_IO_SIZE				0xc
 
 /*
- * Timers: each sys will support at least 1 timer. To
- * configure a timer, first specify the interval to wait for
- * in the INTERVAL register. Then write to CONFIG with the
- * desired configration and ACTIVATE set.
+ * Timers: each sys has VSYS_TIMER_NR independent timers. To configure
+ * a timer, first specify the interval to wait for in its INTERVAL
+ * register. Then write to its CONFIG with the desired configuration and
+ * ACTIVATE set; this (re)starts the timer. Writing CONFIG with ACTIVATE
+ * clear stops it.
  *
- * When the timer fires, it will set the interrupt pending
- * bit in the core and will trigger an interrupt.
+ * A one-shot timer fires once, an interval after it was started. A
+ * PERIODIC timer fires every interval until it's stopped; if software
+ * falls behind, missed periods are dropped rather than queued up.
+ *
+ * When a timer fires it sets its bit in VSYS_TIMER_STATUS and sets the
+ * machine timer interrupt pending bit in hart 0. Write 1s to
+ * VSYS_TIMER_STATUS to clear bits.
+ *
+ * Timer n's registers are at VSYS_TIMER_BASE(n). The original single
+ * timer registers, VSYS_TIMER_CONFIG and VSYS_TIMER_INTERVAL, are
+ * aliases of timer 0's.
  */
 #define VSYS_TIMER_CONFIG			0x10
 #define VSYS_TIMER_CONFIG_PRECISION		1:0
@@ -45,6 +55,8 @@
 #define VSYS_TIMER_CONFIG_PRECISION_USECS	2
 #define VSYS_TIMER_CONFIG_PRECISION_NSECS	3
 
+#define VSYS_TIMER_CONFIG_PERIODIC		2:2
+
 #define VSYS_TIMER_CONFIG_ACTIVATE		31:31
 #define VSYS_TIMER_CONFIG_ACTIVATE_TRIGGER	1
 
@@ -53,10 +65,18 @@
 
 /*
  * A non-zero write to this register will trigger a SW
- * interrupt in machine mode.
+ * interrupt in machine mode on hart 0.
  */
 #define VSYS_M_SW_INTERRUPT			0x20
 
-#define VSYS_MAX_REG				0x30
+#define VSYS_TIMER_STATUS			0x30
+#define VSYS_TIMER_NR_TIMERS			0x34
+
+#define VSYS_TIMER_NR				8
+#define VSYS_TIMER_BASE(n)			(0x40 + (n) * 0x10)
+#define VSYS_TIMERn_CONFIG			0x0
+#define VSYS_TIMERn_INTERVAL			0x4
+
+#define VSYS_MAX_REG				VSYS_TIMER_BASE(VSYS_TIMER_NR)
 
 #endif
@@ -22,11 +22,46 @@
 #define __R5SIM_HW_VUART_H__
 
 /*
- * Trivial UART mock: loads to offset VUART_READ will read a character
- * and stores to VUART_WRITE will write a character to the "UART".
+ * Simple FIFO based UART. Stores to VUART_WRITE push a character into the
+ * TX FIFO and loads from VUART_READ pop a character from the RX FIFO; the
+ * host moves data between the FIFOs and the outside world in the
+ * background.
+ *
+ * VUART_READ never blocks: if the RX FIFO is empty it returns 0 with the
+ * VALID bit clear. VUART_RX_COUNT is the number of characters waiting to
+ * be read and VUART_TX_SPACE the room left in the TX FIFO. A store to
+ * VUART_WRITE with the TX FIFO full stalls until there's room, so simple
+ * software can ignore VUART_TX_SPACE altogether.
+ *
+ * If enabled in VUART_IRQ_ENABLE the UART sets the matching
+ * VUART_IRQ_STATUS bit and asserts its PLIC source (see plic.h) when the
+ * RX FIFO goes from empty to non-empty (RX) and when the TX FIFO has
+ * been completely drained (TX_EMPTY). Write 1s to VUART_IRQ_STATUS to
+ * clear bits; the source stays asserted until every bit is clear.
  */
 
-#define VUART_READ	0x0
-#define VUART_WRITE	0x4
+#define VUART_READ		0x0
+#define VUART_READ_DATA		7:0
+#define VUART_READ_VALID	8:8
+
+#define VUART_WRITE		0x4
+
+#define VUART_RX_COUNT		0x8
+#define VUART_TX_SPACE		0xc
+
+#define VUART_IRQ_ENABLE	0x10
+#define VUART_IRQ_ENABLE_RX	0:0
+#define VUART_IRQ_ENABLE_TX_EMPTY	1:1
+
+#define VUART_IRQ_STATUS	0x14
+#define VUART_IRQ_STATUS_RX	0:0
+#define VUART_IRQ_STATUS_TX_EMPTY	1:1
+
+#define VUART_MAX_REG		0x18
+
+/*
+ * Both FIFOs are this deep.
+ */
+#define VUART_FIFO_SIZE		4096
 
 #endif
@@ -0,0 +1,84 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Host IO event loop. Each machine has one thread that waits (with epoll)
+ * on all of the host fds its devices care about - ptys, sockets, timerfds,
+ * etc - and calls back into the device when one is ready. Devices can also
+ * post work to the loop thread from any thread without taking a lock.
+ */
+
+#ifndef __R5SIM_IOLOOP_H__
+#define __R5SIM_IOLOOP_H__
+
+#include <pthread.h>
+
+#include <r5sim/env.h>
+
+struct r5sim_ioloop;
+
+/*
+ * A host fd being watched by the loop. func is called on the loop thread
+ * with the ready events (EPOLLIN, EPOLLOUT, etc).
+ */
+struct r5sim_io_handler {
+	int               fd;
+	void            (*func)(struct r5sim_io_handler *h, u32 events);
+	void             *priv;
+};
+
+/*
+ * A piece of work to run on the loop thread. A work item may be posted
+ * again before it has run; it'll still only run once.
+ */
+struct r5sim_io_work {
+	void            (*func)(struct r5sim_io_work *w);
+	void             *priv;
+
+	struct r5sim_io_work *next;
+	u32               pending;
+};
+
+/*
+ * Make a new loop and start its thread. If cpu is not negative then the
+ * loop thread (and any thread passed to r5sim_ioloop_pin()) is pinned to
+ * that host CPU.
+ */
+struct r5sim_ioloop *r5sim_ioloop_new(int cpu);
+
+/*
+ * Add, change, or remove a handler. These may be called from any thread.
+ * Returns non-zero if the fd can't be watched; e.g regular files can't
+ * be.
+ */
+int  r5sim_ioloop_add(struct r5sim_ioloop *loop,
+		      struct r5sim_io_handler *h, u32 events);
+int  r5sim_ioloop_mod(struct r5sim_ioloop *loop,
+		      struct r5sim_io_handler *h, u32 events);
+void r5sim_ioloop_del(struct r5sim_ioloop *loop,
+		      struct r5sim_io_handler *h);
+
+/*
+ * Queue work for the loop thread. Lock free; safe to call from the core.
+ */
+void r5sim_ioloop_post(struct r5sim_ioloop *loop, struct r5sim_io_work *w);
+
+/*
+ * Pin another host IO thread (e.g a disk worker) to the loop's CPU.
+ */
+void r5sim_ioloop_pin(struct r5sim_ioloop *loop, pthread_t thread);
+
+#endif
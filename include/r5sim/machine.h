@@ -27,6 +27,9 @@
 #include <r5sim/list.h>
 
 struct r5sim_core;
+struct r5sim_ioloop;
+struct r5sim_event_queue;
+struct r5sim_plic;
 
 /*
  * Define a limited number of breakpoints. _each_ instruction has to check
@@ -34,6 +37,18 @@ struct r5sim_core;
  */
 #define BREAKPOINT_NR		4
 
+/*
+ * Most harts a machine can have.
+ */
+#define R5SIM_MAX_HARTS		32
+
+/*
+ * LR/SC reservation granules: 64 bytes each, hashed into a table of
+ * generation counters (see simple_core.c).
+ */
+#define R5SIM_RESV_SHIFT	6
+#define R5SIM_RESV_GRANULES	1024
+
 /*
  * Memory access results. These mean nothing to the code running on a
  * simulator. They need to be translated to relevant TRAPs before passing
@@ -44,7 +59,26 @@ struct r5sim_core;
 #define __ACCESS_FAULT		-2
 
 /*
- * Define a "machine". This is a single core - for now - and some memory.
+ * A region of host memory mapped directly into the machine's physical
+ * address space; e.g a VDISK aperture. Loads and stores that hit the
+ * region go straight to the host memory backing it.
+ */
+struct r5sim_mem_region {
+	const char       *name;
+
+	u32               base;
+	u32               size;
+	u8               *mem;
+
+	u32               flags;
+#define R5SIM_MEM_READ	  0x1
+#define R5SIM_MEM_WRITE	  0x2
+
+	struct list_head  region_node;
+};
+
+/*
+ * Define a "machine". This is one or more cores (harts) and some memory.
  * Define several function pointers for accessing memory, device memory,
  * etc.
  */
@@ -68,7 +102,42 @@ struct r5sim_machine {
 	volatile int       debug;
 	volatile int       step;
 
+	/*
+	 * Harts; cores[i] has mhartid i. core is hart 0: the hart the
+	 * debugger looks at and steps. Unless the harts share one thread
+	 * (see sched.c) the other harts run on their own threads and wait
+	 * on run_cond while the debugger has the machine.
+	 */
 	struct r5sim_core *core;
+	struct r5sim_core *cores[R5SIM_MAX_HARTS];
+	u32                nr_cores;
+
+	pthread_mutex_t    run_lock;
+	pthread_cond_t     run_cond;
+
+	/*
+	 * Harts found stuck in a loop nothing can break them out of; once
+	 * it's all of them the machine stops.
+	 */
+	u32                nr_hung;
+
+	/*
+	 * Host IO event loop shared by the machine's devices.
+	 */
+	struct r5sim_ioloop *ioloop;
+
+	/*
+	 * Scheduled device events (see event.h) and the soonest deadline.
+	 * On virtual time the core checks event_next as it runs.
+	 */
+	struct r5sim_event_queue *events;
+	u64                  event_next;
+
+	/*
+	 * Interrupt controller the machine's devices raise their
+	 * interrupts through.
+	 */
+	struct r5sim_plic   *plic;
 
 	/*
 	 * Base memory address and size; this is "DRAM".
@@ -128,12 +197,44 @@ struct r5sim_machine {
 			       u32 paddr,
 			       u8 value);
 
+	/*
+	 * Find the host memory backing a word for an atomic access. Only
+	 * DRAM and writable mapped regions support atomics; anything else
+	 * returns __ACCESS_FAULT.
+	 */
+	int       (*mematomic32)(struct r5sim_machine *mach,
+				 u32 paddr,
+				 u32 **ptr);
+
+	/*
+	 * Generation of each reservation granule; bumped by every SC and
+	 * AMO that writes the granule.
+	 */
+	u32    resv_gen[R5SIM_RESV_GRANULES];
+
 	/*
 	 * List of IO devices, e.g UARTs.
 	 */
 	struct list_head io_devs;
+
+	/*
+	 * List of mapped memory regions. These are only checked once an
+	 * access misses DRAM and BROM, so they cost nothing for regular
+	 * memory accesses. Any hart may map or unmap a region, so the list
+	 * is protected by regions_lock; accesses to a region hold it for
+	 * reading across the access.
+	 */
+	struct list_head mem_regions;
+	pthread_rwlock_t regions_lock;
 };
 
+static inline u32 *r5sim_machine_resv_gen(struct r5sim_machine *mach,
+					  u32 paddr)
+{
+	return &mach->resv_gen[(paddr >> R5SIM_RESV_SHIFT) &
+			       (R5SIM_RESV_GRANULES - 1)];
+}
+
 /*
  * Load the default machine; this is a machine that can be used if no
  * other machine is specified and loaded.
@@ -149,10 +250,34 @@ struct r5sim_machine *r5sim_machine_load_default(void);
 void r5sim_machine_load_brom(struct r5sim_machine *mach);
 
 /*
- * Begin machine boot.
+ * Map a region of host memory into the machine's physical address space.
+ * Returns non-zero if the region is not page aligned or overlaps DRAM,
+ * the BROM, the IO aperture, or another mapped region.
+ *
+ * Both are safe to call from any hart. Unmapping waits for loads and
+ * stores already in the region to finish; after it returns the region
+ * struct may be reused. An AMO that looked the region up beforehand may
+ * still land in its memory, so that memory must stay valid for as long
+ * as the machine runs.
+ */
+int  r5sim_machine_map_region(struct r5sim_machine *mach,
+			      struct r5sim_mem_region *region);
+void r5sim_machine_unmap_region(struct r5sim_machine *mach,
+				struct r5sim_mem_region *region);
+
+/*
+ * Begin machine boot. Every hart starts at the base of the BROM; hart 0
+ * runs on the calling thread and each other hart on a thread of its own,
+ * or with a hart quantum all of them take turns on the calling thread.
  */
 void r5sim_machine_run(struct r5sim_machine *mach);
 
+/*
+ * Kick every hart; see r5sim_core_kick(). For device changes software
+ * may be polling for from any hart.
+ */
+void r5sim_machine_kick(struct r5sim_machine *mach);
+
 /*
  * Display the details for a machine.
  */
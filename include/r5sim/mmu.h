@@ -97,6 +97,13 @@ struct r5sim_mmu {
 		       u32 addr, u16 value);
 	int (*store32)(struct r5sim_mmu *mmu,
 		       u32 addr, u32 value);
+
+	/*
+	 * Host pointer to a word for LR/SC and AMOs; the access must be
+	 * allowed to both load and store.
+	 */
+	int (*atomic32)(struct r5sim_mmu *mmu,
+			u32 addr, u32 **ptr);
 };
 
 void r5sim_mmu_use_default(struct r5sim_core *core);
@@ -0,0 +1,41 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * PLIC interface for devices: devices raise and lower their source line
+ * from whatever thread they run on.
+ */
+
+#ifndef __R5SIM_PLIC_H__
+#define __R5SIM_PLIC_H__
+
+#include <r5sim/env.h>
+
+struct r5sim_plic;
+
+/*
+ * Assert or deassert a source. Raising marks the source pending, unless
+ * it's claimed; both are lock free.
+ *
+ * A device that lowers its line should check its own status again after
+ * lowering and raise it again if needed, so that an event racing with
+ * the lower isn't lost.
+ */
+void r5sim_plic_raise(struct r5sim_plic *plic, u32 src);
+void r5sim_plic_lower(struct r5sim_plic *plic, u32 src);
+
+#endif
@@ -25,6 +25,6 @@ struct r5sim_core;
 struct r5sim_machine;
 
 struct r5sim_core *r5sim_simple_core_instance(
-	struct r5sim_machine *mach);
+	struct r5sim_machine *mach, u32 hartid);
 
 #endif
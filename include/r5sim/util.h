@@ -57,6 +57,18 @@ static inline uint64_t sign_extend_64(uint64_t r, uint64_t sbit)
 		(type *)( (char *)__mptr - offsetof(type,member) );	\
 	})
 
+/*
+ * Tell the host CPU we're spinning.
+ */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
 /*
  * Force the compiler to do this read.
  */
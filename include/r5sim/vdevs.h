@@ -28,12 +28,21 @@ struct r5sim_machine;
 
 struct r5sim_iodev *r5sim_vuart_load_new(
 	struct r5sim_machine *mach,
-	u32 io_offs);
+	u32 io_offs, u32 irq, const char *spec);
 struct r5sim_iodev *r5sim_vsys_load_new(
 	struct r5sim_machine *mach,
 	u32 io_offs);
 struct r5sim_iodev *r5sim_vdisk_load_new(
 	struct r5sim_machine *mach,
-	u32 io_offs, const char *path);
+	u32 io_offs, u32 irq, const char *spec);
+struct r5sim_iodev *r5sim_clint_load_new(
+	struct r5sim_machine *mach,
+	u32 io_offs);
+struct r5sim_iodev *r5sim_vblk_load_new(
+	struct r5sim_machine *mach,
+	u32 io_offs, u32 irq, const char *path);
+struct r5sim_iodev *r5sim_plic_load_new(
+	struct r5sim_machine *mach,
+	u32 io_offs);
 
 #endif
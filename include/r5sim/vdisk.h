@@ -0,0 +1,116 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * VDISK storage backends. A backend moves bytes between host buffers and
+ * a disk file; the VDISK device (and its overlays) sit on top of it.
+ *
+ * Backend read/write calls are only made from the VDISK worker thread,
+ * so backends need no locking of their own.
+ */
+
+#ifndef __R5SIM_VDISK_H__
+#define __R5SIM_VDISK_H__
+
+#include <stdbool.h>
+
+#include <r5sim/env.h>
+
+struct vdisk_backend;
+
+/*
+ * Per disk backend settings; parsed from the -d option string.
+ */
+struct vdisk_backend_args {
+	const char       *backend;
+
+	/*
+	 * pio: size of the page cache and how far to read ahead on a
+	 * miss, both in 4K pages.
+	 */
+	u32               cache_pages;
+	u32               readahead;
+
+	/*
+	 * uring: max number of I/Os in flight.
+	 */
+	u32               queue_depth;
+};
+
+struct vdisk_backend_ops {
+	const char       *name;
+
+	int             (*init)(struct vdisk_backend *be,
+				struct vdisk_backend_args *args);
+
+	/*
+	 * Copy len bytes at disk offset offs to/from buf. Return 0 on
+	 * success. Reads past the end of the file return zeros.
+	 */
+	int             (*read)(struct vdisk_backend *be, void *buf,
+				u64 offs, u64 len);
+	int             (*write)(struct vdisk_backend *be, const void *buf,
+				 u64 offs, u64 len);
+
+	/*
+	 * Make [offs, offs + len) durable; a backend may sync more than
+	 * it's asked to. A no-op for private and anonymous disks.
+	 */
+	int             (*flush)(struct vdisk_backend *be, u64 offs, u64 len);
+
+	/*
+	 * Drop [offs, offs + len): it reads back as zeros and, where the
+	 * filesystem allows, no longer takes up space.
+	 */
+	int             (*discard)(struct vdisk_backend *be,
+				   u64 offs, u64 len);
+};
+
+struct vdisk_backend {
+	const struct vdisk_backend_ops *ops;
+
+	/*
+	 * fd is -1 for an anonymous (in memory only) disk.
+	 */
+	int               fd;
+	u64               size;
+	bool              read_only;
+
+	/*
+	 * Writes stay in this process and are never written to the file.
+	 */
+	bool              private;
+
+	/*
+	 * If the backend keeps the whole disk mapped in host memory then
+	 * this points at it; e.g for apertures.
+	 */
+	u8               *mem;
+
+	void             *priv;
+};
+
+extern const struct vdisk_backend_ops vdisk_mmap_backend;
+extern const struct vdisk_backend_ops vdisk_pio_backend;
+extern const struct vdisk_backend_ops vdisk_uring_backend;
+
+int vdisk_backend_punch(struct vdisk_backend *be, u64 offs, u64 len);
+
+struct vdisk_backend *vdisk_backend_open(const char *path, u64 size,
+					 bool read_only, bool private,
+					 struct vdisk_backend_args *args);
+
+#endif
@@ -0,0 +1,87 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * virtio-mmio transport. Specific virtio devices (e.g the block device)
+ * plug into the transport with a r5sim_virtio_ops; the transport handles
+ * the MMIO registers, the virtqueues, and interrupts.
+ */
+
+#ifndef __R5SIM_VIRTIO_H__
+#define __R5SIM_VIRTIO_H__
+
+#include <stdbool.h>
+
+#include <r5sim/env.h>
+
+struct r5sim_iodev;
+struct r5sim_virtio;
+struct r5sim_machine;
+
+#define R5SIM_VIRTIO_MAX_QUEUES		4
+#define R5SIM_VIRTIO_QUEUE_NUM_MAX	256
+
+/*
+ * One buffer of a descriptor chain, already translated to host memory.
+ * mem is NULL if the buffer isn't entirely in DRAM; devices must fail
+ * any request that would touch such a buffer.
+ */
+struct r5sim_virtio_seg {
+	u8               *mem;
+	u32               len;
+	bool              write;	/* Device writable. */
+};
+
+struct r5sim_virtio_req {
+	u32                      nr_segs;
+	struct r5sim_virtio_seg  segs[R5SIM_VIRTIO_QUEUE_NUM_MAX];
+};
+
+struct r5sim_virtio_ops {
+	u32               device_id;
+	u32               nr_queues;
+
+	/*
+	 * Device specific feature bits; the transport adds its own.
+	 */
+	u64               features;
+
+	/*
+	 * Read from the device config space; offs is relative to
+	 * VIRTIO_MMIO_CONFIG.
+	 */
+	u32             (*config_readl)(struct r5sim_virtio *vio, u32 offs);
+
+	/*
+	 * Handle one request. This is called from the transport's worker
+	 * thread, not the core thread. Returns the number of bytes written
+	 * into the device writable buffers.
+	 */
+	u32             (*handle_req)(struct r5sim_virtio *vio, u32 queue,
+				      struct r5sim_virtio_req *req);
+};
+
+struct r5sim_iodev *r5sim_virtio_mmio_new(
+	struct r5sim_machine *mach,
+	u32 io_offs,
+	u32 irq,
+	const char *name,
+	const struct r5sim_virtio_ops *ops,
+	void *priv);
+
+void *r5sim_virtio_priv(struct r5sim_virtio *vio);
+
+#endif
@@ -0,0 +1,7 @@
+/* AUTOGENERATED from config.py. DO NOT EDIT! */
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+
+#endif
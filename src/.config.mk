@@ -0,0 +1,2 @@
+# AUTOGENERATED from config.py. DO NOT EDIT!
+
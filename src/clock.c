@@ -0,0 +1,160 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Simulator clock; see clock.h.
+ */
+
+#include <time.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define R5SIM_HAVE_TSC
+#endif
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/clock.h>
+
+/*
+ * How long to watch the TSC against CLOCK_MONOTONIC to work out its rate.
+ */
+#define CLOCK_CALIBRATE_NS	20000000
+
+static struct {
+	bool   use_tsc;
+	u64    mono0;
+
+	/*
+	 * ns = ((tsc - tsc0) * mult) >> 32
+	 */
+	u64    tsc0;
+	u64    mult;
+} r5sim_clock;
+
+struct r5sim_vclock r5sim_vclock;
+
+static u64 clock_mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef R5SIM_HAVE_TSC
+/*
+ * Only trust the TSC if it ticks at a constant rate through frequency
+ * changes and idle states.
+ */
+static bool clock_tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return (edx & (1 << 8)) != 0;
+}
+
+static void clock_tsc_calibrate(void)
+{
+	struct timespec spec = { .tv_nsec = CLOCK_CALIBRATE_NS };
+	u64 tsc0, tsc1, mono0, mono1;
+
+	mono0 = clock_mono_ns();
+	tsc0  = __rdtsc();
+	nanosleep(&spec, NULL);
+	mono1 = clock_mono_ns();
+	tsc1  = __rdtsc();
+
+	if (tsc1 <= tsc0 || mono1 <= mono0)
+		return;
+
+	r5sim_clock.mult    = ((unsigned __int128)(mono1 - mono0) << 32) /
+		(tsc1 - tsc0);
+	r5sim_clock.use_tsc = true;
+
+	r5sim_info("Clock: TSC at %llu MHz\n",
+		   (unsigned long long)((tsc1 - tsc0) * 1000 /
+					(mono1 - mono0)));
+}
+#endif
+
+void r5sim_clock_init(void)
+{
+#ifdef R5SIM_HAVE_TSC
+	if (clock_tsc_invariant())
+		clock_tsc_calibrate();
+#endif
+
+	if (!r5sim_clock.use_tsc)
+		r5sim_info("Clock: CLOCK_MONOTONIC\n");
+
+	/*
+	 * Take both starting points together so that the two clocks agree
+	 * as closely as possible.
+	 */
+	r5sim_clock.mono0 = clock_mono_ns();
+#ifdef R5SIM_HAVE_TSC
+	r5sim_clock.tsc0  = __rdtsc();
+#endif
+}
+
+/*
+ * Time is purely a function of what the core does, so runs are
+ * repeatable. A 1.0 rate means 1 instruction per ns; a 1GHz machine.
+ */
+void r5sim_clock_init_virtual(double insns_per_ns)
+{
+	r5sim_assert(insns_per_ns > 0);
+
+	r5sim_vclock.step    = (u64)((double)(1ULL << 32) / insns_per_ns);
+	r5sim_vclock.enabled = true;
+
+	r5sim_info("Clock: virtual, %g instructions per ns\n", insns_per_ns);
+}
+
+void r5sim_clock_skip(u64 ns)
+{
+	if (ns <= r5sim_vclock.ns)
+		return;
+
+	r5sim_vclock.frac = 0;
+	__atomic_store_n(&r5sim_vclock.ns, ns, __ATOMIC_RELAXED);
+}
+
+u64 r5sim_clock_ns(void)
+{
+	if (r5sim_vclock.enabled)
+		return __atomic_load_n(&r5sim_vclock.ns, __ATOMIC_RELAXED);
+
+#ifdef R5SIM_HAVE_TSC
+	if (r5sim_clock.use_tsc)
+		return ((unsigned __int128)(__rdtsc() - r5sim_clock.tsc0) *
+			r5sim_clock.mult) >> 32;
+#endif
+
+	return clock_mono_ns() - r5sim_clock.mono0;
+}
+
+u64 r5sim_clock_to_mono(u64 ns)
+{
+	return r5sim_clock.mono0 + ns;
+}
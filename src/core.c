@@ -30,6 +30,8 @@
 #include <r5sim/core.h>
 #include <r5sim/trap.h>
 #include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
 #include <r5sim/machine.h>
 
 /*
@@ -166,6 +168,13 @@ void __r5sim_core_push_trap(struct r5sim_core *core,
 	r5sim_dbg("    Base: 0x%08x\n", base);
 	r5sim_dbg("    Mode: %s\n", mode ? "vectored" : "direct");
 
+	/*
+	 * A trap breaks any LR/SC sequence, and any TIMEH/TIME pair.
+	 */
+	core->resv_valid = 0;
+	core->time_latched = 0;
+
+	core->idle.dirty = 1;
 	core->priv = priv;
 	core->pc = base;
 }
@@ -242,10 +251,17 @@ void r5sim_core_exec(struct r5sim_machine *mach,
 
 	r5sim_dbg("EXEC @ 0x%08x (%x)\n", core->pc, core->priv);
 
+	core->yield = R5SIM_YIELD_NONE;
+
 	while (1) {
+		u32 pc = core->pc;
 		int trap;
 
-		if (mach->debug && !mach->step)
+		/*
+		 * The debugger only ever steps hart 0; the other harts stay
+		 * stopped.
+		 */
+		if (mach->debug && (!mach->step || core != mach->core))
 			return;
 
 		trap = core->exec_one(mach, core);
@@ -256,8 +272,12 @@ void r5sim_core_exec(struct r5sim_machine *mach,
 		 * just continue on.
 		 *
 		 * Interrupts supercede exceptions. So we do this first.
+		 *
+		 * Only bother working out whether to take an interrupt if
+		 * an enabled one is actually pending.
 		 */
-		if (r5sim_core_handle_intr(core))
+		r5sim_core_intr_sync(core);
+		if ((core->mip & core->mie) && r5sim_core_handle_intr(core))
 			goto inst_done;
 
 		/*
@@ -267,6 +287,8 @@ void r5sim_core_exec(struct r5sim_machine *mach,
 		switch (trap) {
 		case TRAP_ALL_GOOD:
 			r5sim_core_incr(core);
+			if (core->pc <= pc)
+				r5sim_core_backedge(core, pc);
 			goto inst_done;
 		case TRAP_MRET:
 			r5sim_core_incr(core);
@@ -314,10 +336,19 @@ void r5sim_core_exec(struct r5sim_machine *mach,
 		done += 1;
 
 		/*
-		 * If the debugger asks us to run nr instructions, return when
-		 * we hit that number.
+		 * On virtual time the core drives the clock; so it's also
+		 * up to the core to run events as it passes them.
+		 */
+		if (r5sim_clock_virtual() &&
+		    r5sim_clock_tick() >= mach->event_next)
+			r5sim_event_run(mach);
+
+		/*
+		 * If the debugger or the scheduler asks us to run nr
+		 * instructions, return when we hit that number; or, for the
+		 * scheduler, when the hart has nothing to do.
 		 */
-		if (nr && done >= nr)
+		if (nr && (done >= nr || core->yield))
 			return;
 	}
 }
@@ -326,13 +357,20 @@ void r5sim_core_init_common(struct r5sim_core *core)
 {
 	r5sim_core_default_csrs(core);
 
-	clock_gettime(CLOCK_MONOTONIC_COARSE, &core->start);
+	core->time_quantum = r5sim_app_get_args()->time_quantum;
 
 	/*
 	 * Start off in M-mode.
 	 */
 	core->priv = RV_PRIV_M;
 
+	/*
+	 * Look for an idle loop from the first backward branch on.
+	 */
+	core->idle.countdown = 1;
+
+	core->waker = &core->wake;
+
 	/*
 	 * Default MMU implementation; has a PMP and will eventually have
 	 * an page table.
@@ -347,7 +385,7 @@ void r5sim_core_describe(struct r5sim_core *core)
 {
 	int i;
 
-	r5sim_info("Core: %s\n", core->name);
+	r5sim_info("Core: %s (hart %u)\n", core->name, core->hartid);
 	r5sim_info(" PC: 0x%08x\n", core->pc);
 
 	for (i = 0; i < 32; i += 4) {
@@ -524,6 +562,10 @@ const char *r5sim_system_func3_to_str(u32 func3, u32 csr)
 			return "MRET";
 		case 0x105: /* WFI */
 			return "WFI";
+		case 0x00d: /* WRS.NTO */
+			return "WRS.NTO";
+		case 0x01d: /* WRS.STO */
+			return "WRS.STO";
 		}
 	case 0x1: /* CSRRW */
 		return "CSRRW";
@@ -541,3 +583,33 @@ const char *r5sim_system_func3_to_str(u32 func3, u32 csr)
 
 	return "ERR";
 }
+
+const char *r5sim_amo_func5_to_str(u32 func5)
+{
+	switch (func5) {
+	case 0x00: /* AMOADD.W */
+		return "AMOADD.W";
+	case 0x01: /* AMOSWAP.W */
+		return "AMOSWAP.W";
+	case 0x02: /* LR.W */
+		return "LR.W";
+	case 0x03: /* SC.W */
+		return "SC.W";
+	case 0x04: /* AMOXOR.W */
+		return "AMOXOR.W";
+	case 0x08: /* AMOOR.W */
+		return "AMOOR.W";
+	case 0x0c: /* AMOAND.W */
+		return "AMOAND.W";
+	case 0x10: /* AMOMIN.W */
+		return "AMOMIN.W";
+	case 0x14: /* AMOMAX.W */
+		return "AMOMAX.W";
+	case 0x18: /* AMOMINU.W */
+		return "AMOMINU.W";
+	case 0x1c: /* AMOMAXU.W */
+		return "AMOMAXU.W";
+	}
+
+	return "ERR";
+}
@@ -0,0 +1,283 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * Idle loop detection.
+ *
+ * Software often spins in loops that can't get anywhere: a while (1) in
+ * an assert, or polling a busy bit. Rather than burn a host CPU on them
+ * the core looks for a pass round a loop that changes nothing: no stores,
+ * no CSR accesses, no traps, and the same registers at the loop head
+ * before and after. Loads are allowed since that's how software polls;
+ * but since the pass changed nothing, as long as what those loads read
+ * stays the same so will every following pass.
+ *
+ * Once a loop is found idle the core:
+ *
+ *   - On virtual time, jumps the clock to the next event;
+ *   - Stops the hart if the loop does no loads and can't be interrupted,
+ *     since nothing can ever change for it; and the machine once every
+ *     hart has stopped (as does WFI with nothing enabled in mie);
+ *   - Otherwise naps until an interrupt or a device kick.
+ *
+ * Stores from other harts don't kick, so naps start short and double
+ * while the loop stays idle: a spin lock handed over by another hart is
+ * noticed within about as long again as it was waited on.
+ *
+ * Checking a loop means copying the register file, so it's only done
+ * every IDLE_SAMPLE backward branches. That's plenty: a loop that spins
+ * long enough to matter gets checked soon enough.
+ *
+ * Software that knows it's spinning can say so with WRS.NTO/WRS.STO
+ * (Zawrs), which nap the same way.
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <r5sim/log.h>
+#include <r5sim/core.h>
+#include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
+#include <r5sim/machine.h>
+
+#define IDLE_SAMPLE		4096
+
+/*
+ * Not every device change kicks the core, e.g a DMA into DRAM or a store
+ * from another hart; so naps are kept short.
+ */
+#define IDLE_NAP_MIN_NS		1000
+#define IDLE_NAP_NS		1000000
+
+/*
+ * WRS.STO's "short" timeout.
+ */
+#define WRS_STO_NS		10000
+
+static bool idle_can_intr(struct r5sim_core *core)
+{
+	if (!core->mie)
+		return false;
+
+	return core->priv != RV_PRIV_M ||
+		get_field(core->mstatus, CSR_MSTATUS_MIE);
+}
+
+/*
+ * Sleep until kicked or ns have passed. seq is the kick sequence sampled
+ * before the core last looked at anything; so any change since then makes
+ * the futex return straight away.
+ */
+static void idle_nap(struct r5sim_core *core, u32 seq, long ns)
+{
+	struct timespec ts = {
+		.tv_sec  = 0,
+		.tv_nsec = ns,
+	};
+
+	__atomic_store_n(&core->waker->waiting, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &core->waker->seq, FUTEX_WAIT_PRIVATE,
+		seq, &ts, NULL, 0);
+	__atomic_store_n(&core->waker->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Nothing can ever get this hart out of its loop, so stop it for good;
+ * or at least until the debugger takes the machine. Then the hart counts
+ * as running again and goes back round the exec loop, which returns to
+ * the debugger (hart 0) or the hart's thread.
+ */
+void r5sim_core_hung(struct r5sim_core *core)
+{
+	struct r5sim_machine *mach = core->mach;
+
+	if (__atomic_add_fetch(&mach->nr_hung, 1, __ATOMIC_SEQ_CST) ==
+	    mach->nr_cores) {
+		r5sim_err("Core hung @ PC=0x%08x; stopping.\n", core->pc);
+		exit(R5SIM_EXIT_HUNG);
+	}
+
+	r5sim_info("Hart %u hung @ PC=0x%08x; parking it.\n",
+		   core->hartid, core->pc);
+
+	if (core->shared) {
+		core->yield = R5SIM_YIELD_HUNG;
+		return;
+	}
+
+	/*
+	 * SIGTSTP only sets mach->debug and may land on any thread; so nap
+	 * and look rather than wait for it.
+	 */
+	while (!mach->debug)
+		idle_nap(core, __atomic_load_n(&core->waker->seq,
+					       __ATOMIC_SEQ_CST),
+			 IDLE_NAP_NS);
+
+	__atomic_sub_fetch(&mach->nr_hung, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Nap for the loop's current nap length and double it for next time.
+ */
+static void idle_backoff(struct r5sim_core *core, u32 seq)
+{
+	u32 ns = max(core->idle.nap_ns, (u32)IDLE_NAP_MIN_NS);
+
+	idle_nap(core, seq, ns);
+
+	core->idle.nap_ns = min(ns * 2, (u32)IDLE_NAP_NS);
+}
+
+static void idle_wait(struct r5sim_core *core)
+{
+	struct r5sim_machine *mach = core->mach;
+
+	/*
+	 * Leave the debugger's single steps alone.
+	 */
+	if (mach->debug)
+		return;
+
+	if (!core->idle.loaded && !idle_can_intr(core)) {
+		r5sim_core_hung(core);
+		return;
+	}
+
+	/*
+	 * A hart sharing its thread mustn't nap or skip ahead itself; the
+	 * other harts may still have work to do. It hands the rest of its
+	 * quantum back instead.
+	 */
+	if (core->shared) {
+		core->yield = R5SIM_YIELD_IDLE;
+		return;
+	}
+
+	if (r5sim_clock_virtual() && r5sim_event_skip(mach))
+		return;
+
+	idle_backoff(core, core->idle.seq);
+}
+
+static void idle_arm(struct r5sim_core *core, u32 from)
+{
+	core->idle.armed  = 1;
+	core->idle.from   = from;
+	core->idle.to     = core->pc;
+	core->idle.seq    = __atomic_load_n(&core->waker->seq,
+					    __ATOMIC_SEQ_CST);
+	core->idle.dirty  = 0;
+	core->idle.loaded = 0;
+
+	memcpy(core->idle.regs, core->reg_file, sizeof(core->reg_file));
+
+	core->idle.countdown = 1;
+}
+
+void __r5sim_core_idle_check(struct r5sim_core *core, u32 from)
+{
+	if (!core->idle.armed) {
+		idle_arm(core, from);
+		return;
+	}
+
+	if (from != core->idle.from || core->pc != core->idle.to ||
+	    core->idle.dirty ||
+	    memcmp(core->idle.regs, core->reg_file, sizeof(core->reg_file))) {
+		core->idle.armed = 0;
+		core->idle.countdown = IDLE_SAMPLE;
+		core->idle.nap_ns = IDLE_NAP_MIN_NS;
+		return;
+	}
+
+	r5sim_dbg_v("Idle loop @ PC=0x%08x\n", core->pc);
+
+	idle_wait(core);
+
+	/*
+	 * Keep checking every pass while the loop stays idle.
+	 */
+	idle_arm(core, from);
+}
+
+/*
+ * Is the reserved word still what LR loaded?
+ */
+static bool wrs_resv_held(struct r5sim_core *core)
+{
+	u32 val;
+
+	if (!core->resv_valid)
+		return false;
+
+	if (__atomic_load_n(r5sim_machine_resv_gen(core->mach, core->resv_addr),
+			    __ATOMIC_ACQUIRE) != core->resv_gen)
+		return false;
+
+	if (core->mmu.load32(&core->mmu, core->resv_addr, &val))
+		return false;
+
+	return val == core->resv_value;
+}
+
+/*
+ * WRS.NTO/WRS.STO: wait while the reservation holds and no interrupt is
+ * pending; enabled in mie is enough, as with WFI. STO gives up after a
+ * short nap, NTO only once something changes. With no reservation both
+ * return straight away.
+ */
+void r5sim_core_wrs(struct r5sim_core *core, u32 sto)
+{
+	struct r5sim_machine *mach = core->mach;
+	u32 seq;
+
+	core->idle.nap_ns = IDLE_NAP_MIN_NS;
+
+	if (core->shared) {
+		r5sim_core_intr_sync(core);
+		if (!(core->mip & core->mie) && wrs_resv_held(core))
+			core->yield = R5SIM_YIELD_IDLE;
+		return;
+	}
+
+	while (!mach->debug) {
+		seq = __atomic_load_n(&core->waker->seq, __ATOMIC_SEQ_CST);
+
+		r5sim_core_intr_sync(core);
+		if ((core->mip & core->mie) || !wrs_resv_held(core))
+			return;
+
+		if (sto) {
+			idle_nap(core, seq, WRS_STO_NS);
+			return;
+		}
+
+		if (r5sim_clock_virtual() && r5sim_event_skip(mach))
+			continue;
+
+		idle_backoff(core, seq);
+	}
+}
@@ -19,33 +19,59 @@
  *
  * The basic idea here is that when an external interrupt source
  * is ready to signal the core, it calls r5sim_core_intr_signal().
- * This tells the core that there's an itnerrutp pending.
+ * This tells the core that there's an interrupt pending.
  *
- * The core, after each instruction has executed, if interrupts
- * are not masked, checks if there's pending interrupts. If so
- * the oldest interrupt is popped and the core handles the
- * interrupt. A interrupt object is malloc()'ed by the
- * core_signal() function, so the core is expected to free() that
- * interrupt object when it's done with it.
+ * Signals can come from any thread, so they don't touch mip directly;
+ * they're posted, lock free, to core->intr_post. The core, after each
+ * instruction has executed, folds any posts into mip and then, only if
+ * an enabled interrupt is pending, works out whether to take it.
  */
 
-#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include <r5sim/log.h>
 #include <r5sim/core.h>
 #include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
+#include <r5sim/machine.h>
 
 /*
  * Wait for an interrupt.
+ *
+ * Rather than poll MIP the core sleeps on a futex (waker->seq) which
+ * r5sim_core_intr_signal() bumps. Sampling the seq before checking MIP
+ * means a signal that lands in between makes FUTEX_WAIT return straight
+ * away, so no wake up can be lost.
  */
 void r5sim_core_wfi(struct r5sim_core *core)
 {
-	struct timespec spec = {
-		.tv_sec  = 0,
-		.tv_nsec = 500000, /* .5 milliseconds */
-	};
+	u32 seq;
 
-	// volatile typeof(core->mip) *__x = &core->mip;
+	/*
+	 * With nothing enabled in mie no interrupt can wake the hart, e.g
+	 * a BROM parking the harts it doesn't want. Count it as hung so
+	 * that the machine still stops once every other hart has.
+	 */
+	r5sim_core_intr_sync(core);
+	if (!core->mip && !core->mie && !core->mach->debug) {
+		r5sim_core_hung(core);
+		return;
+	}
+
+	/*
+	 * Harts sharing a thread leave the waiting to the scheduler.
+	 */
+	if (core->shared) {
+		r5sim_core_intr_sync(core);
+		if (!core->mip)
+			core->yield = R5SIM_YIELD_WFI;
+		return;
+	}
 
 	/*
 	 * Currently we are working with a single core system where
@@ -56,8 +82,31 @@ void r5sim_core_wfi(struct r5sim_core *core)
 	 * If there's already a pending interrupt, even if masked or at a
 	 * different privilege level, we will break.
 	 */
-	while (!__VOL_READ(core->mip))
-		nanosleep(&spec, NULL);
+	if (r5sim_clock_virtual()) {
+		/*
+		 * On virtual time there's no need to wait for a timer or
+		 * any other event: just jump the clock to it. Only host
+		 * interrupt sources, e.g UART input, need a real wait.
+		 */
+		r5sim_core_intr_sync(core);
+		while (!core->mip && r5sim_event_skip(core->mach))
+			r5sim_core_intr_sync(core);
+	}
+
+	__atomic_store_n(&core->waker->waiting, 1, __ATOMIC_SEQ_CST);
+
+	while (1) {
+		seq = __atomic_load_n(&core->waker->seq, __ATOMIC_SEQ_CST);
+
+		r5sim_core_intr_sync(core);
+		if (core->mip)
+			break;
+
+		syscall(SYS_futex, &core->waker->seq, FUTEX_WAIT_PRIVATE,
+			seq, NULL, NULL, 0);
+	}
+
+	__atomic_store_n(&core->waker->waiting, 0, __ATOMIC_SEQ_CST);
 }
 
 /*
@@ -149,9 +198,116 @@ int r5sim_core_handle_intr(struct r5sim_core *core)
 	return 1;
 }
 
+/*
+ * Post a change to bit src of mip: set it, and drop any earlier clear of
+ * it that the core hasn't seen yet, or vice versa.
+ */
+static void r5sim_core_intr_post(struct r5sim_core *core, u32 src,
+				 bool set)
+{
+	u64 set_bit = 1ULL << src;
+	u64 clr_bit = 1ULL << (src + 32);
+	u64 old = __atomic_load_n(&core->intr_post, __ATOMIC_RELAXED);
+	u64 new;
+
+	do {
+		new = set ? (old | set_bit) & ~clr_bit :
+			(old | clr_bit) & ~set_bit;
+	} while (!__atomic_compare_exchange_n(&core->intr_post, &old, new,
+					      true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+void __r5sim_core_intr_fold(struct r5sim_core *core)
+{
+	u64 post = __atomic_exchange_n(&core->intr_post, 0, __ATOMIC_ACQUIRE);
+
+	core->mip = (core->mip & ~(u32)(post >> 32)) | (u32)post;
+}
+
 void r5sim_core_intr_signal(struct r5sim_core *core, u32 src)
 {
 	r5sim_dbg("Interrupt reported: %u\n", src);
 
-	core->mip |= (1 << src);
+	r5sim_core_intr_post(core, src, true);
+	r5sim_core_kick(core);
+}
+
+/*
+ * Wake the core if it's waiting in WFI or napping in an idle loop. Devices
+ * call this when something software may be polling for changes, e.g a
+ * busy bit dropping.
+ */
+void r5sim_core_kick(struct r5sim_core *core)
+{
+	/*
+	 * Only make the wake syscall if the core is actually waiting.
+	 */
+	__atomic_add_fetch(&core->waker->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&core->waker->waiting, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &core->waker->seq, FUTEX_WAKE_PRIVATE,
+			1, NULL, NULL, 0);
+}
+
+/*
+ * For level triggered sources: the source is no longer asserted.
+ */
+void r5sim_core_intr_clear(struct r5sim_core *core, u32 src)
+{
+	r5sim_dbg("Interrupt cleared: %u\n", src);
+
+	r5sim_core_intr_post(core, src, false);
+}
+
+/*
+ * Drive device dev's level on bit src of mip; the bit is set while any
+ * device's level is. Another device may change the line between our
+ * update and our post, so check again after posting: whoever posts last
+ * then always posts the final state.
+ */
+void r5sim_core_intr_level(struct r5sim_core *core, u32 src,
+			   u32 dev, bool level)
+{
+	u32 *lines = &core->intr_levels[src];
+	u32 now, then;
+
+	if (level)
+		now = __atomic_or_fetch(lines, dev, __ATOMIC_SEQ_CST);
+	else
+		now = __atomic_and_fetch(lines, ~dev, __ATOMIC_SEQ_CST);
+
+	while (1) {
+		r5sim_core_intr_post(core, src, now != 0);
+
+		then = __atomic_load_n(lines, __ATOMIC_SEQ_CST);
+		if ((then != 0) == (now != 0))
+			break;
+
+		now = then;
+	}
+
+	r5sim_dbg("Interrupt %u level: 0x%x\n", src, now);
+
+	if (now)
+		r5sim_core_kick(core);
+}
+
+/*
+ * Software cleared bits in mip. For the VSYS that acks its interrupt; a
+ * line still driven by the CLINT stays pending though. Core thread only,
+ * after any posts have been folded into mip.
+ */
+void r5sim_core_intr_ack(struct r5sim_core *core, u32 bits)
+{
+	u32 src;
+
+	while (bits) {
+		src = __builtin_ffs(bits) - 1;
+		bits &= bits - 1;
+
+		if (__atomic_and_fetch(&core->intr_levels[src],
+				       ~R5SIM_INTR_DEV_VSYS,
+				       __ATOMIC_SEQ_CST))
+			core->mip |= 1U << src;
+	}
 }
@@ -19,12 +19,13 @@
  */
 
 #include <stdlib.h>
-
-#include <time.h>
+#include <pthread.h>
 
 #include <r5sim/env.h>
 #include <r5sim/log.h>
 #include <r5sim/csr.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
 #include <r5sim/mmu.h>
 #include <r5sim/core.h>
 #include <r5sim/util.h>
@@ -92,7 +93,7 @@ static void csr_mideleg_write(struct r5sim_core *core,
 			      struct r5sim_csr *csr,
 			      u32 type, u32 *value)
 {
-	*value &= 0xaa;
+	*value &= 0xaaa;
 
 	switch (type) {
 	case CSR_WRITE:
@@ -118,9 +119,9 @@ static void csr_mie_write(struct r5sim_core *core,
 			  u32 type, u32 *value)
 {
 	/*
-	 * We only support the [MS]SI/[MS]TI interrupts atm.
+	 * We only support the [MS]SI/[MS]TI/[MS]EI interrupts atm.
 	 */
-	const u32 mie_mask = 0xaa;
+	const u32 mie_mask = 0xaaa;
 
 	*value &= mie_mask;
 
@@ -140,6 +141,7 @@ static void csr_mie_write(struct r5sim_core *core,
 static void csr_mip_read(struct r5sim_core *core,
 			 struct r5sim_csr *csr)
 {
+	r5sim_core_intr_sync(core);
 	__raw_csr_write(&core->csr_file[CSR_MIP], core->mip);
 }
 
@@ -148,15 +150,25 @@ static void csr_mip_write(struct r5sim_core *core,
 			  u32 type, u32 *value)
 {
 	/*
-	 * We only support the [MS]SI/[MS]TI interrupts atm.
+	 * We only support the [MS]SI/[MS]TI/[MS]EI interrupts atm. MEIP
+	 * is driven by the PLIC and is read-only; so is STIP with Sstc.
 	 */
-	const u32 mip_mask = 0xaa;
+	u32 mip_mask = 0x2aa;
+
+	if (get_field(core->menvcfgh, CSR_MENVCFGH_STCE))
+		mip_mask &= ~0x20;
 
 	*value &= mip_mask;
 
+	/*
+	 * Fold in any posted interrupts first so that they can't undo
+	 * this write later.
+	 */
+	r5sim_core_intr_sync(core);
+
 	switch (type) {
 	case CSR_WRITE:
-		core->mip = *value;
+		core->mip = (core->mip & ~mip_mask) | *value;
 		break;
 	case CSR_SET:
 		core->mip |= *value;
@@ -165,6 +177,8 @@ static void csr_mip_write(struct r5sim_core *core,
 		core->mip &= ~(*value);
 		break;
 	}
+
+	r5sim_core_intr_ack(core, mip_mask & ~core->mip);
 }
 
 static void csr_sstatus_read(struct r5sim_core *core,
@@ -241,6 +255,7 @@ static void csr_sie_write(struct r5sim_core *core,
 static void csr_sip_read(struct r5sim_core *core,
 			 struct r5sim_csr *csr)
 {
+	r5sim_core_intr_sync(core);
 	__raw_csr_write(&core->csr_file[CSR_SIE],
 			core->mip & core->mideleg);
 }
@@ -249,11 +264,16 @@ static void csr_sip_write(struct r5sim_core *core,
 			  struct r5sim_csr *csr,
 			  u32 type, u32 *value)
 {
-	u32 sip_mask = core->mideleg;
+	u32 sip_mask = core->mideleg & ~0x200;	/* SEIP is the PLIC's. */
 	u32 tmp_ip;
 
+	if (get_field(core->menvcfgh, CSR_MENVCFGH_STCE))
+		sip_mask &= ~0x20;
+
 	*value &= sip_mask;
 
+	r5sim_core_intr_sync(core);
+
 	switch (type) {
 	case CSR_WRITE:
 		tmp_ip = core->mip & ~sip_mask;
@@ -269,35 +289,179 @@ static void csr_sip_write(struct r5sim_core *core,
 }
 
 /*
- * Timer callback so that the CSR timer function can get the host system
- * time. This generates a time in nanoseconds which is stored into the
- * TIME and TIMEH CSRs.
- *
- * The subsequent reads will then pull out this computed value from the
- * CSR file.
+ * Sample the simulator clock for the TIME CSRs; no syscall is made (see
+ * clock.h). If a time quantum is set the previous sample is reused until
+ * that many instructions have retired, trading accuracy for even cheaper
+ * reads.
+ */
+static u64 r5sim_csr_time_sample(struct r5sim_core *core)
+{
+	u32 cycle = core->csr_file[CSR_CYCLE].value;
+
+	if (core->time_quantum == 0 ||
+	    cycle - core->time_cycle >= core->time_quantum) {
+		core->time_ns = r5sim_clock_ns();
+		core->time_cycle = cycle;
+	}
+
+	return core->time_ns;
+}
+
+/*
+ * Reading TIMEH latches the full 64 bit time; a TIME read by the very
+ * next instruction returns the low half of that same value. So the usual
+ * rdtimeh, rdtime, rdtimeh sequence costs at most two clock reads and
+ * can't tear unless the high half really did change. Any other TIME read
+ * (or one after a trap) samples the clock again; otherwise the last
+ * rdtimeh of that sequence would leave a stale low half behind.
  */
+static void r5sim_csr_timeh(struct r5sim_core *core,
+			    struct r5sim_csr *csr)
+{
+	u64 ns = r5sim_csr_time_sample(core);
+
+	core->time_latched = 1;
+	core->time_latch_instret = core->csr_file[CSR_INSTRET].value;
+
+	__raw_csr_write(&core->csr_file[CSR_TIME], (u32)ns);
+	__raw_csr_write(&core->csr_file[CSR_TIMEH], (u32)(ns >> 32));
+}
+
 static void r5sim_csr_time(struct r5sim_core *core,
 			   struct r5sim_csr *csr)
 {
-	long nsecs;
-	time_t secs;
-	uint64_t delta_ns;
-	struct timespec now;
+	u64 ns;
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (core->time_latched) {
+		core->time_latched = 0;
+		if (core->csr_file[CSR_INSTRET].value ==
+		    core->time_latch_instret + 1)
+			return;
+	}
+
+	ns = r5sim_csr_time_sample(core);
 
-	nsecs = now.tv_nsec - core->start.tv_nsec;
-	secs = now.tv_sec - core->start.tv_sec;
+	__raw_csr_write(&core->csr_file[CSR_TIME], (u32)ns);
+	__raw_csr_write(&core->csr_file[CSR_TIMEH], (u32)(ns >> 32));
+}
 
-	if (nsecs < 0) {
-		secs = secs - 1;
-		nsecs += 1000000000;
+/*
+ * Sstc: work out whether STI should be pending now; if not, schedule the
+ * stimer event for when it should be. Called from both the core and the
+ * event, just like the CLINT's mtimecmp. Caller holds stimer_lock.
+ */
+static void __csr_stimer_update(struct r5sim_core *core)
+{
+	u64 cmp;
+
+	cmp = __atomic_load_n(&core->stimecmp, __ATOMIC_ACQUIRE);
+
+	if (!get_field(__atomic_load_n(&core->menvcfgh, __ATOMIC_ACQUIRE),
+		       CSR_MENVCFGH_STCE)) {
+		cmp = R5SIM_EVENT_NEVER;
+	} else if (r5sim_clock_ns() >= cmp) {
+		r5sim_core_intr_signal(core, CSR_MCAUSE_CODE_STI);
+		cmp = R5SIM_EVENT_NEVER;
 	}
 
-	delta_ns = secs * 1000000000 + nsecs;
+	r5sim_event_schedule(&core->stimer, cmp);
+}
 
-	__raw_csr_write(&core->csr_file[CSR_TIME], (u32)delta_ns);
-	__raw_csr_write(&core->csr_file[CSR_TIMEH], (u32)(delta_ns >> 32));
+static void csr_stimer_update(struct r5sim_core *core)
+{
+	pthread_mutex_lock(&core->stimer_lock);
+	__csr_stimer_update(core);
+	pthread_mutex_unlock(&core->stimer_lock);
+}
+
+static void csr_stimer_expired(struct r5sim_event *ev)
+{
+	csr_stimer_update(ev->priv);
+}
+
+static void csr_menvcfgh_read(struct r5sim_core *core,
+			      struct r5sim_csr *csr)
+{
+	__raw_csr_write(csr, core->menvcfgh);
+}
+
+static void csr_menvcfgh_write(struct r5sim_core *core,
+			       struct r5sim_csr *csr,
+			       u32 type, u32 *value)
+{
+	u32 menvcfgh = core->menvcfgh;
+
+	/*
+	 * Only STCE is implemented.
+	 */
+	*value &= 0x80000000;
+
+	switch (type) {
+	case CSR_WRITE:
+		menvcfgh = *value;
+		break;
+	case CSR_SET:
+		menvcfgh |= *value;
+		break;
+	case CSR_CLR:
+		menvcfgh &= ~(*value);
+		break;
+	}
+
+	__atomic_store_n(&core->menvcfgh, menvcfgh, __ATOMIC_RELEASE);
+
+	csr_stimer_update(core);
+}
+
+static void csr_stimecmp_read(struct r5sim_core *core,
+			      struct r5sim_csr *csr)
+{
+	if (r5sim_csr_index(core, csr) == CSR_STIMECMP)
+		__raw_csr_write(csr, (u32)core->stimecmp);
+	else
+		__raw_csr_write(csr, (u32)(core->stimecmp >> 32));
+}
+
+static void csr_stimecmp_write(struct r5sim_core *core,
+			       struct r5sim_csr *csr,
+			       u32 type, u32 *value)
+{
+	u32 half = __raw_csr_read(csr);
+	u64 cmp = core->stimecmp;
+
+	switch (type) {
+	case CSR_WRITE:
+		half = *value;
+		break;
+	case CSR_SET:
+		half |= *value;
+		break;
+	case CSR_CLR:
+		half &= ~(*value);
+		break;
+	}
+
+	if (r5sim_csr_index(core, csr) == CSR_STIMECMP)
+		cmp = (cmp & ~0xffffffffULL) | half;
+	else
+		cmp = (cmp & 0xffffffffULL) | ((u64)half << 32);
+
+	/*
+	 * STIP follows stimecmp: moving it into the future clears it. Do it
+	 * all under the lock, as the CLINT does for mtimecmp, so an event
+	 * that saw the old, passed stimecmp can't post STI after the clear.
+	 */
+	pthread_mutex_lock(&core->stimer_lock);
+
+	__atomic_store_n(&core->stimecmp, cmp, __ATOMIC_RELEASE);
+
+	if (get_field(core->menvcfgh, CSR_MENVCFGH_STCE) &&
+	    r5sim_clock_ns() < cmp)
+		r5sim_core_intr_clear(core, CSR_MCAUSE_CODE_STI);
+
+	__csr_stimer_update(core);
+
+	pthread_mutex_unlock(&core->stimer_lock);
 }
 
 void __r5sim_core_add_csr(struct r5sim_core *core,
@@ -317,16 +481,16 @@ void r5sim_core_default_csrs(struct r5sim_core *core)
 	r5sim_core_add_csr(core, CSR_INSTRET,	0x0, CSR_F_READ);
 
 	r5sim_core_add_csr_fn(core, CSR_TIME,	0x0, CSR_F_READ, r5sim_csr_time, NULL);
-	r5sim_core_add_csr_fn(core, CSR_TIMEH,	0x0, CSR_F_READ, r5sim_csr_time, NULL);
+	r5sim_core_add_csr_fn(core, CSR_TIMEH,	0x0, CSR_F_READ, r5sim_csr_timeh, NULL);
 
 	/*
 	 * Machine mode CSRs.
 	 */
-	r5sim_core_add_csr(core, CSR_MISA,		0x40001100,	CSR_F_READ);
+	r5sim_core_add_csr(core, CSR_MISA,		0x40001101,	CSR_F_READ);
 	r5sim_core_add_csr(core, CSR_MVENDORID,		0x0,		CSR_F_READ);
 	r5sim_core_add_csr(core, CSR_MARCHID,		0x0,		CSR_F_READ);
 	r5sim_core_add_csr(core, CSR_MIMPID,		0x0,		CSR_F_READ);
-	r5sim_core_add_csr(core, CSR_MHARTID,		0x0,		CSR_F_READ);
+	r5sim_core_add_csr(core, CSR_MHARTID,		core->hartid,	CSR_F_READ);
 
 	r5sim_core_add_csr_fn(core, CSR_MSTATUS,	0x0,		CSR_F_READ|CSR_F_WRITE, csr_mstatus_read, csr_mstatus_write);
 	r5sim_core_add_csr_fn(core, CSR_MIE,		0x0,		CSR_F_READ|CSR_F_WRITE, csr_mie_read, csr_mie_write);
@@ -340,6 +504,9 @@ void r5sim_core_default_csrs(struct r5sim_core *core)
 	r5sim_core_add_csr(core, CSR_MCAUSE,		0x0,		CSR_F_READ|CSR_F_WRITE);
 	r5sim_core_add_csr(core, CSR_MTVAL,		0x0,		CSR_F_READ|CSR_F_WRITE);
 
+	r5sim_core_add_csr(core, CSR_MENVCFG,		0x0,		CSR_F_READ);
+	r5sim_core_add_csr_fn(core, CSR_MENVCFGH,	0x0,		CSR_F_READ|CSR_F_WRITE, csr_menvcfgh_read, csr_menvcfgh_write);
+
 	/*
 	 * Supervisor CSRs.
 	 */
@@ -353,6 +520,13 @@ void r5sim_core_default_csrs(struct r5sim_core *core)
 	r5sim_core_add_csr(core, CSR_SCAUSE,		0x0,		CSR_F_READ|CSR_F_WRITE);
 	r5sim_core_add_csr(core, CSR_STVAL,		0x0,		CSR_F_READ|CSR_F_WRITE);
 
+	r5sim_core_add_csr_fn(core, CSR_STIMECMP,	0x0,		CSR_F_READ|CSR_F_WRITE, csr_stimecmp_read, csr_stimecmp_write);
+	r5sim_core_add_csr_fn(core, CSR_STIMECMPH,	0x0,		CSR_F_READ|CSR_F_WRITE, csr_stimecmp_read, csr_stimecmp_write);
+
+	core->stimecmp = ~0ULL;
+	pthread_mutex_init(&core->stimer_lock, NULL);
+	r5sim_event_init(core->mach, &core->stimer, csr_stimer_expired, core);
+
 	/*
 	 * The PMP address registers.
 	 */
@@ -406,6 +580,14 @@ struct r5sim_csr *__csr_always(struct r5sim_core *core, u32 rd, u32 csr)
 	if (get_field(csr, CSR_PRIV_FIELD) > core->priv)
 		return NULL;
 
+	/*
+	 * Below M-mode Sstc's CSRs are only there once M-mode enables them.
+	 */
+	if ((csr == CSR_STIMECMP || csr == CSR_STIMECMPH) &&
+	    core->priv != RV_PRIV_M &&
+	    !get_field(core->menvcfgh, CSR_MENVCFGH_STCE))
+		return NULL;
+
 	if ((csr_reg->flags & CSR_F_READ) != 0) {
 		if (csr_reg->read_fn)
 			csr_reg->read_fn(core, csr_reg);
@@ -0,0 +1,241 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * CLINT: mtime, and mtimecmp and msip for each hart. mtime comes straight
+ * from the simulator clock, so polling it costs no syscalls; each hart's
+ * mtimecmp is backed by an event on the machine's event queue.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/csr.h>
+#include <r5sim/core.h>
+#include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
+#include <r5sim/iodev.h>
+#include <r5sim/machine.h>
+
+#include <r5sim/hw/clint.h>
+
+#define clint_dbg r5sim_dbg_v
+
+struct clint_hart {
+	struct r5sim_core      *core;
+
+	/*
+	 * The MSIP register; it drives the hart's MSI line. Any hart may
+	 * write it.
+	 */
+	u32                     msip;
+
+	/*
+	 * Written by the core, read by the timer event. The lock makes sure
+	 * the event is always left scheduled for the latest mtimecmp.
+	 */
+	u64                     mtimecmp;
+	pthread_mutex_t         lock;
+
+	struct r5sim_event      timer;
+};
+
+struct clint_priv {
+	u32                     nr_harts;
+	struct clint_hart       harts[R5SIM_MAX_HARTS];
+};
+
+/*
+ * Work out whether MTI should be pending now; if not, schedule the timer
+ * event for when it should be. Called from both the core and the event.
+ *
+ * With the host clock the event may run a touch early; in that case it's
+ * just rescheduled.
+ */
+static void clint_update(struct clint_hart *hart)
+{
+	u64 cmp;
+
+	pthread_mutex_lock(&hart->lock);
+
+	cmp = __atomic_load_n(&hart->mtimecmp, __ATOMIC_ACQUIRE);
+
+	if (r5sim_clock_ns() >= cmp) {
+		r5sim_core_intr_level(hart->core, CSR_MCAUSE_CODE_MTI,
+				      R5SIM_INTR_DEV_CLINT, true);
+		cmp = R5SIM_EVENT_NEVER;
+	}
+
+	r5sim_event_schedule(&hart->timer, cmp);
+
+	pthread_mutex_unlock(&hart->lock);
+}
+
+static void clint_timer_expired(struct r5sim_event *ev)
+{
+	clint_update(ev->priv);
+}
+
+static void clint_write_mtimecmp(struct clint_hart *hart, u32 hi, u32 val)
+{
+	u64 cmp;
+
+	/*
+	 * Harts only ever write their own mtimecmp in practice; the lock
+	 * keeps two writers from mixing their halves if they don't.
+	 */
+	pthread_mutex_lock(&hart->lock);
+
+	cmp = hart->mtimecmp;
+	if (!hi)
+		cmp = (cmp & ~0xffffffffULL) | val;
+	else
+		cmp = (cmp & 0xffffffffULL) | ((u64)val << 32);
+
+	__atomic_store_n(&hart->mtimecmp, cmp, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&hart->lock);
+
+	/*
+	 * MTIP follows mtimecmp: moving it into the future drops the
+	 * CLINT's level. A VSYS timer may still be holding MTI up.
+	 */
+	if (r5sim_clock_ns() < cmp)
+		r5sim_core_intr_level(hart->core, CSR_MCAUSE_CODE_MTI,
+				      R5SIM_INTR_DEV_CLINT, false);
+
+	clint_update(hart);
+}
+
+static void clint_write_msip(struct clint_hart *hart, u32 val)
+{
+	__atomic_store_n(&hart->msip, get_field(val, CLINT_MSIP_PENDING),
+			 __ATOMIC_RELAXED);
+
+	r5sim_core_intr_level(hart->core, CSR_MCAUSE_CODE_MSI,
+			      R5SIM_INTR_DEV_CLINT,
+			      get_field(val, CLINT_MSIP_PENDING));
+}
+
+/*
+ * Find the hart whose MSIP or MTIMECMP lives at offs; NULL for MTIME or
+ * harts the machine doesn't have.
+ */
+static struct clint_hart *clint_offs_to_hart(struct clint_priv *clint,
+					     u32 offs)
+{
+	u32 h;
+
+	if (offs < CLINT_MTIMECMP_LO(0))
+		h = offs / 4;
+	else if (offs < CLINT_MTIME_LO)
+		h = (offs - CLINT_MTIMECMP_LO(0)) / 8;
+	else
+		return NULL;
+
+	return h < clint->nr_harts ? &clint->harts[h] : NULL;
+}
+
+static u32 clint_readl(struct r5sim_iodev *iodev, u32 offs)
+{
+	struct clint_priv *clint = iodev->priv;
+	struct clint_hart *hart = clint_offs_to_hart(clint, offs);
+	u64 cmp;
+
+	switch (offs) {
+	case CLINT_MTIME_LO:
+		return (u32)r5sim_clock_ns();
+	case CLINT_MTIME_HI:
+		return (u32)(r5sim_clock_ns() >> 32);
+	}
+
+	if (!hart)
+		return 0x0;
+
+	if (offs < CLINT_MTIMECMP_LO(0))
+		return __atomic_load_n(&hart->msip, __ATOMIC_RELAXED);
+
+	cmp = __atomic_load_n(&hart->mtimecmp, __ATOMIC_ACQUIRE);
+
+	return offs & 0x4 ? (u32)(cmp >> 32) : (u32)cmp;
+}
+
+static void clint_writel(struct r5sim_iodev *iodev, u32 offs, u32 val)
+{
+	struct clint_priv *clint = iodev->priv;
+	struct clint_hart *hart = clint_offs_to_hart(clint, offs);
+
+	clint_dbg("CLINT: STORE @ 0x%04x v=0x%08x\n", offs, val);
+
+	if (!hart)
+		return;
+
+	if (offs < CLINT_MTIMECMP_LO(0)) {
+		clint_write_msip(hart, val);
+		return;
+	}
+
+	clint_write_mtimecmp(hart, offs & 0x4, val);
+}
+
+static struct r5sim_iodev clint_dev = {
+	.name      = "clint",
+
+	.io_size   = CLINT_SIZE,
+
+	.readl     = clint_readl,
+	.writel    = clint_writel,
+};
+
+struct r5sim_iodev *r5sim_clint_load_new(struct r5sim_machine *mach,
+					 u32 io_offs)
+{
+	struct r5sim_iodev *dev;
+	struct clint_priv *priv;
+	u32 i;
+
+	dev = malloc(sizeof(*dev));
+	r5sim_assert(dev != NULL);
+
+	priv = calloc(1, sizeof(*priv));
+	r5sim_assert(priv != NULL);
+
+	*dev = clint_dev;
+
+	dev->mach = mach;
+	dev->io_offset = io_offs;
+	dev->priv = priv;
+
+	priv->nr_harts = mach->nr_cores;
+
+	for (i = 0; i < priv->nr_harts; i++) {
+		struct clint_hart *hart = &priv->harts[i];
+
+		hart->core     = mach->cores[i];
+		hart->mtimecmp = ~0ULL;
+		pthread_mutex_init(&hart->lock, NULL);
+
+		r5sim_event_init(mach, &hart->timer,
+				 clint_timer_expired, hart);
+	}
+
+	r5sim_info("CLINT @ 0x%x: %u hart(s)\n", io_offs, priv->nr_harts);
+
+	return dev;
+}
@@ -0,0 +1,386 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * PLIC: routes device interrupts to the harts' external interrupt lines.
+ *
+ * Sources are bits in 64 bit words, and each priority level keeps a mask
+ * of the sources set to it. A claim ANDs the pending, enable and level
+ * masks from the top priority down to the threshold and takes the lowest
+ * set bit; so it's a handful of word operations however many sources are
+ * pending.
+ *
+ * Devices raise sources from their own threads with atomics; everything
+ * else is only touched by the harts through the registers, and the lock
+ * keeps them from racing each other, e.g two harts claiming the same
+ * source.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/csr.h>
+#include <r5sim/core.h>
+#include <r5sim/plic.h>
+#include <r5sim/util.h>
+#include <r5sim/iodev.h>
+#include <r5sim/machine.h>
+
+#include <r5sim/hw/plic.h>
+
+#define plic_dbg r5sim_dbg_v
+
+#define PLIC_NR_CONTEXTS	(2 * R5SIM_MAX_HARTS)
+#define PLIC_NR_WORDS		(PLIC_NR_SOURCES / 32)
+
+struct plic_context {
+	struct r5sim_core      *core;
+	u32                     cause;
+
+	u64                     enable;
+	u32                     threshold;
+};
+
+struct r5sim_plic {
+	/*
+	 * Source masks; asserted is the level of each device's line.
+	 */
+	u64                     pending;
+	u64                     asserted;
+	u64                     claimed;
+
+	u32                     priority[PLIC_NR_SOURCES];
+	u64                     prio_mask[PLIC_PRIORITY_MAX + 1];
+
+	pthread_mutex_t         lock;
+
+	u32                     nr_ctx;
+	struct plic_context     ctx[PLIC_NR_CONTEXTS];
+};
+
+/*
+ * Best source for a context to claim, or 0.
+ */
+static u32 plic_best(struct r5sim_plic *plic, struct plic_context *ctx)
+{
+	u64 pending = __atomic_load_n(&plic->pending, __ATOMIC_SEQ_CST);
+	u32 threshold = __atomic_load_n(&ctx->threshold, __ATOMIC_RELAXED);
+	u32 prio;
+
+	pending &= __atomic_load_n(&ctx->enable, __ATOMIC_RELAXED);
+	if (!pending)
+		return 0;
+
+	for (prio = PLIC_PRIORITY_MAX; prio > threshold; prio--) {
+		u64 mask = pending &
+			__atomic_load_n(&plic->prio_mask[prio],
+					__ATOMIC_RELAXED);
+
+		if (mask)
+			return __builtin_ctzll(mask);
+	}
+
+	return 0;
+}
+
+/*
+ * Signal every context with something to claim. Only called from device
+ * threads, which never take interrupts away.
+ */
+static void plic_notify(struct r5sim_plic *plic)
+{
+	u32 i;
+
+	for (i = 0; i < plic->nr_ctx; i++) {
+		struct plic_context *ctx = &plic->ctx[i];
+
+		if (plic_best(plic, ctx))
+			r5sim_core_intr_signal(ctx->core, ctx->cause);
+	}
+}
+
+/*
+ * Recompute every context's line from a hart. Clear first and check
+ * again after: a device may raise a source between the check and the
+ * clear, and its signal must not be undone.
+ */
+static void plic_update(struct r5sim_plic *plic)
+{
+	u32 i;
+
+	for (i = 0; i < plic->nr_ctx; i++) {
+		struct plic_context *ctx = &plic->ctx[i];
+
+		if (plic_best(plic, ctx)) {
+			r5sim_core_intr_signal(ctx->core, ctx->cause);
+			continue;
+		}
+
+		r5sim_core_intr_clear(ctx->core, ctx->cause);
+
+		if (plic_best(plic, ctx))
+			r5sim_core_intr_signal(ctx->core, ctx->cause);
+	}
+}
+
+void r5sim_plic_raise(struct r5sim_plic *plic, u32 src)
+{
+	u64 bit = 1ULL << src;
+	u64 old;
+
+	__atomic_or_fetch(&plic->asserted, bit, __ATOMIC_SEQ_CST);
+
+	/*
+	 * A claimed source goes pending when it's completed if it's still
+	 * asserted then.
+	 */
+	if (__atomic_load_n(&plic->claimed, __ATOMIC_SEQ_CST) & bit)
+		return;
+
+	old = __atomic_fetch_or(&plic->pending, bit, __ATOMIC_SEQ_CST);
+	if (old & bit)
+		return;
+
+	plic_notify(plic);
+}
+
+void r5sim_plic_lower(struct r5sim_plic *plic, u32 src)
+{
+	__atomic_and_fetch(&plic->asserted, ~(1ULL << src), __ATOMIC_SEQ_CST);
+}
+
+static u32 plic_claim(struct r5sim_plic *plic, struct plic_context *ctx)
+{
+	u32 src = plic_best(plic, ctx);
+	u64 bit = 1ULL << src;
+
+	if (src) {
+		__atomic_or_fetch(&plic->claimed, bit, __ATOMIC_SEQ_CST);
+		__atomic_and_fetch(&plic->pending, ~bit, __ATOMIC_SEQ_CST);
+	}
+
+	plic_update(plic);
+
+	plic_dbg("PLIC: claim %u\n", src);
+
+	return src;
+}
+
+static void plic_complete(struct r5sim_plic *plic, struct plic_context *ctx,
+			  u32 src)
+{
+	u64 bit;
+
+	plic_dbg("PLIC: complete %u\n", src);
+
+	if (src >= PLIC_NR_SOURCES)
+		return;
+
+	bit = 1ULL << src;
+	if (!(ctx->enable & bit) || !(plic->claimed & bit))
+		return;
+
+	__atomic_and_fetch(&plic->claimed, ~bit, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&plic->asserted, __ATOMIC_SEQ_CST) & bit)
+		__atomic_or_fetch(&plic->pending, bit, __ATOMIC_SEQ_CST);
+
+	plic_update(plic);
+}
+
+static void plic_set_priority(struct r5sim_plic *plic, u32 src, u32 prio)
+{
+	u64 bit = 1ULL << src;
+
+	if (src == 0 || src >= PLIC_NR_SOURCES)
+		return;
+
+	prio = min(prio, (u32)PLIC_PRIORITY_MAX);
+
+	__atomic_and_fetch(&plic->prio_mask[plic->priority[src]], ~bit,
+			   __ATOMIC_RELAXED);
+	__atomic_or_fetch(&plic->prio_mask[prio], bit, __ATOMIC_RELAXED);
+	plic->priority[src] = prio;
+}
+
+static void plic_set_enable(struct plic_context *ctx, u32 word, u32 val)
+{
+	u64 enable = ctx->enable;
+
+	if (word == 0)
+		val &= ~1U;	/* There's no source 0. */
+
+	enable &= ~(0xffffffffULL << (32 * word));
+	enable |= (u64)val << (32 * word);
+
+	__atomic_store_n(&ctx->enable, enable, __ATOMIC_RELAXED);
+}
+
+static u32 plic_readl(struct r5sim_iodev *iodev, u32 offs)
+{
+	struct r5sim_plic *plic = iodev->priv;
+	struct plic_context *ctx;
+	u32 nr;
+
+	if (offs < PLIC_PRIORITY(PLIC_NR_SOURCES))
+		return plic->priority[offs / 4];
+
+	if (offs >= PLIC_PENDING(0) && offs < PLIC_PENDING(PLIC_NR_WORDS)) {
+		nr = (offs - PLIC_PENDING(0)) / 4;
+		return __atomic_load_n(&plic->pending,
+				       __ATOMIC_ACQUIRE) >> (32 * nr);
+	}
+
+	if (offs >= PLIC_ENABLE(0, 0) &&
+	    offs < PLIC_ENABLE(plic->nr_ctx, 0)) {
+		nr = (offs - PLIC_ENABLE(0, 0)) / 4;
+		ctx = &plic->ctx[nr / 32];
+		nr %= 32;
+
+		if (nr >= PLIC_NR_WORDS)
+			return 0;
+
+		return ctx->enable >> (32 * nr);
+	}
+
+	if (offs >= PLIC_THRESHOLD(0) &&
+	    offs < PLIC_THRESHOLD(plic->nr_ctx)) {
+		ctx = &plic->ctx[(offs - PLIC_THRESHOLD(0)) / 0x1000];
+
+		switch (offs & 0xfff) {
+		case 0x0:
+			return ctx->threshold;
+		case 0x4:
+			pthread_mutex_lock(&plic->lock);
+			nr = plic_claim(plic, ctx);
+			pthread_mutex_unlock(&plic->lock);
+			return nr;
+		}
+	}
+
+	return 0x0;
+}
+
+static void __plic_writel(struct r5sim_plic *plic, u32 offs, u32 val)
+{
+	struct plic_context *ctx;
+	u32 nr;
+
+	if (offs < PLIC_PRIORITY(PLIC_NR_SOURCES)) {
+		plic_set_priority(plic, offs / 4, val);
+		plic_update(plic);
+		return;
+	}
+
+	if (offs >= PLIC_ENABLE(0, 0) &&
+	    offs < PLIC_ENABLE(plic->nr_ctx, 0)) {
+		nr = (offs - PLIC_ENABLE(0, 0)) / 4;
+		ctx = &plic->ctx[nr / 32];
+		nr %= 32;
+
+		if (nr < PLIC_NR_WORDS) {
+			plic_set_enable(ctx, nr, val);
+			plic_update(plic);
+		}
+		return;
+	}
+
+	if (offs >= PLIC_THRESHOLD(0) &&
+	    offs < PLIC_THRESHOLD(plic->nr_ctx)) {
+		ctx = &plic->ctx[(offs - PLIC_THRESHOLD(0)) / 0x1000];
+
+		switch (offs & 0xfff) {
+		case 0x0:
+			__atomic_store_n(&ctx->threshold,
+					 min(val, (u32)PLIC_PRIORITY_MAX),
+					 __ATOMIC_RELAXED);
+			plic_update(plic);
+			return;
+		case 0x4:
+			plic_complete(plic, ctx, val);
+			return;
+		}
+	}
+}
+
+static void plic_writel(struct r5sim_iodev *iodev, u32 offs, u32 val)
+{
+	struct r5sim_plic *plic = iodev->priv;
+
+	plic_dbg("PLIC: STORE @ 0x%06x v=0x%08x\n", offs, val);
+
+	pthread_mutex_lock(&plic->lock);
+	__plic_writel(plic, offs, val);
+	pthread_mutex_unlock(&plic->lock);
+}
+
+static struct r5sim_iodev plic_dev = {
+	.name      = "plic",
+
+	.io_size   = PLIC_SIZE,
+
+	.readl     = plic_readl,
+	.writel    = plic_writel,
+};
+
+struct r5sim_iodev *r5sim_plic_load_new(struct r5sim_machine *mach,
+					u32 io_offs)
+{
+	struct r5sim_iodev *dev;
+	struct r5sim_plic *plic;
+	u32 i;
+
+	dev = malloc(sizeof(*dev));
+	r5sim_assert(dev != NULL);
+
+	plic = calloc(1, sizeof(*plic));
+	r5sim_assert(plic != NULL);
+
+	*dev = plic_dev;
+
+	dev->mach = mach;
+	dev->io_offset = io_offs;
+	dev->priv = plic;
+
+	/*
+	 * Every source starts at priority 0.
+	 */
+	plic->prio_mask[0] = ~1ULL;
+
+	pthread_mutex_init(&plic->lock, NULL);
+
+	/*
+	 * An M-mode and an S-mode context for each hart.
+	 */
+	plic->nr_ctx = 2 * mach->nr_cores;
+
+	for (i = 0; i < mach->nr_cores; i++) {
+		plic->ctx[2 * i].core      = mach->cores[i];
+		plic->ctx[2 * i].cause     = CSR_MCAUSE_CODE_MEI;
+		plic->ctx[2 * i + 1].core  = mach->cores[i];
+		plic->ctx[2 * i + 1].cause = CSR_MCAUSE_CODE_SEI;
+	}
+
+	mach->plic = plic;
+
+	r5sim_info("PLIC @ 0x%x: %u sources, %u contexts\n",
+		   io_offs, PLIC_NR_SOURCES, plic->nr_ctx);
+
+	return dev;
+}
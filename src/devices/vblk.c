@@ -0,0 +1,261 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * virtio-blk device backed by a file. Unlike the VDISK this lets software
+ * queue many requests and then notify the device once.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/util.h>
+#include <r5sim/iodev.h>
+#include <r5sim/vdevs.h>
+#include <r5sim/virtio.h>
+
+#include <r5sim/hw/virtio.h>
+
+#define vblk_dbg r5sim_dbg_v
+
+struct virtio_blk_priv {
+	int	 fd;
+	u8	*mmap;
+
+	size_t	 size;
+	bool	 read_only;
+};
+
+static u32 vblk_config_readl(struct r5sim_virtio *vio, u32 offs)
+{
+	struct virtio_blk_priv *blk = r5sim_virtio_priv(vio);
+	u64 sectors = blk->size / VIRTIO_BLK_SECTOR_SIZE;
+
+	switch (offs) {
+	case VIRTIO_BLK_CFG_CAPACITY_LO:
+		return sectors & 0xffffffff;
+	case VIRTIO_BLK_CFG_CAPACITY_HI:
+		return sectors >> 32;
+	case VIRTIO_BLK_CFG_SEG_MAX:
+		/*
+		 * Leave room for the header and status descriptors.
+		 */
+		return R5SIM_VIRTIO_QUEUE_NUM_MAX - 2;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy between the disk and the data buffers of a request. Each data
+ * buffer must be device writable for reads and driver writable for
+ * writes.
+ */
+static u8 vblk_rw(struct virtio_blk_priv *blk,
+		  struct r5sim_virtio_req *req,
+		  u64 sector, bool write, u32 *written)
+{
+	struct r5sim_virtio_seg *seg;
+	u64 offs = sector * VIRTIO_BLK_SECTOR_SIZE;
+	u32 i;
+
+	if (write && blk->read_only)
+		return VIRTIO_BLK_S_IOERR;
+
+	if (sector > blk->size / VIRTIO_BLK_SECTOR_SIZE)
+		return VIRTIO_BLK_S_IOERR;
+
+	for (i = 1; i < req->nr_segs - 1; i++) {
+		seg = &req->segs[i];
+
+		if (!seg->mem || seg->write == write ||
+		    seg->len > blk->size - offs)
+			return VIRTIO_BLK_S_IOERR;
+
+		if (write) {
+			memcpy(blk->mmap + offs, seg->mem, seg->len);
+		} else {
+			memcpy(seg->mem, blk->mmap + offs, seg->len);
+			*written += seg->len;
+		}
+
+		offs += seg->len;
+	}
+
+	return VIRTIO_BLK_S_OK;
+}
+
+static u8 vblk_get_id(struct r5sim_virtio_req *req, u32 *written)
+{
+	static const char id[VIRTIO_BLK_ID_BYTES] = "r5sim-vblk";
+	struct r5sim_virtio_seg *seg = &req->segs[1];
+	u32 len;
+
+	if (req->nr_segs != 3 || !seg->mem || !seg->write)
+		return VIRTIO_BLK_S_IOERR;
+
+	len = min(seg->len, (u32)VIRTIO_BLK_ID_BYTES);
+	memcpy(seg->mem, id, len);
+	*written += len;
+
+	return VIRTIO_BLK_S_OK;
+}
+
+/*
+ * Requests are laid out as a header buffer, any number of data buffers,
+ * and a status buffer. The status is the last byte of the last buffer.
+ */
+static u32 vblk_handle_req(struct r5sim_virtio *vio, u32 queue,
+			   struct r5sim_virtio_req *req)
+{
+	struct virtio_blk_priv *blk = r5sim_virtio_priv(vio);
+	struct r5sim_virtio_seg *status_seg;
+	struct virtio_blk_req_hdr hdr;
+	u32 written = 0;
+	u8 status;
+
+	if (req->nr_segs < 2)
+		return 0;
+
+	/*
+	 * Without a usable header and status there's no way to even
+	 * report an error.
+	 */
+	status_seg = &req->segs[req->nr_segs - 1];
+	if (!status_seg->mem || !status_seg->write || status_seg->len < 1 ||
+	    !req->segs[0].mem || req->segs[0].write ||
+	    req->segs[0].len < sizeof(hdr))
+		return 0;
+
+	memcpy(&hdr, req->segs[0].mem, sizeof(hdr));
+
+	vblk_dbg("vblk: type=%u sector=%llu segs=%u\n",
+		 hdr.type, (unsigned long long)hdr.sector, req->nr_segs);
+
+	switch (hdr.type) {
+	case VIRTIO_BLK_T_IN:
+		status = vblk_rw(blk, req, hdr.sector, false, &written);
+		break;
+	case VIRTIO_BLK_T_OUT:
+		status = vblk_rw(blk, req, hdr.sector, true, &written);
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		status = msync(blk->mmap, blk->size, MS_SYNC) ?
+			VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+		break;
+	case VIRTIO_BLK_T_GET_ID:
+		status = vblk_get_id(req, &written);
+		break;
+	default:
+		status = VIRTIO_BLK_S_UNSUPP;
+		break;
+	}
+
+	status_seg->mem[status_seg->len - 1] = status;
+
+	return written + 1;
+}
+
+static struct r5sim_virtio_ops virtio_blk_ops = {
+	.device_id	= VIRTIO_ID_BLOCK,
+	.nr_queues	= 1,
+	.features	= (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+			  (1ULL << VIRTIO_BLK_F_FLUSH),
+
+	.config_readl	= vblk_config_readl,
+	.handle_req	= vblk_handle_req,
+};
+
+static struct r5sim_virtio_ops virtio_blk_ro_ops = {
+	.device_id	= VIRTIO_ID_BLOCK,
+	.nr_queues	= 1,
+	.features	= (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+			  (1ULL << VIRTIO_BLK_F_FLUSH) |
+			  (1ULL << VIRTIO_BLK_F_RO),
+
+	.config_readl	= vblk_config_readl,
+	.handle_req	= vblk_handle_req,
+};
+
+static void vblk_load(struct virtio_blk_priv *blk, const char *path)
+{
+	struct stat buf;
+	int prot = PROT_READ|PROT_WRITE;
+
+	memset(blk, 0, sizeof(*blk));
+
+	/*
+	 * Fall back to a read-only disk if we can't write the file.
+	 */
+	blk->fd = open(path, O_RDWR);
+	if (blk->fd < 0) {
+		blk->fd = open(path, O_RDONLY);
+		blk->read_only = true;
+		prot = PROT_READ;
+	}
+
+	if (blk->fd < 0) {
+		perror(path);
+		r5sim_assert(!"Failed to open virtio-blk path");
+	}
+
+	if (fstat(blk->fd, &buf) < 0) {
+		perror(path);
+		r5sim_assert(!"Failed to stat!");
+	}
+
+	blk->size = buf.st_size;
+
+	blk->mmap = mmap(NULL, blk->size, prot, MAP_SHARED, blk->fd, 0x0);
+	if (blk->mmap == MAP_FAILED) {
+		perror(path);
+		r5sim_assert(!"Failed to mmap!");
+	}
+}
+
+struct r5sim_iodev *r5sim_vblk_load_new(
+	struct r5sim_machine *mach,
+	u32 io_offs, u32 irq, const char *path)
+{
+	struct r5sim_iodev *dev;
+	struct virtio_blk_priv *priv;
+
+	priv = malloc(sizeof(*priv));
+	r5sim_assert(priv != NULL);
+
+	vblk_load(priv, path);
+
+	dev = r5sim_virtio_mmio_new(mach, io_offs, irq, "virtio-blk",
+				    priv->read_only ?
+				    &virtio_blk_ro_ops : &virtio_blk_ops,
+				    priv);
+
+	r5sim_info("VIRTIO-BLK @ 0x%x: path=%s%s\n", io_offs, path,
+		   priv->read_only ? " (read-only)" : "");
+	r5sim_info("  Disk size: %zu\n", priv->size);
+
+	return dev;
+}
@@ -17,22 +17,63 @@
  *
  * Define a virtual disk like device that can be used for accessing a
  * permanent store of memory.
+ *
+ * A disk is specified as PATH[,OPTION...]. Options:
+ *
+ *   overlay=DELTA   Leave the image at PATH untouched and send writes to
+ *                   a sparse delta file; the delta is created if needed.
+ *   snapshot        Like overlay but the delta lives in memory and is
+ *                   discarded on exit.
+ *
+ * Either way the base image is only opened for reading, so any number of
+ * simulators can share one (page cached) base image.
+ *
+ *   backend=NAME    Storage backend; see below. Defaults to mmap.
+ *   cache=PAGES     pio: size of the page cache in 4K pages.
+ *   readahead=PAGES pio: pages to read ahead on a cache miss.
+ *   qd=N            uring: max number of I/Os in flight.
+ *   writeback[=PAGES]
+ *                   Track written ranges and push them out in large
+ *                   batches once PAGES (default 16MB worth) are dirty,
+ *                   rather than leaving it to the kernel's timing.
+ *   latency=NS      Model device latency: an op completes no sooner than
+ *                   NS after it was started. With virtual time this is
+ *                   virtual ns.
+ *
+ * Backends:
+ *
+ *   mmap            Map the whole file. Fast, but the file takes up
+ *                   address space and page faults land on the worker at
+ *                   unpredictable times. Apertures need this backend.
+ *   pio             pread()/pwrite() through a bounded LRU page cache.
+ *   uring           io_uring; large transfers are split up and issued
+ *                   concurrently.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
 
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <r5sim/log.h>
 #include <r5sim/env.h>
+#include <r5sim/list.h>
+#include <r5sim/core.h>
+#include <r5sim/plic.h>
+#include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
 #include <r5sim/iodev.h>
+#include <r5sim/ioloop.h>
+#include <r5sim/vdisk.h>
 #include <r5sim/vdevs.h>
 #include <r5sim/machine.h>
 
@@ -40,12 +81,112 @@
 
 #define vdisk_dbg r5sim_dbg_v
 
+/*
+ * Delta file layout: this header, then a bitmap with one bit per disk
+ * page at bitmap_offs, then the pages themselves at data_offs laid out
+ * exactly as they are on the disk. Pages that have never been written are
+ * holes in the file and take no space.
+ */
+#define VDISK_DELTA_MAGIC	0x57433552 /* "R5CW" */
+#define VDISK_DELTA_VERSION	1
+
+struct vdisk_delta_hdr {
+	u32		 magic;
+	u32		 version;
+	u64		 disk_size;
+	u32		 page_size;
+	u32		 bitmap_offs;
+	u64		 data_offs;
+};
+
+/*
+ * A disk op, latched from the op registers when VDISK_EXEC is written.
+ */
+struct vdisk_op {
+	u32		 op;
+	u32		 dram_addr;
+	u64		 page_start;
+	u32		 pages;
+
+	/*
+	 * Simulator time at which the op may complete; see latency.
+	 */
+	u64		 due;
+
+	struct list_head op_node;
+};
+
+/*
+ * Push out write-back ranges once there are this many of them, no matter
+ * how small they are; it bounds the cost of tracking them.
+ */
+#define VDISK_WB_MAX_RANGES	256
+
+struct vdisk_wb_range {
+	u64		 start;
+	u64		 end;
+
+	struct list_head range_node;
+};
+
 struct virt_disk_priv {
-	int	 fd;
-	void	*mmap;
+	struct vdisk_backend	*base;
 
 	size_t	 size;
 
+	/*
+	 * For overlay disks base is the read-only base image and written
+	 * pages live in the delta. The bitmap of written pages is kept in
+	 * memory and written through to the delta file. Only the worker
+	 * accesses the delta.
+	 */
+	struct vdisk_backend	*delta;
+	u8			*delta_bitmap;
+	u64			 delta_bitmap_offs;
+	u64			 delta_data_offs;
+
+	/*
+	 * Write-back mode: ranges written since they were last pushed out.
+	 * wb_limit is the number of bytes to let pile up before pushing
+	 * them all out, or 0 if write-back mode is off. Worker only.
+	 */
+	struct list_head	 wb_ranges;
+	u32			 wb_nr;
+	u64			 wb_bytes;
+	u64			 wb_limit;
+
+	/*
+	 * Ops are handed off to the worker thread through the op queue.
+	 * The lock protects the queue; busy counts ops that have been
+	 * executed but not yet completed and is accessed atomically so
+	 * that the core can poll it without taking the lock.
+	 */
+	pthread_t		worker;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	ops;
+	u32			busy;
+
+	/*
+	 * Modeled latency: executed ops wait on the done list (under the
+	 * lock) until the done event completes them. Since every op has
+	 * the same latency the list is in due order.
+	 */
+	u64			latency;
+	struct list_head	done;
+	struct r5sim_event	done_ev;
+
+	struct r5sim_machine	*mach;
+	u32			irq;
+
+	/*
+	 * Aperture mapping of the disk into the machine's physical address
+	 * space. Any hart can (re)map it; aperture_lock serialises that.
+	 */
+	pthread_mutex_t		aperture_lock;
+	struct r5sim_mem_region	aperture;
+	bool			aperture_mapped;
+
 	u32 dev_state[VDISK_MAX_REG >> 2];
 };
 
@@ -62,9 +203,17 @@ static const char *vdisk_reg_to_str(u32 reg)
 		[VDISK_OP]		= "VDISK_OP",
 		[VDISK_EXEC]		= "VDISK_EXEC",
 		[VDISK_BUSY]		= "VDISK_BUSY",
+		[VDISK_IRQ_ENABLE]	= "VDISK_IRQ_ENABLE",
+		[VDISK_IRQ_STATUS]	= "VDISK_IRQ_STATUS",
+		[VDISK_APERTURE_ADDR]	= "VDISK_APERTURE_ADDR",
+		[VDISK_APERTURE_SIZE]	= "VDISK_APERTURE_SIZE",
+		[VDISK_APERTURE_STATUS]	= "VDISK_APERTURE_STATUS",
+		[VDISK_PAGE_START_HI]	= "VDISK_START_HI",
+		[VDISK_NR_DISKS]	= "VDISK_NR_DISKS",
 	};
 
-	r5sim_assert(reg <= VDISK_MAX_REG);
+	if (reg >= sizeof(str_reg) / sizeof(str_reg[0]) || !str_reg[reg])
+		return "VDISK_INVALID";
 
 	return str_reg[reg];
 }
@@ -76,7 +225,7 @@ static void __vdisk_set_state(struct virt_disk_priv *disk, u32 __i, u32 val)
 {
 	u32 i = __i >> 2;
 
-	r5sim_assert(i < VDISK_MAX_REG);
+	r5sim_assert(i < (VDISK_MAX_REG >> 2));
 
 	disk->dev_state[i] = val;
 }
@@ -85,86 +234,689 @@ static u32 __vdisk_read_state(struct virt_disk_priv *disk, u32 __i)
 {
 	u32 i = __i >> 2;
 
-	r5sim_assert(i < VDISK_MAX_REG);
+	r5sim_assert(i < (VDISK_MAX_REG >> 2));
 
 	return disk->dev_state[i];
 }
 
+/*
+ * Count the VDISKs on the machine. The device list only changes while the
+ * machine is being built, so there's no need to cache this.
+ */
+static u32 vdisk_count(struct r5sim_machine *mach)
+{
+	struct r5sim_iodev *dev;
+	u32 nr = 0;
+
+	list_for_each_entry(dev, &mach->io_devs, mach_node) {
+		if (strcmp(dev->name, "vdisk") == 0)
+			nr++;
+	}
+
+	return nr;
+}
+
+static u64 vdisk_page_start(struct virt_disk_priv *priv)
+{
+	return ((u64)__vdisk_read_state(priv, VDISK_PAGE_START_HI) << 32) |
+		__vdisk_read_state(priv, VDISK_PAGE_START);
+}
+
 static u32 virt_disk_readl(struct r5sim_iodev *iodev, u32 offs)
 {
+	struct virt_disk_priv *priv = iodev->priv;
+
 	vdisk_dbg("LOAD  @ %s\n",
 		  vdisk_reg_to_str(offs));
 
 	if (offs >= VDISK_MAX_REG)
 		return 0x0;
 
-	return __vdisk_read_state(iodev->priv, offs);
+	switch (offs) {
+	case VDISK_BUSY:
+		/*
+		 * Pairs with the release in the worker: once software sees
+		 * not-busy the op's data is visible, too.
+		 */
+		return __atomic_load_n(&priv->busy, __ATOMIC_ACQUIRE) != 0;
+	case VDISK_IRQ_STATUS:
+		return __atomic_load_n(&priv->dev_state[offs >> 2],
+				       __ATOMIC_ACQUIRE);
+	case VDISK_NR_DISKS:
+		return vdisk_count(iodev->mach);
+	}
+
+	return __vdisk_read_state(priv, offs);
+}
+
+static struct vdisk_backend *vdisk_wr_backend(struct virt_disk_priv *priv)
+{
+	return priv->delta ? priv->delta : priv->base;
+}
+
+static bool vdisk_page_dirty(struct virt_disk_priv *priv, u64 page)
+{
+	return (priv->delta_bitmap[page >> 3] >> (page & 0x7)) & 0x1;
+}
+
+static int vdisk_page_rd(struct virt_disk_priv *priv, u64 page,
+			 u8 *buf, u32 len)
+{
+	u64 offs = page * KB(4);
+
+	if (vdisk_page_dirty(priv, page))
+		return priv->delta->ops->read(priv->delta, buf,
+					      priv->delta_data_offs + offs,
+					      len);
+
+	return priv->base->ops->read(priv->base, buf, offs, len);
+}
+
+/*
+ * Write-back mode: remember which ranges of the file being written have
+ * been touched (sorted, with neighbours merged) so that they can be
+ * pushed out in big batches.
+ */
+static void vdisk_wb_add(struct virt_disk_priv *priv, u64 start, u64 len)
+{
+	struct list_head *pos = &priv->wb_ranges;
+	struct vdisk_wb_range *r, *tmp;
+	u64 end = start + len;
+
+	if (!priv->wb_limit || !len)
+		return;
+
+	list_for_each_entry_safe(r, tmp, &priv->wb_ranges, range_node) {
+		if (r->end < start)
+			continue;
+
+		if (r->start > end) {
+			pos = &r->range_node;
+			break;
+		}
+
+		start = min(start, r->start);
+		end   = max(end, r->end);
+
+		priv->wb_bytes -= r->end - r->start;
+		priv->wb_nr--;
+		list_del(&r->range_node);
+		free(r);
+	}
+
+	r = malloc(sizeof(*r));
+	r5sim_assert(r != NULL);
+
+	r->start = start;
+	r->end   = end;
+	list_add_tail(&r->range_node, pos);
+
+	priv->wb_bytes += end - start;
+	priv->wb_nr++;
+}
+
+/*
+ * Start writeback of every tracked range overlapping [start, end). This
+ * doesn't wait; it just hands the kernel large contiguous ranges to
+ * write instead of leaving it to trickle them out on its own schedule.
+ */
+static void vdisk_wb_kick(struct virt_disk_priv *priv, u64 start, u64 end)
+{
+	struct vdisk_backend *be = vdisk_wr_backend(priv);
+	struct vdisk_wb_range *r, *tmp;
+
+	list_for_each_entry_safe(r, tmp, &priv->wb_ranges, range_node) {
+		if (r->end <= start || r->start >= end)
+			continue;
+
+		vdisk_dbg("writeback: 0x%llx - 0x%llx\n",
+			  (unsigned long long)r->start,
+			  (unsigned long long)r->end);
+
+		if (be->fd >= 0)
+			sync_file_range(be->fd, r->start, r->end - r->start,
+					SYNC_FILE_RANGE_WRITE);
+
+		priv->wb_bytes -= r->end - r->start;
+		priv->wb_nr--;
+		list_del(&r->range_node);
+		free(r);
+	}
+}
+
+static void vdisk_wb_check(struct virt_disk_priv *priv)
+{
+	if (priv->wb_bytes >= priv->wb_limit ||
+	    priv->wb_nr >= VDISK_WB_MAX_RANGES)
+		vdisk_wb_kick(priv, 0, ~0ULL);
+}
+
+/*
+ * Make [offs, offs + len) of the file being written durable.
+ */
+static int vdisk_sync(struct virt_disk_priv *priv, u64 offs, u64 len)
+{
+	struct vdisk_backend *be = vdisk_wr_backend(priv);
+
+	vdisk_wb_kick(priv, offs, offs + len);
+
+	return be->ops->flush(be, offs, len);
+}
+
+/*
+ * Mark nr pages as living in the delta and write the changed part of the
+ * bitmap through to the delta file.
+ */
+static int vdisk_set_dirty(struct virt_disk_priv *priv, u64 first, u64 nr)
+{
+	struct vdisk_backend *delta = priv->delta;
+	u64 page, lo = first >> 3, hi = (first + nr - 1) >> 3;
+
+	for (page = first; page < first + nr; page++)
+		priv->delta_bitmap[page >> 3] |= 1 << (page & 0x7);
+
+	if (delta->fd < 0)
+		return 0;
+
+	if (pwrite(delta->fd, &priv->delta_bitmap[lo], hi - lo + 1,
+		   priv->delta_bitmap_offs + lo) != (ssize_t)(hi - lo + 1))
+		return -1;
+
+	vdisk_wb_add(priv, priv->delta_bitmap_offs + lo, hi - lo + 1);
+
+	return 0;
+}
+
+/*
+ * Write to a page of an overlay. The first write to a page copies it up
+ * from the base into the delta. The bit is only set once the data is
+ * written so that the delta is always consistent on disk.
+ */
+static int vdisk_page_wr(struct virt_disk_priv *priv, u64 page,
+			 const u8 *buf, u32 len)
+{
+	struct vdisk_backend *delta = priv->delta;
+	u64 offs = page * KB(4);
+	u8 copy[KB(4)];
+
+	if (!vdisk_page_dirty(priv, page) && len < KB(4)) {
+		if (priv->base->ops->read(priv->base, copy, offs, KB(4)))
+			return -1;
+
+		memcpy(copy, buf, len);
+		buf = copy;
+		len = KB(4);
+	}
+
+	if (delta->ops->write(delta, buf, priv->delta_data_offs + offs, len))
+		return -1;
+
+	vdisk_wb_add(priv, priv->delta_data_offs + offs, len);
+
+	if (vdisk_page_dirty(priv, page))
+		return 0;
+
+	return vdisk_set_dirty(priv, page, 1);
+}
+
+/*
+ * Work out the byte range of the disk covered by an op; returns false if
+ * the op starts past the end of the disk. Ops that run off the end are
+ * cut short.
+ */
+static bool vdisk_op_range(struct virt_disk_priv *priv, u64 page_start,
+			   u32 pages, u64 *start, u64 *bytes)
+{
+	/*
+	 * Check the page rather than the byte offset; the latter can wrap.
+	 */
+	if (page_start >= (priv->size + KB(4) - 1) / KB(4))
+		return false;
+
+	*start = page_start * KB(4);
+	*bytes = min((u64)pages * KB(4), priv->size - *start);
+
+	return true;
 }
 
 static void virt_disk_do_copy(struct virt_disk_priv *priv,
 			      struct r5sim_machine *mach,
 			      u32 op,
 			      u32 dram_addr,
-			      u32 page_start,
+			      u64 page_start,
 			      u32 pages)
 {
-	u32 disk_start = page_start * KB(4);
-	u32 disk_bytes = pages * KB(4);
+	u64 disk_start, disk_bytes;
+	u8 *dram;
+	u64 page;
+	int err = 0;
 
-	if (disk_start >= priv->size) {
+	if (!vdisk_op_range(priv, page_start, pages,
+			    &disk_start, &disk_bytes)) {
 		vdisk_dbg("Read overrun!\n");
 		return;
 	}
 
 	/*
-	 * Only copy up to the size of the disk.
+	 * And make sure the DRAM side of the copy is actually in DRAM.
+	 * The copy happens on the host, so there's no way to fault back
+	 * to the core here; just drop the op.
 	 */
-	if (disk_start + disk_bytes >= priv->size)
-		disk_bytes = priv->size - disk_start - 1;
+	if (!addr_in(mach->memory_base, mach->memory_size, dram_addr) ||
+	    disk_bytes > mach->memory_base + mach->memory_size - dram_addr) {
+		vdisk_dbg("DRAM overrun!\n");
+		return;
+	}
 
-	if (op == VDISK_OP_COPY_TO_DRAM)
-		memcpy(mach->memory + (dram_addr - mach->memory_base),
-		       priv->mmap + disk_start,
-		       disk_bytes);
-	else
-		memcpy(priv->mmap + disk_start,
-		       mach->memory + (dram_addr - mach->memory_base),
-		       disk_bytes);
+	dram = mach->memory + (dram_addr - mach->memory_base);
+
+	if (!priv->delta) {
+		if (op == VDISK_OP_COPY_TO_DRAM) {
+			err = priv->base->ops->read(priv->base, dram,
+						    disk_start, disk_bytes);
+		} else {
+			err = priv->base->ops->write(priv->base, dram,
+						     disk_start, disk_bytes);
+			vdisk_wb_add(priv, disk_start, disk_bytes);
+		}
+		goto done;
+	}
 
+	/*
+	 * Overlays go a page at a time; each page may be in the base or
+	 * the delta.
+	 */
+	for (page = page_start; disk_bytes && !err; page++) {
+		u32 len = min(disk_bytes, (u64)KB(4));
+
+		if (op == VDISK_OP_COPY_TO_DRAM)
+			err = vdisk_page_rd(priv, page, dram, len);
+		else
+			err = vdisk_page_wr(priv, page, dram, len);
+
+		dram += len;
+		disk_bytes -= len;
+	}
+
+done:
+	if (err)
+		r5sim_warn("VDISK I/O error: page %llu\n",
+			   (unsigned long long)page_start);
+
+	if (op == VDISK_OP_COPY_TO_DISK && priv->wb_limit)
+		vdisk_wb_check(priv);
 }
 
-static void virt_disk_exec_op(struct r5sim_iodev *iodev)
+/*
+ * Flush pages to stable storage; no pages means the whole disk. For an
+ * overlay that's the delta's copy of the pages plus the bitmap.
+ */
+static void virt_disk_do_flush(struct virt_disk_priv *priv,
+			       u64 page_start, u32 pages)
 {
-	struct virt_disk_priv *priv = iodev->priv;
-	struct r5sim_machine *mach = iodev->mach;
+	u64 start = 0, bytes = priv->size;
+	int err;
+
+	if (pages && !vdisk_op_range(priv, page_start, pages,
+				     &start, &bytes))
+		return;
 
-	u32 dram_addr  = __vdisk_read_state(priv, VDISK_DRAM_ADDR);
-	u32 page_start = __vdisk_read_state(priv, VDISK_PAGE_START);
-	u32 pages      = __vdisk_read_state(priv, VDISK_PAGES);
-	u32 op         = __vdisk_read_state(priv, VDISK_OP);
+	if (!priv->delta) {
+		err = vdisk_sync(priv, start, bytes);
+	} else {
+		err = vdisk_sync(priv, priv->delta_data_offs + start, bytes);
+		err |= vdisk_sync(priv, priv->delta_bitmap_offs,
+				  priv->delta_data_offs -
+				  priv->delta_bitmap_offs);
+	}
 
-	if ((op & VDISK_OP_COPY_TO_DRAM) == 0 &&
-	    (op & VDISK_OP_COPY_TO_DISK) == 0) {
-		vdisk_dbg("noop.\n");
+	if (err)
+		r5sim_warn("VDISK flush failed!\n");
+}
+
+/*
+ * Discarded pages read back as zeros. For an overlay the base can't be
+ * touched, so the pages move to the delta as holes.
+ */
+static void virt_disk_do_discard(struct virt_disk_priv *priv,
+				 u64 page_start, u32 pages)
+{
+	struct vdisk_backend *delta = priv->delta;
+	u64 start, bytes;
+	int err;
+
+	if (!vdisk_op_range(priv, page_start, pages, &start, &bytes))
 		return;
+
+	if (!delta) {
+		err = priv->base->ops->discard(priv->base, start, bytes);
+	} else {
+		bytes = (bytes + KB(4) - 1) & ~((u64)KB(4) - 1);
+		err = delta->ops->discard(delta, priv->delta_data_offs + start,
+					  bytes);
+		if (!err)
+			err = vdisk_set_dirty(priv, page_start,
+					      bytes / KB(4));
 	}
 
+	if (err)
+		r5sim_warn("VDISK discard failed!\n");
+}
+
+static void virt_disk_do_op(struct virt_disk_priv *priv, u32 op,
+			    u32 dram_addr, u64 page_start, u32 pages)
+{
 	vdisk_dbg("op: %u\n", op);
 	vdisk_dbg("  DRAM addr:   0x%08x\n", dram_addr);
-	vdisk_dbg("  Page offset: %u\n", page_start);
+	vdisk_dbg("  Page offset: %llu\n", (unsigned long long)page_start);
 	vdisk_dbg("  Pages:       %u\n", pages);
 
-	if (op & VDISK_OP_COPY_TO_DRAM)
-		virt_disk_do_copy(priv, mach, VDISK_OP_COPY_TO_DRAM,
+	if (op & VDISK_OP_FLUSH)
+		virt_disk_do_flush(priv, page_start, pages);
+	else if (op & VDISK_OP_DISCARD)
+		virt_disk_do_discard(priv, page_start, pages);
+	else if (op & VDISK_OP_COPY_TO_DRAM)
+		virt_disk_do_copy(priv, priv->mach, VDISK_OP_COPY_TO_DRAM,
 				  dram_addr, page_start, pages);
-	else
-		virt_disk_do_copy(priv, mach, VDISK_OP_COPY_TO_DISK,
+	else if (op & VDISK_OP_COPY_TO_DISK)
+		virt_disk_do_copy(priv, priv->mach, VDISK_OP_COPY_TO_DISK,
 				  dram_addr, page_start, pages);
+	else
+		vdisk_dbg("  Skipping op.\n");
+}
+
+static u32 vdisk_sg_field(const u8 *desc, u32 offs)
+{
+	u32 val;
+
+	memcpy(&val, desc + offs, sizeof(val));
+
+	return val;
+}
+
+/*
+ * Run a scatter-gather list. The list is in guest memory and is read as
+ * we go, which is fine: software isn't allowed to touch it until the op
+ * completes.
+ */
+static void virt_disk_do_sg(struct virt_disk_priv *priv,
+			    u32 list_addr, u32 nr_descs)
+{
+	struct r5sim_machine *mach = priv->mach;
+	const u8 *desc;
+	u32 i;
+
+	if ((list_addr & 0x3) ||
+	    !addr_in(mach->memory_base, mach->memory_size, list_addr) ||
+	    (u64)nr_descs * VDISK_SG_DESC_SIZE >
+	    mach->memory_base + mach->memory_size - list_addr) {
+		vdisk_dbg("SG list overrun!\n");
+		return;
+	}
+
+	desc = mach->memory + (list_addr - mach->memory_base);
+
+	for (i = 0; i < nr_descs; i++, desc += VDISK_SG_DESC_SIZE) {
+		u32 ctrl = vdisk_sg_field(desc, VDISK_SG_DESC_CTRL);
+		u32 op = get_field(ctrl, VDISK_SG_DESC_CTRL_OP);
+		u64 page_start;
+
+		/*
+		 * No nesting, and no apertures; those aren't queued ops.
+		 */
+		if (op & ~(VDISK_OP_COPY_TO_DRAM | VDISK_OP_COPY_TO_DISK |
+			   VDISK_OP_FLUSH | VDISK_OP_DISCARD))
+			continue;
+
+		page_start = get_field(ctrl, VDISK_SG_DESC_CTRL_PAGE_START_HI);
+		page_start = page_start << 32 |
+			vdisk_sg_field(desc, VDISK_SG_DESC_PAGE_START);
+
+		virt_disk_do_op(priv, op,
+				vdisk_sg_field(desc, VDISK_SG_DESC_DRAM_ADDR),
+				page_start,
+				vdisk_sg_field(desc, VDISK_SG_DESC_PAGES));
+	}
+}
+
+static void virt_disk_complete_op(struct virt_disk_priv *priv)
+{
+	u32 irq_en = __vdisk_read_state(priv, VDISK_IRQ_ENABLE);
+	u32 status = 0;
+
+	__atomic_sub_fetch(&priv->busy, 1, __ATOMIC_RELEASE);
+	r5sim_machine_kick(priv->mach);
+
+	if (!get_field(irq_en, VDISK_IRQ_ENABLE_DONE))
+		return;
+
+	set_field(status, VDISK_IRQ_STATUS_DONE, 1);
+	__atomic_or_fetch(&priv->dev_state[VDISK_IRQ_STATUS >> 2],
+			  status, __ATOMIC_SEQ_CST);
+
+	r5sim_plic_raise(priv->mach->plic, priv->irq);
+}
+
+/*
+ * Drop the PLIC line once the status is clear; an op may complete while
+ * we're at it.
+ */
+static void virt_disk_ack(struct virt_disk_priv *priv, u32 status)
+{
+	u32 *irq_status = &priv->dev_state[VDISK_IRQ_STATUS >> 2];
+
+	if (__atomic_and_fetch(irq_status, ~status, __ATOMIC_SEQ_CST))
+		return;
+
+	r5sim_plic_lower(priv->mach->plic, priv->irq);
+
+	if (__atomic_load_n(irq_status, __ATOMIC_SEQ_CST))
+		r5sim_plic_raise(priv->mach->plic, priv->irq);
+}
+
+/*
+ * Complete the executed ops whose latency is up.
+ */
+static void virt_disk_done_expired(struct r5sim_event *ev)
+{
+	struct virt_disk_priv *priv = ev->priv;
+	struct vdisk_op *op, *tmp;
+	struct list_head due;
+	u64 now = r5sim_clock_ns();
+
+	INIT_LIST_HEAD(&due);
+
+	pthread_mutex_lock(&priv->lock);
+	list_for_each_entry_safe(op, tmp, &priv->done, op_node) {
+		if (op->due > now) {
+			r5sim_event_schedule(&priv->done_ev, op->due);
+			break;
+		}
+
+		list_move_tail(&op->op_node, &due);
+	}
+	pthread_mutex_unlock(&priv->lock);
+
+	list_for_each_entry_safe(op, tmp, &due, op_node) {
+		list_del(&op->op_node);
+		free(op);
+		virt_disk_complete_op(priv);
+	}
+}
+
+/*
+ * The worker thread: pull ops off the op queue and execute them. This
+ * lets the core keep executing instructions while large copies happen
+ * on the host.
+ */
+static void *virt_disk_worker(void *data)
+{
+	struct virt_disk_priv *priv = data;
+	struct vdisk_op *op;
+
+	while (1) {
+		pthread_mutex_lock(&priv->lock);
+		while (list_empty(&priv->ops))
+			pthread_cond_wait(&priv->cond, &priv->lock);
+
+		op = list_first_entry(&priv->ops, struct vdisk_op, op_node);
+		list_del(&op->op_node);
+		pthread_mutex_unlock(&priv->lock);
+
+		if (op->op & VDISK_OP_SG)
+			virt_disk_do_sg(priv, op->dram_addr, op->pages);
+		else
+			virt_disk_do_op(priv, op->op, op->dram_addr,
+					op->page_start, op->pages);
+
+		if (!priv->latency) {
+			free(op);
+			virt_disk_complete_op(priv);
+			continue;
+		}
+
+		pthread_mutex_lock(&priv->lock);
+		list_add_tail(&op->op_node, &priv->done);
+		if (list_is_singular(&priv->done))
+			r5sim_event_schedule(&priv->done_ev, op->due);
+		pthread_mutex_unlock(&priv->lock);
+	}
+
+	return NULL;
+}
+
+static void virt_disk_unmap_aperture(struct virt_disk_priv *priv)
+{
+	if (!priv->aperture_mapped)
+		return;
+
+	r5sim_machine_unmap_region(priv->mach, &priv->aperture);
+	priv->aperture_mapped = false;
+
+	__vdisk_set_state(priv, VDISK_APERTURE_ADDR,   0x0);
+	__vdisk_set_state(priv, VDISK_APERTURE_SIZE,   0x0);
+	__vdisk_set_state(priv, VDISK_APERTURE_STATUS, 0x0);
+}
+
+/*
+ * Map (or unmap) a window of the disk into the physical address space.
+ * The aperture points straight at the mmap()'ed disk, so there's no copy
+ * and no extra host memory.
+ */
+static void virt_disk_aperture_op(struct virt_disk_priv *priv, u32 op)
+{
+	u32 phys_addr  = __vdisk_read_state(priv, VDISK_DRAM_ADDR);
+	u64 page_start = vdisk_page_start(priv);
+	u64 pages      = __vdisk_read_state(priv, VDISK_PAGES);
+	u64 disk_pages = (priv->size + KB(4) - 1) / KB(4);
+	bool writable  = (op & VDISK_OP_MAP_RW) != 0;
+	u32 status = 0;
+
+	virt_disk_unmap_aperture(priv);
+
+	if (op & VDISK_OP_UNMAP)
+		return;
+
+	vdisk_dbg("Aperture: phys=0x%08x page=%llu pages=%llu %s\n",
+		  phys_addr, (unsigned long long)page_start,
+		  (unsigned long long)pages, writable ? "RW" : "RO");
+
+	/*
+	 * Only map what's actually there; the host mapping ends at the
+	 * last page of the disk.
+	 */
+	if (page_start >= disk_pages || pages == 0)
+		goto fail;
+
+	/*
+	 * An overlay's pages are split between two files, so there's no
+	 * single host mapping to point the aperture at. Likewise for
+	 * backends that don't map the disk.
+	 */
+	if (priv->delta || !priv->base->mem ||
+	    (writable && priv->base->read_only && !priv->base->private))
+		goto fail;
+
+	/*
+	 * The aperture has to fit in the 32 bit physical address space.
+	 */
+	pages = min(pages, disk_pages - page_start);
+	pages = min(pages, (u64)(0xffffffff / KB(4)));
+
+	priv->aperture.name  = "vdisk-aperture";
+	priv->aperture.base  = phys_addr;
+	priv->aperture.size  = pages * KB(4);
+	priv->aperture.mem   = priv->base->mem + page_start * KB(4);
+	priv->aperture.flags = R5SIM_MEM_READ;
+	if (writable)
+		priv->aperture.flags |= R5SIM_MEM_WRITE;
+
+	if (r5sim_machine_map_region(priv->mach, &priv->aperture))
+		goto fail;
+
+	priv->aperture_mapped = true;
+
+	set_field(status, VDISK_APERTURE_STATUS_MAPPED, 1);
+	set_field(status, VDISK_APERTURE_STATUS_WRITABLE, writable);
+
+	__vdisk_set_state(priv, VDISK_APERTURE_ADDR,   phys_addr);
+	__vdisk_set_state(priv, VDISK_APERTURE_SIZE,   priv->aperture.size);
+	__vdisk_set_state(priv, VDISK_APERTURE_STATUS, status);
+	return;
+
+fail:
+	vdisk_dbg("Aperture: failed to map!\n");
+	set_field(status, VDISK_APERTURE_STATUS_ERROR, 1);
+	__vdisk_set_state(priv, VDISK_APERTURE_STATUS, status);
+}
+
+static void virt_disk_exec_op(struct r5sim_iodev *iodev)
+{
+	struct virt_disk_priv *priv = iodev->priv;
+	struct vdisk_op *op;
+	u32 op_type = __vdisk_read_state(priv, VDISK_OP);
+
+	if (op_type & (VDISK_OP_MAP_RO | VDISK_OP_MAP_RW | VDISK_OP_UNMAP)) {
+		pthread_mutex_lock(&priv->aperture_lock);
+		virt_disk_aperture_op(priv, op_type);
+		pthread_mutex_unlock(&priv->aperture_lock);
+		return;
+	}
+
+	if ((op_type & (VDISK_OP_COPY_TO_DRAM | VDISK_OP_COPY_TO_DISK |
+			VDISK_OP_FLUSH | VDISK_OP_DISCARD |
+			VDISK_OP_SG)) == 0) {
+		vdisk_dbg("noop.\n");
+		return;
+	}
+
+	op = malloc(sizeof(*op));
+	r5sim_assert(op != NULL);
+
+	op->op         = op_type;
+	op->dram_addr  = __vdisk_read_state(priv, VDISK_DRAM_ADDR);
+	op->page_start = vdisk_page_start(priv);
+	op->pages      = __vdisk_read_state(priv, VDISK_PAGES);
+	op->due        = priv->latency ?
+		r5sim_clock_ns() + priv->latency : 0;
+
+	/*
+	 * Mark ourselves busy before the op is visible to the worker so
+	 * that software never sees a spurious not-busy.
+	 */
+	__atomic_add_fetch(&priv->busy, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&priv->lock);
+	list_add_tail(&op->op_node, &priv->ops);
+	pthread_cond_signal(&priv->cond);
+	pthread_mutex_unlock(&priv->lock);
 }
 
 static void virt_disk_writel(struct r5sim_iodev *iodev,
 			     u32 offs, u32 val)
 {
+	struct virt_disk_priv *priv = iodev->priv;
+
 	vdisk_dbg("STORE @ %-17s v=0x%08x\n",
 		  vdisk_reg_to_str(offs), val);
 
@@ -175,9 +927,18 @@ static void virt_disk_writel(struct r5sim_iodev *iodev,
 		 */
 	case VDISK_DRAM_ADDR:
 	case VDISK_PAGE_START:
+	case VDISK_PAGE_START_HI:
 	case VDISK_PAGES:
 	case VDISK_OP:
-		__vdisk_set_state(iodev->priv, offs, val);
+	case VDISK_IRQ_ENABLE:
+		__vdisk_set_state(priv, offs, val);
+		return;
+
+		/*
+		 * Write 1 to clear.
+		 */
+	case VDISK_IRQ_STATUS:
+		virt_disk_ack(priv, val);
 		return;
 
 		/*
@@ -194,34 +955,162 @@ static void virt_disk_writel(struct r5sim_iodev *iodev,
 	}
 }
 
-static int vdisk_load(struct r5sim_machine *mach,
-		      struct virt_disk_priv *disk,
-		      const char *path)
+/*
+ * Open (or create) the delta for an overlay disk. A NULL path gives an
+ * in memory delta.
+ */
+static void vdisk_open_delta(struct virt_disk_priv *disk, const char *path,
+			     struct vdisk_backend_args *args)
 {
+	struct vdisk_delta_hdr hdr;
 	struct stat buf;
+	u64 disk_pages = (disk->size + KB(4) - 1) / KB(4);
+	u64 bitmap_bytes = (disk_pages + 7) / 8;
+	int fd;
 
-	memset(disk, 0, sizeof(*disk));
+	disk->delta_bitmap = calloc(1, bitmap_bytes);
+	r5sim_assert(disk->delta_bitmap != NULL);
+
+	if (!path) {
+		disk->delta = vdisk_backend_open(NULL, disk_pages * KB(4),
+						 false, true, args);
+		return;
+	}
 
-	disk->fd = open(path, O_RDWR);
-	if (disk->fd < 0) {
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
 		perror(path);
-		r5sim_assert(!"Failed to open VDISK path");
+		r5sim_assert(!"Failed to open VDISK delta");
 	}
 
-	if (fstat(disk->fd, &buf) < 0) {
+	if (fstat(fd, &buf) < 0) {
 		perror(path);
 		r5sim_assert(!"Failed to stat!");
 	}
 
-	disk->size = buf.st_size;
+	if (buf.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic       = VDISK_DELTA_MAGIC;
+		hdr.version     = VDISK_DELTA_VERSION;
+		hdr.disk_size   = disk->size;
+		hdr.page_size   = KB(4);
+		hdr.bitmap_offs = KB(4);
+		hdr.data_offs   = KB(4) +
+			(bitmap_bytes + KB(4) - 1) / KB(4) * KB(4);
 
-	disk->mmap = mmap(NULL, disk->size, PROT_READ|PROT_WRITE,
-			  MAP_SHARED, disk->fd, 0x0);
-	if (disk->mmap == MAP_FAILED) {
-		perror(path);
-		r5sim_assert(!"Failed to mmap!");
+		/*
+		 * Truncating up leaves the whole file a hole.
+		 */
+		if (ftruncate(fd, hdr.data_offs + disk_pages * KB(4)) ||
+		    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			perror(path);
+			r5sim_assert(!"Failed to create VDISK delta");
+		}
+	} else if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		   hdr.magic != VDISK_DELTA_MAGIC ||
+		   hdr.version != VDISK_DELTA_VERSION ||
+		   hdr.disk_size != disk->size ||
+		   hdr.page_size != KB(4) ||
+		   (u64)buf.st_size < hdr.data_offs + disk_pages * KB(4) ||
+		   pread(fd, disk->delta_bitmap, bitmap_bytes,
+			 hdr.bitmap_offs) != (ssize_t)bitmap_bytes) {
+		r5sim_err("%s: delta does not match the base image!\n", path);
+		r5sim_assert(!"Bad VDISK delta");
 	}
 
+	close(fd);
+
+	disk->delta_bitmap_offs = hdr.bitmap_offs;
+	disk->delta_data_offs   = hdr.data_offs;
+	disk->delta = vdisk_backend_open(path, 0, false, false, args);
+}
+
+static u32 vdisk_opt_u32(const char *opt, const char *val)
+{
+	char *end;
+	unsigned long v = strtoul(val, &end, 0);
+
+	if (*val == '\0' || *end != '\0' || v == 0 || v > 0xffffffff) {
+		r5sim_err("Bad value for VDISK option: %s\n", opt);
+		r5sim_assert(!"Bad VDISK option");
+	}
+
+	return v;
+}
+
+static int vdisk_load(struct r5sim_machine *mach,
+		      struct virt_disk_priv *disk,
+		      const char *spec)
+{
+	struct vdisk_backend_args args = {
+		.backend     = "mmap",
+		.cache_pages = 1024,
+		.readahead   = 16,
+		.queue_depth = 32,
+	};
+	char *str, *opts, *path, *opt;
+	const char *delta = NULL;
+	bool snapshot = false;
+
+	memset(disk, 0, sizeof(*disk));
+
+	INIT_LIST_HEAD(&disk->wb_ranges);
+
+	str = strdup(spec);
+	r5sim_assert(str != NULL);
+
+	opts = str;
+	path = strsep(&opts, ",");
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		if (strncmp(opt, "overlay=", 8) == 0) {
+			delta = opt + 8;
+		} else if (strcmp(opt, "snapshot") == 0) {
+			snapshot = true;
+		} else if (strncmp(opt, "backend=", 8) == 0) {
+			args.backend = opt + 8;
+		} else if (strncmp(opt, "cache=", 6) == 0) {
+			args.cache_pages = vdisk_opt_u32(opt, opt + 6);
+		} else if (strncmp(opt, "readahead=", 10) == 0) {
+			args.readahead = vdisk_opt_u32(opt, opt + 10);
+		} else if (strcmp(opt, "writeback") == 0) {
+			disk->wb_limit = MB(16);
+		} else if (strncmp(opt, "writeback=", 10) == 0) {
+			disk->wb_limit = (u64)vdisk_opt_u32(opt, opt + 10) *
+				KB(4);
+		} else if (strncmp(opt, "qd=", 3) == 0) {
+			args.queue_depth = vdisk_opt_u32(opt, opt + 3);
+		} else if (strncmp(opt, "latency=", 8) == 0) {
+			disk->latency = vdisk_opt_u32(opt, opt + 8);
+		} else {
+			r5sim_err("Unknown VDISK option: %s\n", opt);
+			r5sim_assert(!"Bad VDISK option");
+		}
+	}
+
+	/*
+	 * A snapshot on the mmap backend is just a private mapping of the
+	 * base; the kernel copies pages on write for us and the copies go
+	 * away on exit. Other backends get an in memory delta.
+	 */
+	if (snapshot && strcmp(args.backend, "mmap") == 0)
+		disk->base = vdisk_backend_open(path, 0, true, true, &args);
+	else
+		disk->base = vdisk_backend_open(path, 0,
+						delta != NULL || snapshot,
+						false, &args);
+
+	disk->size = disk->base->size;
+
+	if (delta)
+		vdisk_open_delta(disk, delta, &args);
+	else if (snapshot && !disk->base->private)
+		vdisk_open_delta(disk, NULL, &args);
+
+	r5sim_info("VDISK %s: backend=%s%s\n", path, disk->base->ops->name,
+		   delta ? " overlay" : snapshot ? " snapshot" : "");
+
+	free(str);
+
 	/*
 	 * Init some basic settings.
 	 */
@@ -230,6 +1119,22 @@ static int vdisk_load(struct r5sim_machine *mach,
 	__vdisk_set_state(disk, VDISK_SIZE_LO,   disk->size & 0xFFFFFFFF);
 	__vdisk_set_state(disk, VDISK_SIZE_HI,   disk->size >> 32);
 
+	/*
+	 * And start the worker.
+	 */
+	disk->mach = mach;
+	INIT_LIST_HEAD(&disk->ops);
+	INIT_LIST_HEAD(&disk->done);
+	pthread_mutex_init(&disk->lock, NULL);
+	pthread_mutex_init(&disk->aperture_lock, NULL);
+	r5sim_event_init(mach, &disk->done_ev, virt_disk_done_expired, disk);
+	pthread_cond_init(&disk->cond, NULL);
+
+	if (pthread_create(&disk->worker, NULL, virt_disk_worker, disk))
+		r5sim_assert(!"Failed to create VDISK worker!");
+
+	r5sim_ioloop_pin(mach->ioloop, disk->worker);
+
 	return 0;
 }
 
@@ -251,7 +1156,7 @@ static struct r5sim_iodev virtual_disk = {
 
 struct r5sim_iodev *r5sim_vdisk_load_new(
 	struct r5sim_machine *mach,
-	u32 io_offs, const char *path)
+	u32 io_offs, u32 irq, const char *spec)
 {
 	struct r5sim_iodev *dev;
 	struct virt_disk_priv *priv;
@@ -268,9 +1173,11 @@ struct r5sim_iodev *r5sim_vdisk_load_new(
 	dev->io_offset = io_offs;
 	dev->priv = priv;
 
-	vdisk_load(mach, priv, path);
+	vdisk_load(mach, priv, spec);
+
+	priv->irq = irq;
 
-	r5sim_info("VDISK @ 0x%x: path=%s\n", io_offs, path);
+	r5sim_info("VDISK @ 0x%x: path=%s\n", io_offs, spec);
 	r5sim_info("  Disk size: %zu\n", priv->size);
 
 	return dev;
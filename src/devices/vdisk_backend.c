@@ -0,0 +1,255 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * VDISK backend selection and the mmap backend.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/util.h>
+#include <r5sim/vdisk.h>
+
+static const struct vdisk_backend_ops *vdisk_backends[] = {
+	&vdisk_mmap_backend,
+	&vdisk_pio_backend,
+	&vdisk_uring_backend,
+};
+
+/*
+ * Map the whole disk. Anonymous disks are just zero filled memory; the
+ * kernel only allocates the pages that get written.
+ */
+static int vdisk_mmap_init(struct vdisk_backend *be,
+			   struct vdisk_backend_args *args)
+{
+	int prot = PROT_READ|PROT_WRITE;
+	int flags = be->private ? MAP_PRIVATE : MAP_SHARED;
+
+	if (be->read_only && !be->private)
+		prot = PROT_READ;
+
+	if (be->fd < 0)
+		flags |= MAP_ANONYMOUS | MAP_NORESERVE;
+
+	be->mem = mmap(NULL, be->size, prot, flags, be->fd, 0x0);
+	if (be->mem == MAP_FAILED) {
+		be->mem = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int vdisk_mmap_read(struct vdisk_backend *be, void *buf,
+			   u64 offs, u64 len)
+{
+	u64 avail = offs < be->size ? min(len, be->size - offs) : 0;
+
+	memcpy(buf, be->mem + offs, avail);
+	memset((u8 *)buf + avail, 0, len - avail);
+
+	return 0;
+}
+
+static int vdisk_mmap_write(struct vdisk_backend *be, const void *buf,
+			    u64 offs, u64 len)
+{
+	if (offs > be->size || len > be->size - offs)
+		return -1;
+
+	memcpy(be->mem + offs, buf, len);
+
+	return 0;
+}
+
+/*
+ * For a shared mapping a ranged msync() is a ranged fdatasync().
+ */
+static int vdisk_mmap_flush(struct vdisk_backend *be, u64 offs, u64 len)
+{
+	u64 start = offs & ~((u64)KB(4) - 1);
+
+	if (be->fd < 0 || be->private || start >= be->size)
+		return 0;
+
+	len = min(offs + len, be->size) - start;
+
+	return msync(be->mem + start, len, MS_SYNC);
+}
+
+static int vdisk_mmap_discard(struct vdisk_backend *be, u64 offs, u64 len)
+{
+	u64 start, end;
+
+	if (offs >= be->size)
+		return 0;
+
+	len = min(len, be->size - offs);
+
+	if (be->fd >= 0 && !be->private)
+		return vdisk_backend_punch(be, offs, len);
+
+	/*
+	 * Anonymous memory can just be handed back; whole pages read as
+	 * zeros afterwards. A private file mapping would revert to the
+	 * file contents, so that has to be zeroed by hand.
+	 */
+	start = (offs + KB(4) - 1) & ~((u64)KB(4) - 1);
+	end   = (offs + len) & ~((u64)KB(4) - 1);
+
+	if (be->fd >= 0 || start >= end ||
+	    madvise(be->mem + start, end - start, MADV_DONTNEED)) {
+		memset(be->mem + offs, 0, len);
+		return 0;
+	}
+
+	memset(be->mem + offs, 0, start - offs);
+	memset(be->mem + end, 0, offs + len - end);
+
+	return 0;
+}
+
+const struct vdisk_backend_ops vdisk_mmap_backend = {
+	.name    = "mmap",
+	.init    = vdisk_mmap_init,
+	.read    = vdisk_mmap_read,
+	.write   = vdisk_mmap_write,
+	.flush   = vdisk_mmap_flush,
+	.discard = vdisk_mmap_discard,
+};
+
+/*
+ * Punch a hole in a file backed disk. Not every filesystem can do that,
+ * in which case fall back to writing zeros.
+ */
+int vdisk_backend_punch(struct vdisk_backend *be, u64 offs, u64 len)
+{
+	static const u8 zeros[KB(4)];
+	u64 chunk;
+
+	if (offs >= be->size)
+		return 0;
+
+	len = min(len, be->size - offs);
+
+	if (fallocate(be->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      offs, len) == 0)
+		return 0;
+
+	while (len) {
+		chunk = min(len, (u64)KB(4));
+		if (be->ops->write(be, zeros, offs, chunk))
+			return -1;
+		offs += chunk;
+		len  -= chunk;
+	}
+
+	return 0;
+}
+
+static const struct vdisk_backend_ops *vdisk_find_backend(const char *name)
+{
+	u32 i;
+
+	for (i = 0; i < sizeof(vdisk_backends) / sizeof(vdisk_backends[0]);
+	     i++) {
+		if (strcmp(vdisk_backends[i]->name, name) == 0)
+			return vdisk_backends[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Open a disk with the backend named in args. A NULL path makes an
+ * anonymous, in memory disk of the given size; this is always backed by
+ * mmap. Otherwise the size comes from the file.
+ */
+struct vdisk_backend *vdisk_backend_open(const char *path, u64 size,
+					 bool read_only, bool private,
+					 struct vdisk_backend_args *args)
+{
+	struct vdisk_backend *be;
+	struct stat buf;
+
+	be = malloc(sizeof(*be));
+	r5sim_assert(be != NULL);
+
+	memset(be, 0, sizeof(*be));
+
+	be->fd = -1;
+	be->size = size;
+	be->read_only = read_only;
+	be->private = private;
+
+	if (!path) {
+		be->ops = &vdisk_mmap_backend;
+		if (be->ops->init(be, args))
+			r5sim_assert(!"Failed to allocate VDISK memory!");
+		return be;
+	}
+
+	be->ops = vdisk_find_backend(args->backend);
+	if (!be->ops) {
+		r5sim_err("Unknown VDISK backend: %s\n", args->backend);
+		r5sim_assert(!"Bad VDISK backend");
+	}
+
+	be->fd = open(path, read_only || private ? O_RDONLY : O_RDWR);
+	if (be->fd < 0) {
+		perror(path);
+		r5sim_assert(!"Failed to open VDISK path");
+	}
+
+	if (fstat(be->fd, &buf) < 0) {
+		perror(path);
+		r5sim_assert(!"Failed to stat!");
+	}
+
+	be->size = buf.st_size;
+
+	if (be->ops->init(be, args) == 0)
+		return be;
+
+	/*
+	 * io_uring may not be available (old kernel, seccomp, etc); plain
+	 * pread/pwrite always is.
+	 */
+	if (be->ops == &vdisk_uring_backend) {
+		r5sim_warn("%s: io_uring unavailable; using pio\n", path);
+		be->ops = &vdisk_pio_backend;
+		if (be->ops->init(be, args) == 0)
+			return be;
+	}
+
+	perror(path);
+	r5sim_assert(!"Failed to init VDISK backend!");
+
+	return NULL;
+}
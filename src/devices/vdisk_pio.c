@@ -0,0 +1,352 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * pread()/pwrite() VDISK backend with a bounded LRU page cache.
+ *
+ * The cache is write-through, so it never holds dirty data: writes go
+ * straight to the file and update any cached copies. On a miss the cache
+ * reads ahead with a single preadv() straight into the cache pages.
+ * Transfers that are big relative to the cache skip it entirely rather
+ * than flushing everything else out.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/uio.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/list.h>
+#include <r5sim/util.h>
+#include <r5sim/vdisk.h>
+
+#define pio_dbg r5sim_dbg_vv
+
+#define PIO_PAGE_INVALID	((u64)-1)
+#define PIO_MAX_READAHEAD	64
+
+struct pio_page {
+	u64			 page;
+	u8			*data;
+
+	struct list_head	 lru_node;
+	struct list_head	 hash_node;
+};
+
+struct pio_cache {
+	struct pio_page		*pages;
+	u8			*data;
+	u32			 nr_pages;
+	u32			 readahead;
+
+	/*
+	 * Most recently used pages are at the head.
+	 */
+	struct list_head	 lru;
+
+	struct list_head	*hash;
+	u32			 hash_bits;
+};
+
+static u32 pio_hash(struct pio_cache *cache, u64 page)
+{
+	return (page * 0x9e3779b97f4a7c15ULL) >> (64 - cache->hash_bits);
+}
+
+static struct pio_page *pio_lookup(struct pio_cache *cache, u64 page)
+{
+	struct pio_page *p;
+
+	list_for_each_entry(p, &cache->hash[pio_hash(cache, page)],
+			    hash_node) {
+		if (p->page == page)
+			return p;
+	}
+
+	return NULL;
+}
+
+/*
+ * Take the least recently used page for reuse. It's moved to the head of
+ * the LRU so that the next eviction picks a different page.
+ */
+static struct pio_page *pio_evict(struct pio_cache *cache)
+{
+	struct pio_page *p = list_last_entry(&cache->lru, struct pio_page,
+					     lru_node);
+
+	if (p->page != PIO_PAGE_INVALID)
+		list_del_init(&p->hash_node);
+
+	p->page = PIO_PAGE_INVALID;
+	list_move(&p->lru_node, &cache->lru);
+
+	return p;
+}
+
+/*
+ * Read exactly len bytes unless we hit EOF. Returns the number of bytes
+ * read or -1.
+ */
+static ssize_t pio_pread_full(int fd, void *buf, u64 len, u64 offs)
+{
+	u64 done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, (u8 *)buf + done, len - done, offs + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static int pio_pwrite_full(int fd, const void *buf, u64 len, u64 offs)
+{
+	u64 done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pwrite(fd, (const u8 *)buf + done, len - done,
+			     offs + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill the cache starting at page, reading ahead until the readahead
+ * window is full, the disk ends, or we hit a page that's already cached.
+ */
+static struct pio_page *pio_fill(struct vdisk_backend *be, u64 page)
+{
+	struct pio_cache *cache = be->priv;
+	struct pio_page *fill[PIO_MAX_READAHEAD];
+	struct iovec iov[PIO_MAX_READAHEAD];
+	u64 disk_pages = (be->size + KB(4) - 1) / KB(4);
+	ssize_t got;
+	u32 i, nr = 0;
+
+	do {
+		fill[nr] = pio_evict(cache);
+		iov[nr].iov_base = fill[nr]->data;
+		iov[nr].iov_len = KB(4);
+		nr++;
+	} while (nr < cache->readahead && page + nr < disk_pages &&
+		 !pio_lookup(cache, page + nr));
+
+	do {
+		got = preadv(be->fd, iov, nr, page * KB(4));
+	} while (got < 0 && errno == EINTR);
+
+	if (got < 0)
+		got = 0;
+
+	pio_dbg("pio: miss @ %llu, read %u pages\n",
+		(unsigned long long)page, nr);
+
+	/*
+	 * Short reads are either EOF or rare enough not to care about;
+	 * only keep what we got and zero the tail of a partial last page.
+	 * Pages we didn't fill go back to the LRU tail.
+	 */
+	for (i = 0; i < nr; i++) {
+		if ((u64)got <= i * KB(4)) {
+			list_move_tail(&fill[i]->lru_node, &cache->lru);
+			continue;
+		}
+
+		if ((u64)got < (i + 1) * KB(4))
+			memset(fill[i]->data + (got - i * KB(4)), 0,
+			       (i + 1) * KB(4) - got);
+
+		fill[i]->page = page + i;
+		list_add(&fill[i]->hash_node,
+			 &cache->hash[pio_hash(cache, page + i)]);
+	}
+
+	return got ? fill[0] : NULL;
+}
+
+static int vdisk_pio_read(struct vdisk_backend *be, void *buf,
+			  u64 offs, u64 len)
+{
+	struct pio_cache *cache = be->priv;
+	struct pio_page *p;
+	u64 page, in, chunk;
+	u8 *dst = buf;
+	ssize_t got;
+
+	if (len >= (u64)cache->nr_pages * KB(4) / 4) {
+		got = pio_pread_full(be->fd, buf, len, offs);
+		if (got < 0)
+			return -1;
+		memset(dst + got, 0, len - got);
+		return 0;
+	}
+
+	while (len) {
+		page  = offs / KB(4);
+		in    = offs & (KB(4) - 1);
+		chunk = min(len, KB(4) - in);
+
+		if (offs >= be->size) {
+			memset(dst, 0, len);
+			return 0;
+		}
+
+		p = pio_lookup(cache, page);
+		if (!p)
+			p = pio_fill(be, page);
+		if (!p)
+			return -1;
+
+		list_move(&p->lru_node, &cache->lru);
+		memcpy(dst, p->data + in, chunk);
+
+		dst  += chunk;
+		offs += chunk;
+		len  -= chunk;
+	}
+
+	return 0;
+}
+
+static int vdisk_pio_write(struct vdisk_backend *be, const void *buf,
+			   u64 offs, u64 len)
+{
+	struct pio_cache *cache = be->priv;
+	struct pio_page *p;
+	u64 page, start, end;
+
+	if (offs > be->size || len > be->size - offs)
+		return -1;
+
+	if (pio_pwrite_full(be->fd, buf, len, offs))
+		return -1;
+
+	/*
+	 * Keep any cached copies up to date.
+	 */
+	for (page = offs / KB(4); page * KB(4) < offs + len; page++) {
+		p = pio_lookup(cache, page);
+		if (!p)
+			continue;
+
+		start = max(offs, page * KB(4));
+		end   = min(offs + len, (page + 1) * KB(4));
+
+		memcpy(p->data + (start - page * KB(4)),
+		       (const u8 *)buf + (start - offs), end - start);
+	}
+
+	return 0;
+}
+
+static int vdisk_pio_flush(struct vdisk_backend *be, u64 offs, u64 len)
+{
+	if (be->private)
+		return 0;
+
+	return fdatasync(be->fd);
+}
+
+static int vdisk_pio_discard(struct vdisk_backend *be, u64 offs, u64 len)
+{
+	struct pio_cache *cache = be->priv;
+	struct pio_page *p;
+	u64 page;
+
+	/*
+	 * Drop any cached pages first; the punch may fall back to writes
+	 * which would just update them again.
+	 */
+	for (page = offs / KB(4); page * KB(4) < offs + len; page++) {
+		p = pio_lookup(cache, page);
+		if (!p)
+			continue;
+
+		list_del_init(&p->hash_node);
+		p->page = PIO_PAGE_INVALID;
+		list_move_tail(&p->lru_node, &cache->lru);
+	}
+
+	return vdisk_backend_punch(be, offs, len);
+}
+
+static int vdisk_pio_init(struct vdisk_backend *be,
+			  struct vdisk_backend_args *args)
+{
+	struct pio_cache *cache;
+	u32 i;
+
+	cache = malloc(sizeof(*cache));
+	r5sim_assert(cache != NULL);
+
+	cache->nr_pages  = max(args->cache_pages, 4u);
+	cache->readahead = min(min(args->readahead, cache->nr_pages / 2),
+			       (u32)PIO_MAX_READAHEAD);
+	cache->readahead = max(cache->readahead, 1u);
+
+	cache->hash_bits = 1;
+	while ((1u << cache->hash_bits) < cache->nr_pages)
+		cache->hash_bits++;
+
+	cache->pages = calloc(cache->nr_pages, sizeof(*cache->pages));
+	cache->data  = malloc((u64)cache->nr_pages * KB(4));
+	cache->hash  = calloc(1u << cache->hash_bits, sizeof(*cache->hash));
+	r5sim_assert(cache->pages && cache->data && cache->hash);
+
+	INIT_LIST_HEAD(&cache->lru);
+	for (i = 0; i < (1u << cache->hash_bits); i++)
+		INIT_LIST_HEAD(&cache->hash[i]);
+
+	for (i = 0; i < cache->nr_pages; i++) {
+		cache->pages[i].page = PIO_PAGE_INVALID;
+		cache->pages[i].data = cache->data + (u64)i * KB(4);
+		INIT_LIST_HEAD(&cache->pages[i].hash_node);
+		list_add_tail(&cache->pages[i].lru_node, &cache->lru);
+	}
+
+	be->priv = cache;
+
+	return 0;
+}
+
+const struct vdisk_backend_ops vdisk_pio_backend = {
+	.name    = "pio",
+	.init    = vdisk_pio_init,
+	.read    = vdisk_pio_read,
+	.write   = vdisk_pio_write,
+	.flush   = vdisk_pio_flush,
+	.discard = vdisk_pio_discard,
+};
@@ -0,0 +1,300 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * io_uring VDISK backend. Transfers are split into chunks which are all
+ * put in flight at once (up to the queue depth), so a large op keeps the
+ * host storage busy rather than going one read at a time.
+ *
+ * This talks to the kernel directly rather than through liburing to
+ * avoid the extra dependency.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/util.h>
+#include <r5sim/vdisk.h>
+
+#define uring_dbg r5sim_dbg_vv
+
+#define URING_CHUNK		KB(128)
+
+/*
+ * How many io_uring_enter() failures in a row to put up with while I/O
+ * is still in flight. Giving up would leave the kernel writing into the
+ * caller's buffers, so there's nothing to do but assert.
+ */
+#define URING_MAX_FAILS		1000
+
+struct uring {
+	int			 fd;
+	u32			 depth;
+
+	u32			*sq_head;
+	u32			*sq_tail;
+	u32			*sq_mask;
+	u32			*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	u32			*cq_head;
+	u32			*cq_tail;
+	u32			*cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static int uring_setup(u32 entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int vdisk_uring_init(struct vdisk_backend *be,
+			    struct vdisk_backend_args *args)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+	size_t sq_size, cq_size;
+	u8 *sq, *cq;
+
+	ring = malloc(sizeof(*ring));
+	r5sim_assert(ring != NULL);
+
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = uring_setup(args->queue_depth, &p);
+	if (ring->fd < 0)
+		goto fail;
+
+	ring->depth = p.sq_entries;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = max(sq_size, cq_size);
+
+	sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else
+		cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, ring->fd,
+			  IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto fail_unmap_sq;
+
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_unmap_cq;
+
+	ring->sq_head  = (u32 *)(sq + p.sq_off.head);
+	ring->sq_tail  = (u32 *)(sq + p.sq_off.tail);
+	ring->sq_mask  = (u32 *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (u32 *)(sq + p.sq_off.array);
+
+	ring->cq_head  = (u32 *)(cq + p.cq_off.head);
+	ring->cq_tail  = (u32 *)(cq + p.cq_off.tail);
+	ring->cq_mask  = (u32 *)(cq + p.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	be->priv = ring;
+
+	return 0;
+
+fail_unmap_cq:
+	if (cq != sq)
+		munmap(cq, cq_size);
+fail_unmap_sq:
+	munmap(sq, sq_size);
+fail_close:
+	close(ring->fd);
+fail:
+	free(ring);
+	return -1;
+}
+
+static void uring_queue(struct uring *ring, u8 opcode, int fd,
+			u8 *buf, u32 len, u64 offs, u64 user_data)
+{
+	u32 tail = *ring->sq_tail;
+	u32 idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = opcode;
+	sqe->fd        = fd;
+	sqe->addr      = (u64)(uintptr_t)buf;
+	sqe->len       = len;
+	sqe->off       = offs;
+	sqe->user_data = user_data;
+
+	ring->sq_array[idx] = idx;
+
+	/*
+	 * The kernel must see the SQE before the new tail.
+	 */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Run a read or write of len bytes at offs through the ring. Each chunk
+ * is tagged with its offset into buf. Short transfers are finished off
+ * by re-queuing the remainder; a short read at EOF is zero filled.
+ *
+ * Once a chunk is queued the kernel owns it until its CQE comes back, so
+ * this never returns with anything in flight, errors included: the
+ * kernel would keep writing into buf after the caller is done with it,
+ * and the next call would reap the stale CQEs as its own.
+ */
+static int uring_rw(struct vdisk_backend *be, u8 opcode,
+		    u8 *buf, u64 offs, u64 len)
+{
+	struct uring *ring = be->priv;
+	struct io_uring_cqe *cqe;
+	u64 pos = 0, done, chunk;
+	u32 inflight = 0, to_submit = 0, fails = 0, head;
+	int ret, err = 0;
+
+	while ((pos < len && !err) || inflight) {
+		while (pos < len && !err && inflight < ring->depth) {
+			chunk = min(len - pos, (u64)URING_CHUNK);
+			uring_queue(ring, opcode, be->fd, buf + pos, chunk,
+				    offs + pos, (pos << 24) | chunk);
+			pos += chunk;
+			inflight++;
+			to_submit++;
+		}
+
+		/*
+		 * After an error just wait for everything still in flight.
+		 * Queued SQEs can't be taken back, so they're submitted
+		 * and waited for, too.
+		 */
+		ret = uring_enter(ring->fd, to_submit, err ? inflight : 1,
+				  IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR) {
+			uring_dbg("uring: enter failed: %d\n", errno);
+			err = -1;
+			r5sim_assert(++fails < URING_MAX_FAILS);
+		} else if (ret >= 0) {
+			to_submit -= min((u32)ret, to_submit);
+			fails = 0;
+		}
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail,
+					       __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			head++;
+			inflight--;
+
+			done  = cqe->user_data >> 24;
+			chunk = cqe->user_data & 0xffffff;
+
+			if (cqe->res < 0) {
+				err = -1;
+				continue;
+			}
+
+			if ((u64)cqe->res == chunk || err)
+				continue;
+
+			done  += cqe->res;
+			chunk -= cqe->res;
+
+			if (opcode == IORING_OP_READ &&
+			    (cqe->res == 0 || offs + done >= be->size)) {
+				memset(buf + done, 0, chunk);
+				continue;
+			}
+
+			uring_dbg("uring: short I/O @ %llu\n",
+				  (unsigned long long)(offs + done));
+
+			uring_queue(ring, opcode, be->fd, buf + done, chunk,
+				    offs + done, (done << 24) | chunk);
+			inflight++;
+			to_submit++;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return err;
+}
+
+static int vdisk_uring_read(struct vdisk_backend *be, void *buf,
+			    u64 offs, u64 len)
+{
+	return uring_rw(be, IORING_OP_READ, buf, offs, len);
+}
+
+static int vdisk_uring_write(struct vdisk_backend *be, const void *buf,
+			     u64 offs, u64 len)
+{
+	if (offs > be->size || len > be->size - offs)
+		return -1;
+
+	return uring_rw(be, IORING_OP_WRITE, (u8 *)buf, offs, len);
+}
+
+/*
+ * Flushes and discards are rare and synchronous anyway, so there's no
+ * point in sending them through the ring.
+ */
+static int vdisk_uring_flush(struct vdisk_backend *be, u64 offs, u64 len)
+{
+	if (be->private)
+		return 0;
+
+	return fdatasync(be->fd);
+}
+
+static int vdisk_uring_discard(struct vdisk_backend *be, u64 offs, u64 len)
+{
+	return vdisk_backend_punch(be, offs, len);
+}
+
+const struct vdisk_backend_ops vdisk_uring_backend = {
+	.name    = "uring",
+	.init    = vdisk_uring_init,
+	.read    = vdisk_uring_read,
+	.write   = vdisk_uring_write,
+	.flush   = vdisk_uring_flush,
+	.discard = vdisk_uring_discard,
+};
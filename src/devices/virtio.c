@@ -0,0 +1,630 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * virtio-mmio transport with split virtqueues.
+ *
+ * Software queues any number of requests in the avail ring and writes
+ * QUEUE_NOTIFY once; a worker thread then drains the ring in a batch.
+ * While the worker is draining a ring it asks the driver not to notify,
+ * and it only interrupts the core once per batch (and only if the driver
+ * wants an interrupt), so a busy driver costs very few MMIO traps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/core.h>
+#include <r5sim/plic.h>
+#include <r5sim/util.h>
+#include <r5sim/iodev.h>
+#include <r5sim/ioloop.h>
+#include <r5sim/virtio.h>
+#include <r5sim/machine.h>
+
+#include <r5sim/hw/virtio.h>
+
+#define virtio_dbg r5sim_dbg_v
+
+#define VIRTIO_MMIO_VENDOR_R5SIM	0x6d697335 /* "5sim" */
+
+struct virtio_queue {
+	u32			 num;
+	u32			 ready;
+
+	/*
+	 * The driver writes these as LOW/HIGH halves; only addresses below
+	 * 4GB can be in DRAM.
+	 */
+	u64			 desc_addr;
+	u64			 driver_addr;
+	u64			 device_addr;
+
+	/*
+	 * Host pointers to the rings; valid while ready is set.
+	 */
+	struct virtq_desc	*desc;
+	struct virtq_avail	*avail;
+	struct virtq_used	*used;
+
+	/*
+	 * Only touched by the worker.
+	 */
+	u16			 last_avail;
+	u16			 used_idx;
+};
+
+struct r5sim_virtio {
+	const struct r5sim_virtio_ops	*ops;
+	void				*priv;
+
+	struct r5sim_machine		*mach;
+	u32				 irq;
+
+	u32			 status;
+	u32			 dev_features_sel;
+	u32			 drv_features_sel;
+	u64			 drv_features;
+	u32			 queue_sel;
+
+	/*
+	 * Set by the worker, cleared by the core.
+	 */
+	u32			 int_status;
+
+	struct virtio_queue	 queues[R5SIM_VIRTIO_MAX_QUEUES];
+
+	/*
+	 * The worker waits on cond for kick to be set; kick is accessed
+	 * atomically so that notifies don't wait on the worker.
+	 *
+	 * The queue lock is held by the worker while it processes the
+	 * rings; the core takes it when it changes queue state (ready or
+	 * reset) so that the rings don't change under the worker.
+	 */
+	pthread_t		 worker;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	u32			 kick;
+
+	pthread_mutex_t		 queue_lock;
+
+	/*
+	 * Scratch space for the worker.
+	 */
+	struct r5sim_virtio_req	 req;
+};
+
+void *r5sim_virtio_priv(struct r5sim_virtio *vio)
+{
+	return vio->priv;
+}
+
+static u64 virtio_dev_features(struct r5sim_virtio *vio)
+{
+	return vio->ops->features |
+		(1ULL << VIRTIO_F_VERSION_1) |
+		(1ULL << VIRTIO_RING_F_EVENT_IDX);
+}
+
+static bool virtio_has_feature(struct r5sim_virtio *vio, u32 bit)
+{
+	return (vio->drv_features & (1ULL << bit)) != 0;
+}
+
+/*
+ * Translate a physical address range to host memory. Rings and buffers
+ * must live in DRAM. The driver picks addr and len, so don't add them:
+ * a large enough addr would wrap.
+ */
+static void *virtio_dram(struct r5sim_machine *mach, u64 addr, u64 len)
+{
+	u64 offs = addr - mach->memory_base;
+
+	if (addr < mach->memory_base ||
+	    offs > mach->memory_size ||
+	    len > mach->memory_size - offs)
+		return NULL;
+
+	return mach->memory + (addr - mach->memory_base);
+}
+
+/*
+ * The u16 after the last ring entry of each ring is used for event index
+ * based suppression.
+ */
+static u16 *virtio_used_event(struct virtio_queue *q)
+{
+	return &q->avail->ring[q->num];
+}
+
+static u16 *virtio_avail_event(struct virtio_queue *q)
+{
+	return (u16 *)&q->used->ring[q->num];
+}
+
+/*
+ * Whether the driver wants an interrupt for the used ring moving from
+ * old to new. Same as vring_need_event() from the spec.
+ */
+static bool virtio_need_event(u16 event, u16 new, u16 old)
+{
+	return (u16)(new - event - 1) < (u16)(new - old);
+}
+
+static void virtio_enable_notify(struct r5sim_virtio *vio,
+				 struct virtio_queue *q, bool enable)
+{
+	if (virtio_has_feature(vio, VIRTIO_RING_F_EVENT_IDX)) {
+		/*
+		 * With event indexes there's no way to turn notifies off;
+		 * leaving avail_event behind last_avail does the trick.
+		 */
+		if (enable)
+			__atomic_store_n(virtio_avail_event(q), q->last_avail,
+					 __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_store_n(&q->used->flags,
+			 enable ? 0 : VIRTQ_USED_F_NO_NOTIFY,
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Walk a descriptor chain and translate it to host buffers.
+ */
+static int virtio_map_chain(struct r5sim_virtio *vio,
+			    struct virtio_queue *q, u16 head,
+			    struct r5sim_virtio_req *req)
+{
+	struct virtq_desc *desc;
+	u16 i = head;
+
+	req->nr_segs = 0;
+
+	do {
+		if (i >= q->num || req->nr_segs >= q->num)
+			return -1;
+
+		desc = &q->desc[i];
+
+		if (desc->flags & VIRTQ_DESC_F_INDIRECT)
+			return -1;
+
+		/*
+		 * A buffer outside of DRAM is left NULL for the device to
+		 * fail; the request can still be completed with an error.
+		 */
+		req->segs[req->nr_segs].mem =
+			virtio_dram(vio->mach, desc->addr, desc->len);
+		req->segs[req->nr_segs].len = desc->len;
+		req->segs[req->nr_segs].write =
+			(desc->flags & VIRTQ_DESC_F_WRITE) != 0;
+
+		req->nr_segs++;
+		i = desc->next;
+	} while (desc->flags & VIRTQ_DESC_F_NEXT);
+
+	return 0;
+}
+
+/*
+ * Drain a queue. Returns true if the driver should be interrupted.
+ */
+static bool virtio_process_queue(struct r5sim_virtio *vio, u32 qi)
+{
+	struct virtio_queue *q = &vio->queues[qi];
+	u16 old_used = q->used_idx;
+	u16 head;
+	u32 len;
+
+	if (!q->ready)
+		return false;
+
+	while (1) {
+		virtio_enable_notify(vio, q, false);
+
+		/*
+		 * Pairs with the driver's barrier before it bumps the
+		 * avail index: once we see the index the entries are valid.
+		 */
+		while (__atomic_load_n(&q->avail->idx, __ATOMIC_ACQUIRE) !=
+		       q->last_avail) {
+			head = q->avail->ring[q->last_avail % q->num];
+			q->last_avail++;
+
+			len = 0;
+			if (virtio_map_chain(vio, q, head, &vio->req) == 0)
+				len = vio->ops->handle_req(vio, qi, &vio->req);
+			else
+				virtio_dbg("virtio: bad chain @ %u\n", head);
+
+			q->used->ring[q->used_idx % q->num].id  = head;
+			q->used->ring[q->used_idx % q->num].len = len;
+			q->used_idx++;
+
+			__atomic_store_n(&q->used->idx, q->used_idx,
+					 __ATOMIC_RELEASE);
+		}
+
+		/*
+		 * Turn notifies back on and check once more; otherwise the
+		 * driver could add a request after our last check but
+		 * before notifies were enabled and never notify us.
+		 */
+		virtio_enable_notify(vio, q, true);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&q->avail->idx, __ATOMIC_ACQUIRE) ==
+		    q->last_avail)
+			break;
+	}
+
+	if (q->used_idx == old_used)
+		return false;
+
+	if (virtio_has_feature(vio, VIRTIO_RING_F_EVENT_IDX))
+		return virtio_need_event(
+			__atomic_load_n(virtio_used_event(q), __ATOMIC_RELAXED),
+			q->used_idx, old_used);
+
+	return !(__atomic_load_n(&q->avail->flags, __ATOMIC_RELAXED) &
+		 VIRTQ_AVAIL_F_NO_INTERRUPT);
+}
+
+static void virtio_raise_irq(struct r5sim_virtio *vio, u32 reason)
+{
+	__atomic_or_fetch(&vio->int_status, reason, __ATOMIC_SEQ_CST);
+	r5sim_plic_raise(vio->mach->plic, vio->irq);
+}
+
+/*
+ * Drop the PLIC line once every reason is acked; the worker may raise
+ * another meanwhile.
+ */
+static void virtio_ack_irq(struct r5sim_virtio *vio, u32 reason)
+{
+	if (__atomic_and_fetch(&vio->int_status, ~reason, __ATOMIC_SEQ_CST))
+		return;
+
+	r5sim_plic_lower(vio->mach->plic, vio->irq);
+
+	if (__atomic_load_n(&vio->int_status, __ATOMIC_SEQ_CST))
+		r5sim_plic_raise(vio->mach->plic, vio->irq);
+}
+
+static void *virtio_worker(void *data)
+{
+	struct r5sim_virtio *vio = data;
+	bool irq;
+	u32 i;
+
+	while (1) {
+		pthread_mutex_lock(&vio->lock);
+		while (!__atomic_exchange_n(&vio->kick, 0, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&vio->cond, &vio->lock);
+		pthread_mutex_unlock(&vio->lock);
+
+		pthread_mutex_lock(&vio->queue_lock);
+
+		irq = false;
+		if (vio->status & VIRTIO_STATUS_DRIVER_OK) {
+			for (i = 0; i < vio->ops->nr_queues; i++)
+				irq |= virtio_process_queue(vio, i);
+		}
+
+		pthread_mutex_unlock(&vio->queue_lock);
+
+		/*
+		 * Software may be polling the used rings instead.
+		 */
+		r5sim_machine_kick(vio->mach);
+
+		if (irq)
+			virtio_raise_irq(vio, VIRTIO_MMIO_INT_VRING);
+	}
+
+	return NULL;
+}
+
+static void virtio_kick(struct r5sim_virtio *vio)
+{
+	__atomic_store_n(&vio->kick, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&vio->lock);
+	pthread_cond_signal(&vio->cond);
+	pthread_mutex_unlock(&vio->lock);
+}
+
+static void virtio_reset(struct r5sim_virtio *vio)
+{
+	pthread_mutex_lock(&vio->queue_lock);
+
+	vio->status = 0;
+	vio->dev_features_sel = 0;
+	vio->drv_features_sel = 0;
+	vio->drv_features = 0;
+	vio->queue_sel = 0;
+	memset(vio->queues, 0, sizeof(vio->queues));
+	virtio_ack_irq(vio, ~0U);
+
+	pthread_mutex_unlock(&vio->queue_lock);
+}
+
+static void virtio_queue_set_ready(struct r5sim_virtio *vio,
+				   struct virtio_queue *q, u32 ready)
+{
+	pthread_mutex_lock(&vio->queue_lock);
+
+	q->ready = 0;
+
+	if (!ready)
+		goto done;
+
+	if (q->num == 0 || q->num > R5SIM_VIRTIO_QUEUE_NUM_MAX ||
+	    (q->num & (q->num - 1))) {
+		virtio_dbg("virtio: bad queue size: %u\n", q->num);
+		goto done;
+	}
+
+	if ((q->desc_addr | q->driver_addr | q->device_addr) >> 32) {
+		virtio_dbg("virtio: queue rings above 4GB!\n");
+		goto done;
+	}
+
+	/*
+	 * Include the event index words at the end of both rings.
+	 */
+	q->desc  = virtio_dram(vio->mach, q->desc_addr,
+			       sizeof(struct virtq_desc) * q->num);
+	q->avail = virtio_dram(vio->mach, q->driver_addr,
+			       sizeof(struct virtq_avail) + 2 * q->num + 2);
+	q->used  = virtio_dram(vio->mach, q->device_addr,
+			       sizeof(struct virtq_used) +
+			       sizeof(struct virtq_used_elem) * q->num + 2);
+
+	if (!q->desc || !q->avail || !q->used) {
+		virtio_dbg("virtio: queue rings not in DRAM!\n");
+		goto done;
+	}
+
+	q->last_avail = 0;
+	q->used_idx = 0;
+	q->ready = 1;
+
+done:
+	pthread_mutex_unlock(&vio->queue_lock);
+}
+
+static void virtio_set_low(u64 *addr, u32 val)
+{
+	*addr = (*addr & 0xffffffff00000000ULL) | val;
+}
+
+static void virtio_set_high(u64 *addr, u32 val)
+{
+	*addr = (*addr & 0xffffffff) | ((u64)val << 32);
+}
+
+static u32 virtio_mmio_readl(struct r5sim_iodev *iodev, u32 offs)
+{
+	struct r5sim_virtio *vio = iodev->priv;
+	struct virtio_queue *q = &vio->queues[vio->queue_sel];
+	u64 features;
+
+	virtio_dbg("%s: LOAD  @ 0x%03x\n", iodev->name, offs);
+
+	if (offs >= VIRTIO_MMIO_CONFIG)
+		return vio->ops->config_readl(vio, offs - VIRTIO_MMIO_CONFIG);
+
+	switch (offs) {
+	case VIRTIO_MMIO_MAGIC_VALUE:
+		return VIRTIO_MMIO_MAGIC;
+	case VIRTIO_MMIO_VERSION:
+		return 2;
+	case VIRTIO_MMIO_DEVICE_ID:
+		return vio->ops->device_id;
+	case VIRTIO_MMIO_VENDOR_ID:
+		return VIRTIO_MMIO_VENDOR_R5SIM;
+	case VIRTIO_MMIO_DEVICE_FEATURES:
+		features = virtio_dev_features(vio);
+		if (vio->dev_features_sel == 0)
+			return features & 0xffffffff;
+		if (vio->dev_features_sel == 1)
+			return features >> 32;
+		return 0;
+	case VIRTIO_MMIO_QUEUE_NUM_MAX:
+		return vio->queue_sel < vio->ops->nr_queues ?
+			R5SIM_VIRTIO_QUEUE_NUM_MAX : 0;
+	case VIRTIO_MMIO_QUEUE_READY:
+		return q->ready;
+	case VIRTIO_MMIO_INTERRUPT_STATUS:
+		return __atomic_load_n(&vio->int_status, __ATOMIC_ACQUIRE);
+	case VIRTIO_MMIO_STATUS:
+		return vio->status;
+	case VIRTIO_MMIO_CONFIG_GENERATION:
+		return 0;
+	}
+
+	return 0;
+}
+
+static void virtio_set_status(struct r5sim_virtio *vio, u32 val)
+{
+	u64 dev_features = virtio_dev_features(vio);
+
+	if (val == 0) {
+		virtio_reset(vio);
+		return;
+	}
+
+	/*
+	 * Refuse feature sets we didn't offer; and we are a modern only
+	 * device so VERSION_1 is a must.
+	 */
+	if ((val & VIRTIO_STATUS_FEATURES_OK) &&
+	    !(vio->status & VIRTIO_STATUS_FEATURES_OK) &&
+	    ((vio->drv_features & ~dev_features) ||
+	     !virtio_has_feature(vio, VIRTIO_F_VERSION_1)))
+		val &= ~VIRTIO_STATUS_FEATURES_OK;
+
+	pthread_mutex_lock(&vio->queue_lock);
+	vio->status = val;
+	pthread_mutex_unlock(&vio->queue_lock);
+
+	/*
+	 * The driver may have queued requests before DRIVER_OK.
+	 */
+	if (val & VIRTIO_STATUS_DRIVER_OK)
+		virtio_kick(vio);
+}
+
+static void virtio_mmio_writel(struct r5sim_iodev *iodev,
+			       u32 offs, u32 val)
+{
+	struct r5sim_virtio *vio = iodev->priv;
+	struct virtio_queue *q = &vio->queues[vio->queue_sel];
+
+	virtio_dbg("%s: STORE @ 0x%03x v=0x%08x\n", iodev->name, offs, val);
+
+	switch (offs) {
+	case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+		vio->dev_features_sel = val;
+		return;
+	case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+		vio->drv_features_sel = val;
+		return;
+	case VIRTIO_MMIO_DRIVER_FEATURES:
+		if (vio->status & VIRTIO_STATUS_FEATURES_OK)
+			return;
+		if (vio->drv_features_sel == 0)
+			vio->drv_features = (vio->drv_features &
+					     0xffffffff00000000ULL) | val;
+		else if (vio->drv_features_sel == 1)
+			vio->drv_features = (vio->drv_features & 0xffffffff) |
+				((u64)val << 32);
+		return;
+	case VIRTIO_MMIO_QUEUE_SEL:
+		if (val < vio->ops->nr_queues)
+			vio->queue_sel = val;
+		return;
+	case VIRTIO_MMIO_QUEUE_NOTIFY:
+		virtio_kick(vio);
+		return;
+	case VIRTIO_MMIO_INTERRUPT_ACK:
+		virtio_ack_irq(vio, val);
+		return;
+	case VIRTIO_MMIO_STATUS:
+		virtio_set_status(vio, val);
+		return;
+	}
+
+	/*
+	 * Queue config can only change while the queue is disabled.
+	 */
+	if (q->ready && offs != VIRTIO_MMIO_QUEUE_READY)
+		return;
+
+	switch (offs) {
+	case VIRTIO_MMIO_QUEUE_NUM:
+		q->num = val;
+		return;
+	case VIRTIO_MMIO_QUEUE_READY:
+		virtio_queue_set_ready(vio, q, val & 0x1);
+		return;
+	case VIRTIO_MMIO_QUEUE_DESC_LOW:
+		virtio_set_low(&q->desc_addr, val);
+		return;
+	case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+		virtio_set_high(&q->desc_addr, val);
+		return;
+	case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+		virtio_set_low(&q->driver_addr, val);
+		return;
+	case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+		virtio_set_high(&q->driver_addr, val);
+		return;
+	case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+		virtio_set_low(&q->device_addr, val);
+		return;
+	case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+		virtio_set_high(&q->device_addr, val);
+		return;
+	}
+
+	virtio_dbg("  Invalid WRITE.\n");
+}
+
+/*
+ * Other fields will be filled in on instantiation.
+ */
+static struct r5sim_iodev virtio_mmio = {
+	.io_size   = 0x1000,
+
+	.readl     = virtio_mmio_readl,
+	.writel    = virtio_mmio_writel,
+};
+
+struct r5sim_iodev *r5sim_virtio_mmio_new(
+	struct r5sim_machine *mach,
+	u32 io_offs,
+	u32 irq,
+	const char *name,
+	const struct r5sim_virtio_ops *ops,
+	void *priv)
+{
+	struct r5sim_iodev *dev;
+	struct r5sim_virtio *vio;
+
+	r5sim_assert(ops->nr_queues <= R5SIM_VIRTIO_MAX_QUEUES);
+
+	dev = malloc(sizeof(*dev));
+	r5sim_assert(dev != NULL);
+
+	*dev = virtio_mmio;
+
+	vio = malloc(sizeof(*vio));
+	r5sim_assert(vio != NULL);
+
+	memset(vio, 0, sizeof(*vio));
+
+	vio->ops = ops;
+	vio->priv = priv;
+	vio->mach = mach;
+	vio->irq = irq;
+
+	pthread_mutex_init(&vio->lock, NULL);
+	pthread_mutex_init(&vio->queue_lock, NULL);
+	pthread_cond_init(&vio->cond, NULL);
+
+	if (pthread_create(&vio->worker, NULL, virtio_worker, vio))
+		r5sim_assert(!"Failed to create virtio worker!");
+
+	r5sim_ioloop_pin(mach->ioloop, vio->worker);
+
+	dev->name = name;
+	dev->mach = mach;
+	dev->io_offset = io_offs;
+	dev->priv = vio;
+
+	return dev;
+}
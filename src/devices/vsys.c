@@ -19,15 +19,18 @@
  * system that code running on the system may want.
  */
 
-#include <time.h>
-#include <signal.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include <r5sim/log.h>
 #include <r5sim/env.h>
 #include <r5sim/csr.h>
+#include <r5sim/list.h>
 #include <r5sim/core.h>
 #include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
 #include <r5sim/iodev.h>
 #include <r5sim/machine.h>
 
@@ -35,13 +38,57 @@
 
 #define vsys_dbg r5sim_dbg_v
 
-#define VSYS_TIMERS	1
+/*
+ * The timers live on a hierarchical timer wheel with 1ns ticks. Level L
+ * has 64 slots of 64^L ticks each; a timer goes in the lowest level whose
+ * span covers its expiry and trickles down a level each time the wheel
+ * reaches its slot. The wheel's event is only ever scheduled for the next
+ * slot with something in it, so idle timers cost nothing and a timer far
+ * in the future only causes a handful of wakeups on its way down.
+ */
+#define VSYS_WHEEL_BITS		6
+#define VSYS_WHEEL_SLOTS	(1 << VSYS_WHEEL_BITS)
+#define VSYS_WHEEL_LEVELS	8
+
+struct vsys_timer {
+	u32              config;
+	u32              interval;
+
+	bool             armed;
+	u64              expires;	/* ns, simulator clock */
+	u64              period;	/* ns; 0 for one-shot */
+
+	u32              level;
+	u32              slot;
+	struct list_head wheel_node;
+};
+
+struct vsys_wheel {
+	/*
+	 * Time up to which the wheel has been processed.
+	 */
+	u64              now;
+
+	u64              pending[VSYS_WHEEL_LEVELS];
+	struct list_head slots[VSYS_WHEEL_LEVELS][VSYS_WHEEL_SLOTS];
+};
 
 struct vsys_priv {
 	u32             dev_state[VSYS_MAX_REG >> 2];
 
-	timer_t         timer;
-	struct sigevent ev;
+	/*
+	 * The timers and the wheel are shared between the core (which
+	 * starts and stops timers) and the IO loop (which fires them);
+	 * the lock covers both. The wheel is driven by a single event on
+	 * the machine's event queue.
+	 */
+	struct r5sim_core      *core;
+	pthread_mutex_t         lock;
+	struct vsys_timer       timers[VSYS_TIMER_NR];
+	struct vsys_wheel       wheel;
+	struct r5sim_event      timer;
+	u64                     timer_armed;
+	u32                     timer_status;
 };
 
 static const char *vsys_reg_to_str(u32 reg)
@@ -53,9 +100,16 @@ static const char *vsys_reg_to_str(u32 reg)
 		[VSYS_TIMER_CONFIG]	= "VSYS_TIMER_CONFIG",
 		[VSYS_TIMER_INTERVAL]	= "VSYS_TIMER_INTERVAL",
 		[VSYS_M_SW_INTERRUPT]   = "VSYS_M_SW_INTERRUPT",
+		[VSYS_TIMER_STATUS]	= "VSYS_TIMER_STATUS",
+		[VSYS_TIMER_NR_TIMERS]	= "VSYS_TIMER_NR_TIMERS",
 	};
 
-	r5sim_assert(reg <= VSYS_MAX_REG);
+	if (reg >= VSYS_TIMER_BASE(0) && reg < VSYS_MAX_REG)
+		return (reg & 0xf) == VSYS_TIMERn_CONFIG ?
+			"VSYS_TIMERn_CONFIG" : "VSYS_TIMERn_INTERVAL";
+
+	if (reg >= sizeof(str_reg) / sizeof(str_reg[0]) || !str_reg[reg])
+		return "VSYS_INVALID";
 
 	return str_reg[reg];
 }
@@ -81,45 +135,264 @@ static u32 __vsys_read_state(struct vsys_priv *vsys, u32 __i)
 	return vsys->dev_state[i];
 }
 
-static void vsys_timer_notify(union sigval sv)
+static void vsys_wheel_init(struct vsys_wheel *wheel, u64 now)
+{
+	int l, s;
+
+	wheel->now = now;
+
+	for (l = 0; l < VSYS_WHEEL_LEVELS; l++) {
+		wheel->pending[l] = 0;
+		for (s = 0; s < VSYS_WHEEL_SLOTS; s++)
+			INIT_LIST_HEAD(&wheel->slots[l][s]);
+	}
+}
+
+static void vsys_wheel_add(struct vsys_wheel *wheel, struct vsys_timer *t)
+{
+	u64 expires = max(t->expires, wheel->now);
+	u64 delta = expires - wheel->now;
+	u32 level = 0, slot;
+
+	while (level < VSYS_WHEEL_LEVELS - 1 &&
+	       delta >= 1ULL << ((level + 1) * VSYS_WHEEL_BITS))
+		level++;
+
+	/*
+	 * Past the end of the wheel; park it in the furthest slot and let
+	 * it be re-filed when the wheel gets there.
+	 */
+	if (delta >= 1ULL << (VSYS_WHEEL_LEVELS * VSYS_WHEEL_BITS))
+		expires = wheel->now +
+			(1ULL << (VSYS_WHEEL_LEVELS * VSYS_WHEEL_BITS)) - 1;
+
+	slot = (expires >> (level * VSYS_WHEEL_BITS)) & (VSYS_WHEEL_SLOTS - 1);
+
+	t->level = level;
+	t->slot  = slot;
+	list_add_tail(&t->wheel_node, &wheel->slots[level][slot]);
+	wheel->pending[level] |= 1ULL << slot;
+}
+
+static void vsys_wheel_del(struct vsys_wheel *wheel, struct vsys_timer *t)
 {
-	struct r5sim_core *core = sv.sival_ptr;
+	list_del(&t->wheel_node);
 
-	r5sim_dbg("Timer fired!\n");
+	if (list_empty(&wheel->slots[t->level][t->slot]))
+		wheel->pending[t->level] &= ~(1ULL << t->slot);
+}
+
+/*
+ * When the wheel next has to do something: fire a level 0 slot or
+ * cascade a higher level slot. ~0 if the wheel is empty.
+ */
+static u64 vsys_wheel_next(struct vsys_wheel *wheel)
+{
+	u64 next = ~0ULL;
+	u32 level;
+
+	for (level = 0; level < VSYS_WHEEL_LEVELS; level++) {
+		u32 shift = level * VSYS_WHEEL_BITS;
+		u64 span = 1ULL << (shift + VSYS_WHEEL_BITS);
+		u64 cur = (wheel->now >> shift) & (VSYS_WHEEL_SLOTS - 1);
+		u64 pending = wheel->pending[level];
+		u64 rot, when;
+		u32 dist;
 
-	r5sim_core_intr_signal(core, CSR_MCAUSE_CODE_MTI);
+		if (!pending)
+			continue;
+
+		/*
+		 * Level 0 slots are due at their tick, which may be now.
+		 * Higher level slots are due at their next boundary
+		 * strictly after now.
+		 */
+		rot = level ? cur + 1 : cur;
+		rot &= VSYS_WHEEL_SLOTS - 1;
+		pending = pending >> rot | (rot ? pending << (64 - rot) : 0);
+		dist = __builtin_ctzll(pending) + (level ? 1 : 0);
+
+		when = (wheel->now & ~(span - 1)) + ((cur + dist) << shift);
+		next = min(next, when);
+	}
+
+	return next;
 }
 
-static void vsys_trigger_timer(struct vsys_priv *vsys)
+/*
+ * Fire a timer, and queue up its next period if it's periodic. The caller
+ * holds the lock.
+ */
+static void vsys_timer_fire(struct vsys_priv *vsys, struct vsys_timer *t,
+			    u64 now)
 {
-	struct itimerspec spec = { };
-	u64 interv = __vsys_read_state(vsys, VSYS_TIMER_INTERVAL);
-	u32 config = __vsys_read_state(vsys, VSYS_TIMER_CONFIG);
-	u32 prec = get_field(config, VSYS_TIMER_CONFIG_PRECISION);
+	u32 idx = t - vsys->timers;
+
+	vsys->timer_status |= 1 << idx;
+	t->armed = false;
+
+	if (!t->period)
+		return;
 
 	/*
-	 * Scale the incoming time to nanoseconds; then we'll fill
-	 * in the timer spec with the right second/ns split.
+	 * Periodic: drop any periods we've already missed.
 	 */
-	switch (prec) {
+	t->expires += t->period;
+	if (t->expires <= now)
+		t->expires += ((now - t->expires) / t->period + 1) * t->period;
+
+	t->armed = true;
+	vsys_wheel_add(&vsys->wheel, t);
+}
+
+/*
+ * Bring the wheel up to now, firing and cascading as we go. Returns true
+ * if any timer fired.
+ */
+static bool vsys_wheel_advance(struct vsys_priv *vsys, u64 now)
+{
+	struct vsys_wheel *wheel = &vsys->wheel;
+	struct vsys_timer *t, *tmp;
+	bool fired = false;
+	struct list_head due;
+	u64 next;
+	int level;
+	u32 slot;
+
+	while ((next = vsys_wheel_next(wheel)) <= now) {
+		wheel->now = next;
+
+		for (level = VSYS_WHEEL_LEVELS - 1; level >= 0; level--) {
+			u32 shift = level * VSYS_WHEEL_BITS;
+
+			if (level && (next & ((1ULL << shift) - 1)))
+				continue;
+
+			slot = (next >> shift) & (VSYS_WHEEL_SLOTS - 1);
+			if (!(wheel->pending[level] & (1ULL << slot)))
+				continue;
+
+			INIT_LIST_HEAD(&due);
+			list_splice_init(&wheel->slots[level][slot], &due);
+			wheel->pending[level] &= ~(1ULL << slot);
+
+			list_for_each_entry_safe(t, tmp, &due, wheel_node) {
+				list_del(&t->wheel_node);
+
+				if (level == 0 || t->expires <= next) {
+					vsys_timer_fire(vsys, t, now);
+					fired = true;
+				} else {
+					vsys_wheel_add(wheel, t);
+				}
+			}
+		}
+	}
+
+	wheel->now = now;
+
+	return fired;
+}
+
+/*
+ * Schedule the timer event for the wheel's next slot. The caller holds the
+ * lock.
+ */
+static void vsys_rearm(struct vsys_priv *vsys)
+{
+	u64 next = vsys_wheel_next(&vsys->wheel);
+
+	if (next == vsys->timer_armed)
+		return;
+
+	vsys->timer_armed = next;
+
+	/*
+	 * ~0 (an empty wheel) is R5SIM_EVENT_NEVER.
+	 */
+	r5sim_event_schedule(&vsys->timer, next);
+}
+
+static void vsys_timer_expired(struct r5sim_event *ev)
+{
+	struct vsys_priv *vsys = ev->priv;
+	bool fired;
+
+	pthread_mutex_lock(&vsys->lock);
+	vsys->timer_armed = ~0ULL;
+	fired = vsys_wheel_advance(vsys, r5sim_clock_ns());
+	vsys_rearm(vsys);
+	pthread_mutex_unlock(&vsys->lock);
+
+	if (fired) {
+		r5sim_dbg("Timer fired!\n");
+		r5sim_core_intr_level(vsys->core, CSR_MCAUSE_CODE_MTI,
+				      R5SIM_INTR_DEV_VSYS, true);
+	}
+}
+
+static u64 vsys_interval_ns(u32 config, u32 interval)
+{
+	u64 interv = interval;
+
+	/*
+	 * Scale the incoming time to nanoseconds.
+	 */
+	switch (get_field(config, VSYS_TIMER_CONFIG_PRECISION)) {
 	case VSYS_TIMER_CONFIG_PRECISION_SECS:
-		interv *= 1000000000;
-		break;
+		return interv * 1000000000;
 	case VSYS_TIMER_CONFIG_PRECISION_MSECS:
-		interv *= 1000000;
-		break;
+		return interv * 1000000;
 	case VSYS_TIMER_CONFIG_PRECISION_USECS:
-		interv *= 1000;
-		break;
+		return interv * 1000;
+	case VSYS_TIMER_CONFIG_PRECISION_NSECS:
+	default:
+		return interv;
 	}
+}
 
-	spec.it_value.tv_sec  = interv ? interv / 1000000000 : 0u;
-	spec.it_value.tv_nsec = interv % 1000000000;
+/*
+ * (Re)start or stop timer idx based on its config.
+ */
+static void vsys_trigger_timer(struct vsys_priv *vsys, u32 idx)
+{
+	struct vsys_timer *t = &vsys->timers[idx];
+	u64 now = r5sim_clock_ns();
+	u64 interv;
+
+	pthread_mutex_lock(&vsys->lock);
+
+	if (t->armed) {
+		vsys_wheel_del(&vsys->wheel, t);
+		t->armed = false;
+	}
 
-	timer_settime(vsys->timer, 0, &spec, NULL);
-	r5sim_dbg("Timer activated: [%ld.%ld]\n",
-		  spec.it_value.tv_sec,
-		  spec.it_value.tv_nsec);
+	if (get_field(t->config, VSYS_TIMER_CONFIG_ACTIVATE)) {
+		interv = vsys_interval_ns(t->config, t->interval);
+
+		/*
+		 * Catch the wheel up first so that the new timer is filed
+		 * relative to the right time.
+		 */
+		if (vsys_wheel_advance(vsys, now))
+			r5sim_core_intr_level(vsys->core,
+					      CSR_MCAUSE_CODE_MTI,
+					      R5SIM_INTR_DEV_VSYS, true);
+
+		t->expires = now + interv;
+		t->period  = get_field(t->config, VSYS_TIMER_CONFIG_PERIODIC) &&
+			interv ? interv : 0;
+		t->armed   = true;
+		vsys_wheel_add(&vsys->wheel, t);
+
+		r5sim_dbg("Timer %u activated: %llu ns%s\n", idx,
+			  (unsigned long long)interv,
+			  t->period ? " (periodic)" : "");
+	}
+
+	vsys_rearm(vsys);
+
+	pthread_mutex_unlock(&vsys->lock);
 }
 
 static void vsys_trigger_msw_intr(struct r5sim_iodev *iodev,
@@ -129,42 +402,100 @@ static void vsys_trigger_msw_intr(struct r5sim_iodev *iodev,
 	struct r5sim_core *core = mach->core;
 
 	if (value)
-		r5sim_core_intr_signal(core, CSR_MCAUSE_CODE_MSI);
+		r5sim_core_intr_level(core, CSR_MCAUSE_CODE_MSI,
+				      R5SIM_INTR_DEV_VSYS, true);
+}
+
+/*
+ * Map a timer register (including the legacy aliases for timer 0) to the
+ * timer and the register within it. Returns false for non-timer regs.
+ */
+static bool vsys_timer_reg(u32 offs, u32 *idx, u32 *reg)
+{
+	if (offs == VSYS_TIMER_CONFIG || offs == VSYS_TIMER_INTERVAL) {
+		*idx = 0;
+		*reg = offs == VSYS_TIMER_CONFIG ?
+			VSYS_TIMERn_CONFIG : VSYS_TIMERn_INTERVAL;
+		return true;
+	}
+
+	if (offs < VSYS_TIMER_BASE(0) || offs >= VSYS_MAX_REG)
+		return false;
+
+	*idx = (offs - VSYS_TIMER_BASE(0)) / 0x10;
+	*reg = offs & 0xf;
+
+	return *reg == VSYS_TIMERn_CONFIG || *reg == VSYS_TIMERn_INTERVAL;
 }
 
 static u32 vsys_readl(struct r5sim_iodev *iodev, u32 offs)
 {
+	struct vsys_priv *vsys = iodev->priv;
+	u32 idx, reg, val;
+
 	vsys_dbg("LOAD  @ %s\n", vsys_reg_to_str(offs));
 
 	if (offs >= VSYS_MAX_REG)
 		return 0x0;
 
-	return __vsys_read_state(iodev->priv, offs);
+	if (vsys_timer_reg(offs, &idx, &reg)) {
+		pthread_mutex_lock(&vsys->lock);
+		val = reg == VSYS_TIMERn_CONFIG ?
+			vsys->timers[idx].config : vsys->timers[idx].interval;
+		pthread_mutex_unlock(&vsys->lock);
+		return val;
+	}
+
+	switch (offs) {
+	case VSYS_TIMER_STATUS:
+		pthread_mutex_lock(&vsys->lock);
+		val = vsys->timer_status;
+		pthread_mutex_unlock(&vsys->lock);
+		return val;
+	case VSYS_TIMER_NR_TIMERS:
+		return VSYS_TIMER_NR;
+	}
+
+	return __vsys_read_state(vsys, offs);
 }
 
 static void vsys_writel(struct r5sim_iodev *iodev,
 		        u32 offs, u32 val)
 {
+	struct vsys_priv *vsys = iodev->priv;
+	u32 idx, reg;
+
 	vsys_dbg("STORE @ %-17s v=0x%08x\n",
 		  vsys_reg_to_str(offs), val);
 
+	if (vsys_timer_reg(offs, &idx, &reg)) {
+		if (reg == VSYS_TIMERn_INTERVAL) {
+			/*
+			 * Simple write through.
+			 */
+			pthread_mutex_lock(&vsys->lock);
+			vsys->timers[idx].interval = val;
+			pthread_mutex_unlock(&vsys->lock);
+			return;
+		}
+
+		pthread_mutex_lock(&vsys->lock);
+		vsys->timers[idx].config = val;
+		pthread_mutex_unlock(&vsys->lock);
+
+		/* Now start or stop the timer. */
+		vsys_trigger_timer(vsys, idx);
+		return;
+	}
+
 	switch (offs) {
-	case VSYS_TIMER_INTERVAL:
+	case VSYS_TIMER_STATUS:
 		/*
-		 * Simple write through.
+		 * Write 1 to clear.
 		 */
-		__vsys_set_state(iodev->priv,
-				 VSYS_TIMER_INTERVAL,
-				 val);
-		break;
-	case VSYS_TIMER_CONFIG:
-		__vsys_set_state(iodev->priv,
-				 VSYS_TIMER_CONFIG,
-				 val);
-
-		/* Now (potentially) trigger the timer. */
-		if (get_field(val, VSYS_TIMER_CONFIG_ACTIVATE))
-			vsys_trigger_timer(iodev->priv);
+		pthread_mutex_lock(&vsys->lock);
+		vsys->timer_status &= ~val;
+		pthread_mutex_unlock(&vsys->lock);
 		break;
 	case VSYS_M_SW_INTERRUPT:
 		vsys_trigger_msw_intr(iodev, val);
@@ -174,7 +505,6 @@ static void vsys_writel(struct r5sim_iodev *iodev,
 		return;
 	}
 }
-
 static struct r5sim_iodev virtual_sys = {
 	.name      = "vsys",
 
@@ -193,7 +523,7 @@ struct r5sim_iodev *r5sim_vsys_load_new(struct r5sim_machine *mach,
 	dev = malloc(sizeof(*dev));
 	r5sim_assert(dev != NULL);
 
-	priv = malloc(sizeof(*priv));
+	priv = calloc(1, sizeof(*priv));
 	r5sim_assert(priv != NULL);
 
 	*dev = virtual_sys;
@@ -211,14 +541,13 @@ struct r5sim_iodev *r5sim_vsys_load_new(struct r5sim_machine *mach,
 	__vsys_set_state(priv, VSYS_IO_SIZE,    mach->iomem_size);
 
 	/*
-	 * Init timer for the vsys.
+	 * Init timers for the vsys.
 	 */
-	priv->ev.sigev_notify = SIGEV_THREAD;
-	priv->ev.sigev_value.sival_ptr = mach->core;
-	priv->ev.sigev_notify_function = vsys_timer_notify;
-
-	if (timer_create(CLOCK_REALTIME, &priv->ev, &priv->timer))
-		r5sim_assert(!"timer_create: failed!");
+	priv->core = mach->core;
+	priv->timer_armed = ~0ULL;
+	pthread_mutex_init(&priv->lock, NULL);
+	vsys_wheel_init(&priv->wheel, r5sim_clock_ns());
+	r5sim_event_init(mach, &priv->timer, vsys_timer_expired, priv);
 
 	return dev;
 }
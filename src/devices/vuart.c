@@ -17,61 +17,679 @@
  *
  * Define a virtual UART device that can be used for reading/writing
  * data into the R5.
+ *
+ * The host side of the UART is one of the following backends, picked with
+ * the -u option:
+ *
+ *   pty             A pseudo terminal (the default); attach a terminal
+ *                   program to the printed path.
+ *   stdio           The simulator's stdin and stdout.
+ *   file=PATH       Write output to PATH through a large buffer. There's
+ *                   no input.
+ *   unix=PATH       Listen on a unix domain socket at PATH. One client at
+ *                   a time; a new connection replaces the old one. Output
+ *                   is dropped while nothing is connected.
+ *   null            Drop output, no input. Costs next to nothing.
  */
 
 #include <pty.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 
 #include <r5sim/log.h>
 #include <r5sim/env.h>
+#include <r5sim/list.h>
+#include <r5sim/core.h>
+#include <r5sim/plic.h>
+#include <r5sim/util.h>
 #include <r5sim/iodev.h>
+#include <r5sim/ioloop.h>
+#include <r5sim/machine.h>
 
 #include <r5sim/hw/vuart.h>
 
+/*
+ * How long to wait at exit for the TX FIFO to drain, in seconds.
+ */
+#define VUART_EXIT_DRAIN	1
+
+/*
+ * The file backend's output buffer; it's written out when full, or once
+ * output has been idle for VUART_FILE_IDLE_MS.
+ */
+#define VUART_FILE_BUF		KB(64)
+#define VUART_FILE_IDLE_MS	100
+
+enum vuart_backend {
+	VUART_PTY,
+	VUART_STDIO,
+	VUART_FILE,
+	VUART_UNIX,
+	VUART_NULL,
+};
+
+static const char *vuart_backend_names[] = {
+	[VUART_PTY]	= "pty",
+	[VUART_STDIO]	= "stdio",
+	[VUART_FILE]	= "file",
+	[VUART_UNIX]	= "unix",
+	[VUART_NULL]	= "null",
+};
+
+/*
+ * head and tail are free running; the FIFO holds head - tail bytes.
+ */
+struct vuart_fifo {
+	u8		 buf[VUART_FIFO_SIZE];
+	u32		 head;
+	u32		 tail;
+};
+
 struct virt_uart_priv {
-	char fd_path[32];
-	int  master_fd;
-	int  slave_fd;
+	enum vuart_backend	 backend;
+	const char		*path;
+
+	/*
+	 * Where input comes from and output goes; -1 if there's no such
+	 * thing (right now). For the pty these are both the master and
+	 * for a unix socket both the connected client, in which case only
+	 * in_h is used.
+	 *
+	 * The handlers are only in the IO loop while there's something to
+	 * wait for; *_events are the events currently waited for. Fds that
+	 * can't be waited on (regular files, /dev/null) are always ready
+	 * and are just read or written directly.
+	 */
+	int			 in_fd;
+	int			 out_fd;
+	struct r5sim_io_handler	 in_h;
+	struct r5sim_io_handler	 out_h;
+	u32			 in_events;
+	u32			 out_events;
+	bool			 in_poll;
+	bool			 out_poll;
+
+	/*
+	 * Backend specific bits.
+	 */
+	char			 pty_path[32];
+	int			 pty_slave_fd;
+	int			 listen_fd;
+	struct r5sim_io_handler	 listen_h;
+	u8			*out_buf;
+	u32			 out_len;
+	bool			 out_err;
+	struct r5sim_io_handler	 flush_h;
+	bool			 flush_armed;
+
+	struct r5sim_machine	*mach;
+
+	/*
+	 * The machine's IO loop moves data between the backend and the
+	 * FIFOs; everything above is only touched from the loop thread.
+	 * The core posts the kick work when the loop has to start paying
+	 * attention again: when the TX FIFO stops being empty or the RX
+	 * FIFO stops being full. The lock protects the FIFO indexes; the
+	 * data itself is only touched by the FIFO's consumer or producer.
+	 */
+	struct r5sim_io_work	 kick;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 tx_cond;
+	bool			 exiting;
+	bool			 drained;
+
+	struct vuart_fifo	 rx;
+	struct vuart_fifo	 tx;
+
+	u32			 irq;
+	u32			 irq_enable;
+	u32			 irq_status;
+
+	struct list_head	 exit_node;
 };
 
-static u32 virt_uart_readl(struct r5sim_iodev *iodev, u32 offs)
+/*
+ * UARTs to drain at exit.
+ */
+static LIST_HEAD(vuart_list);
+
+static u32 vuart_fifo_count(struct vuart_fifo *fifo)
 {
-	struct virt_uart_priv *priv = iodev->priv;
-	char c = 0;
+	return fifo->head - fifo->tail;
+}
+
+static u32 vuart_fifo_space(struct vuart_fifo *fifo)
+{
+	return VUART_FIFO_SIZE - vuart_fifo_count(fifo);
+}
+
+/*
+ * Fill in up to two iovecs describing either the used part of the FIFO
+ * (for the consumer) or the free part (for the producer).
+ */
+static int vuart_fifo_iov(struct vuart_fifo *fifo, struct iovec *iov,
+			  bool used)
+{
+	u32 start = used ? fifo->tail : fifo->head;
+	u32 len = used ? vuart_fifo_count(fifo) : vuart_fifo_space(fifo);
+	u32 offs = start % VUART_FIFO_SIZE;
+	u32 first = min(len, VUART_FIFO_SIZE - offs);
+
+	iov[0].iov_base = fifo->buf + offs;
+	iov[0].iov_len  = first;
+	iov[1].iov_base = fifo->buf;
+	iov[1].iov_len  = len - first;
+
+	return len - first ? 2 : 1;
+}
+
+static void virt_uart_kick(struct virt_uart_priv *priv)
+{
+	r5sim_ioloop_post(priv->mach->ioloop, &priv->kick);
+}
+
+static void virt_uart_raise(struct virt_uart_priv *priv, u32 status)
+{
+	if (!(__atomic_load_n(&priv->irq_enable, __ATOMIC_RELAXED) & status))
+		return;
+
+	__atomic_or_fetch(&priv->irq_status, status, __ATOMIC_SEQ_CST);
+
+	r5sim_plic_raise(priv->mach->plic, priv->irq);
+}
+
+/*
+ * Drop the PLIC line once every status bit is clear.
+ */
+static void virt_uart_ack(struct virt_uart_priv *priv, u32 status)
+{
+	if (__atomic_and_fetch(&priv->irq_status, ~status, __ATOMIC_SEQ_CST))
+		return;
 
-	r5sim_dbg_vv("vuart: R=%c (%u)\n", c, offs);
+	r5sim_plic_lower(priv->mach->plic, priv->irq);
+
+	if (__atomic_load_n(&priv->irq_status, __ATOMIC_SEQ_CST))
+		r5sim_plic_raise(priv->mach->plic, priv->irq);
+}
+
+/*
+ * Wait for events on a handler; none means take it out of the loop.
+ * Leaving an fd in the loop with no events isn't enough since a hung up
+ * fd keeps reporting EPOLLHUP.
+ */
+static void virt_uart_watch(struct virt_uart_priv *priv,
+			    struct r5sim_io_handler *h, u32 *cur, u32 events)
+{
+	struct r5sim_ioloop *loop = priv->mach->ioloop;
+
+	if (*cur == events)
+		return;
+
+	if (!events)
+		r5sim_ioloop_del(loop, h);
+	else if (!*cur)
+		r5sim_assert(r5sim_ioloop_add(loop, h, events) == 0);
+	else
+		r5sim_assert(r5sim_ioloop_mod(loop, h, events) == 0);
+
+	*cur = events;
+}
+
+/*
+ * Work out whether an fd can be waited on at all.
+ */
+static bool virt_uart_pollable(struct virt_uart_priv *priv,
+			       struct r5sim_io_handler *h)
+{
+	if (r5sim_ioloop_add(priv->mach->ioloop, h, EPOLLIN))
+		return false;
+
+	r5sim_ioloop_del(priv->mach->ioloop, h);
+	return true;
+}
+
+/*
+ * The input side went away: EOF on stdin, or the socket client hung up.
+ */
+static void virt_uart_in_closed(struct virt_uart_priv *priv)
+{
+	virt_uart_watch(priv, &priv->in_h, &priv->in_events, 0);
+
+	if (priv->backend == VUART_UNIX) {
+		r5sim_info("VUART: client disconnected from %s\n",
+			   priv->path);
+		close(priv->in_fd);
+		priv->out_fd = -1;
+	}
+
+	priv->in_fd = -1;
+}
+
+/*
+ * Write out the file backend's buffer. Output files are regular files, so
+ * this doesn't block for long. If the write fails the buffer is dropped
+ * anyway; warn the first time, not on every flush of a full disk.
+ */
+static void virt_uart_flush_file(struct virt_uart_priv *priv)
+{
+	u32 done = 0;
+	ssize_t ret;
+
+	while (done < priv->out_len) {
+		ret = write(priv->out_fd, priv->out_buf + done,
+			    priv->out_len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (!priv->out_err)
+				r5sim_warn("VUART: %s: lost %u bytes: %s\n",
+					   priv->path, priv->out_len - done,
+					   ret < 0 ? strerror(errno) :
+					   "write returned 0");
+			priv->out_err = true;
+			break;
+		}
+		done += ret;
+	}
+
+	if (done == priv->out_len)
+		priv->out_err = false;
+
+	priv->out_len = 0;
+}
+
+/*
+ * Move what we can out of the TX FIFO. Returns the number of bytes.
+ */
+static ssize_t virt_uart_tx_out(struct virt_uart_priv *priv,
+				struct iovec *iov, int nr)
+{
+	ssize_t ret = 0;
+	u32 done, len;
+	int i;
+
+	/*
+	 * Nowhere to send it, so drop it.
+	 */
+	if (priv->out_fd < 0)
+		return iov[0].iov_len + (nr > 1 ? iov[1].iov_len : 0);
+
+	if (priv->backend != VUART_FILE) {
+		ret = writev(priv->out_fd, iov, nr);
+		if (ret < 0 && errno == EPIPE)
+			virt_uart_in_closed(priv);
+		return ret;
+	}
+
+	/*
+	 * Take all of every iovec, flushing each time the buffer fills, so
+	 * that ret is exactly what made it into the buffer.
+	 */
+	for (i = 0; i < nr; i++) {
+		done = 0;
+		while (done < iov[i].iov_len) {
+			len = min((u32)iov[i].iov_len - done,
+				  VUART_FILE_BUF - priv->out_len);
+
+			memcpy(priv->out_buf + priv->out_len,
+			       (u8 *)iov[i].iov_base + done, len);
+			priv->out_len += len;
+			done += len;
+			ret += len;
+
+			if (priv->out_len == VUART_FILE_BUF)
+				virt_uart_flush_file(priv);
+		}
+	}
+
+	return ret;
+}
+
+static ssize_t virt_uart_do_tx(struct virt_uart_priv *priv)
+{
+	struct iovec iov[2];
+	ssize_t ret;
+	u32 status = 0;
+	int nr;
+
+	pthread_mutex_lock(&priv->lock);
+	nr = vuart_fifo_iov(&priv->tx, iov, true);
+	pthread_mutex_unlock(&priv->lock);
+
+	ret = virt_uart_tx_out(priv, iov, nr);
+	if (ret <= 0)
+		return ret;
+
+	pthread_mutex_lock(&priv->lock);
+	priv->tx.tail += ret;
+	pthread_cond_broadcast(&priv->tx_cond);
+	if (vuart_fifo_count(&priv->tx) == 0)
+		set_field(status, VUART_IRQ_STATUS_TX_EMPTY, 1);
+	pthread_mutex_unlock(&priv->lock);
+
+	r5sim_dbg_vv("vuart: TX %zd bytes\n", ret);
+
+	r5sim_machine_kick(priv->mach);
+
+	if (status)
+		virt_uart_raise(priv, status);
+
+	return ret;
+}
+
+static ssize_t virt_uart_do_rx(struct virt_uart_priv *priv)
+{
+	struct iovec iov[2];
+	ssize_t ret;
+	u32 status = 0;
+	int nr;
+
+	pthread_mutex_lock(&priv->lock);
+	nr = vuart_fifo_iov(&priv->rx, iov, false);
+	pthread_mutex_unlock(&priv->lock);
+
+	ret = readv(priv->in_fd, iov, nr);
+	if (ret == 0 ||
+	    (ret < 0 && errno != EAGAIN && errno != EINTR && errno != EIO))
+		virt_uart_in_closed(priv);
+	if (ret <= 0)
+		return ret;
+
+	pthread_mutex_lock(&priv->lock);
+	if (vuart_fifo_count(&priv->rx) == 0)
+		set_field(status, VUART_IRQ_STATUS_RX, 1);
+	priv->rx.head += ret;
+	pthread_mutex_unlock(&priv->lock);
+
+	r5sim_dbg_vv("vuart: RX %zd bytes\n", ret);
+
+	r5sim_machine_kick(priv->mach);
+
+	if (status)
+		virt_uart_raise(priv, status);
+
+	return ret;
+}
 
-	if (offs != VUART_READ)
+static void virt_uart_arm_flush(struct virt_uart_priv *priv)
+{
+	struct itimerspec spec = {
+		.it_value.tv_nsec = VUART_FILE_IDLE_MS * 1000000,
+	};
+
+	timerfd_settime(priv->flush_h.fd, 0, &spec, NULL);
+	priv->flush_armed = true;
+}
+
+/*
+ * Bring everything up to date with the FIFOs: move data to and from fds
+ * that are always ready and wait for the rest to become ready. Called on
+ * the loop thread whenever something changes.
+ */
+static void virt_uart_update(struct virt_uart_priv *priv)
+{
+	bool rx_space, tx_data, exiting;
+	u32 in_want = 0, out_want = 0;
+
+	while (1) {
+		pthread_mutex_lock(&priv->lock);
+		rx_space = vuart_fifo_space(&priv->rx) != 0;
+		tx_data  = vuart_fifo_count(&priv->tx) != 0;
+		exiting  = priv->exiting;
+		pthread_mutex_unlock(&priv->lock);
+
+		if (tx_data && (priv->out_fd < 0 || !priv->out_poll ||
+				priv->backend == VUART_FILE) &&
+		    virt_uart_do_tx(priv) > 0)
+			continue;
+
+		if (rx_space && priv->in_fd >= 0 && !priv->in_poll &&
+		    virt_uart_do_rx(priv) > 0)
+			continue;
+
+		break;
+	}
+
+	if (priv->out_len) {
+		if (exiting)
+			virt_uart_flush_file(priv);
+		else if (!priv->flush_armed)
+			virt_uart_arm_flush(priv);
+	}
+
+	if (priv->in_fd >= 0 && priv->in_poll && rx_space)
+		in_want = EPOLLIN;
+	if (priv->out_fd >= 0 && priv->out_poll && tx_data &&
+	    priv->backend != VUART_FILE)
+		out_want = EPOLLOUT;
+
+	if (priv->in_fd >= 0 && priv->in_fd == priv->out_fd) {
+		virt_uart_watch(priv, &priv->in_h, &priv->in_events,
+				in_want | out_want);
+	} else {
+		virt_uart_watch(priv, &priv->in_h, &priv->in_events,
+				in_want);
+		virt_uart_watch(priv, &priv->out_h, &priv->out_events,
+				out_want);
+	}
+
+	if (exiting && !tx_data && !priv->out_len) {
+		pthread_mutex_lock(&priv->lock);
+		priv->drained = true;
+		pthread_cond_broadcast(&priv->tx_cond);
+		pthread_mutex_unlock(&priv->lock);
+	}
+}
+
+static void virt_uart_kick_work(struct r5sim_io_work *w)
+{
+	virt_uart_update(w->priv);
+}
+
+static void virt_uart_in_ready(struct r5sim_io_handler *h, u32 events)
+{
+	struct virt_uart_priv *priv = h->priv;
+
+	if (events & EPOLLOUT)
+		virt_uart_do_tx(priv);
+	if (priv->in_fd >= 0 && (events & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+		virt_uart_do_rx(priv);
+
+	virt_uart_update(priv);
+}
+
+static void virt_uart_out_ready(struct r5sim_io_handler *h, u32 events)
+{
+	struct virt_uart_priv *priv = h->priv;
+
+	virt_uart_do_tx(priv);
+	virt_uart_update(priv);
+}
+
+static void virt_uart_flush_timeout(struct r5sim_io_handler *h, u32 events)
+{
+	struct virt_uart_priv *priv = h->priv;
+	u64 val;
+
+	if (read(h->fd, &val, sizeof(val)) != sizeof(val))
+		return;
+
+	priv->flush_armed = false;
+	virt_uart_flush_file(priv);
+	virt_uart_update(priv);
+}
+
+static void virt_uart_accept(struct r5sim_io_handler *h, u32 events)
+{
+	struct virt_uart_priv *priv = h->priv;
+	int fd = accept(priv->listen_fd, NULL, NULL);
+
+	if (fd < 0)
+		return;
+
+	if (priv->in_fd >= 0) {
+		virt_uart_watch(priv, &priv->in_h, &priv->in_events, 0);
+		close(priv->in_fd);
+	}
+
+	r5sim_assert(fcntl(fd, F_SETFL, O_NONBLOCK) == 0);
+
+	priv->in_fd    = fd;
+	priv->out_fd   = fd;
+	priv->in_h.fd  = fd;
+	priv->in_poll  = true;
+	priv->out_poll = true;
+
+	r5sim_info("VUART: client connected to %s\n", priv->path);
+
+	virt_uart_update(priv);
+}
+
+/*
+ * Give the IO loop a chance to get any buffered output out before the
+ * simulator exits; but don't hang if nothing is reading the output.
+ */
+static void virt_uart_drain(void)
+{
+	struct virt_uart_priv *priv;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += VUART_EXIT_DRAIN;
+
+	list_for_each_entry(priv, &vuart_list, exit_node) {
+		pthread_mutex_lock(&priv->lock);
+		priv->exiting = true;
+		pthread_mutex_unlock(&priv->lock);
+
+		virt_uart_kick(priv);
+
+		pthread_mutex_lock(&priv->lock);
+		while (!priv->drained) {
+			if (pthread_cond_timedwait(&priv->tx_cond, &priv->lock,
+						   &deadline))
+				break;
+		}
+		pthread_mutex_unlock(&priv->lock);
+	}
+}
+
+static u32 virt_uart_read_char(struct virt_uart_priv *priv)
+{
+	bool was_full;
+	u32 val = 0;
+	u8 c;
+
+	pthread_mutex_lock(&priv->lock);
+
+	if (vuart_fifo_count(&priv->rx) == 0) {
+		pthread_mutex_unlock(&priv->lock);
 		return 0x0;
+	}
+
+	was_full = vuart_fifo_space(&priv->rx) == 0;
+	c = priv->rx.buf[priv->rx.tail++ % VUART_FIFO_SIZE];
+
+	pthread_mutex_unlock(&priv->lock);
+
+	if (was_full)
+		virt_uart_kick(priv);
+
+	set_field(val, VUART_READ_DATA, c);
+	set_field(val, VUART_READ_VALID, 1);
+
+	return val;
+}
+
+static void virt_uart_write_char(struct virt_uart_priv *priv, u8 c)
+{
+	bool was_empty;
+
+	if (priv->backend == VUART_NULL)
+		return;
+
+	pthread_mutex_lock(&priv->lock);
 
 	/*
-	 * Not a lot we can do if it fails.
+	 * Stall the core until there's room; this is what lets software
+	 * that never looks at VUART_TX_SPACE get away with it.
 	 */
-	r5sim_assert(read(priv->master_fd, &c, 1));
+	while (vuart_fifo_space(&priv->tx) == 0)
+		pthread_cond_wait(&priv->tx_cond, &priv->lock);
+
+	was_empty = vuart_fifo_count(&priv->tx) == 0;
+	priv->tx.buf[priv->tx.head++ % VUART_FIFO_SIZE] = c;
+
+	pthread_mutex_unlock(&priv->lock);
 
-	r5sim_dbg_vv("vuart: R=%c\n", c);
+	if (was_empty)
+		virt_uart_kick(priv);
+}
+static u32 virt_uart_readl(struct r5sim_iodev *iodev, u32 offs)
+{
+	struct virt_uart_priv *priv = iodev->priv;
+	u32 val;
 
-	return (u32)c;
+	switch (offs) {
+	case VUART_READ:
+		val = virt_uart_read_char(priv);
+		r5sim_dbg_vv("vuart: R=0x%x\n", val);
+		return val;
+	case VUART_RX_COUNT:
+		pthread_mutex_lock(&priv->lock);
+		val = vuart_fifo_count(&priv->rx);
+		pthread_mutex_unlock(&priv->lock);
+		return val;
+	case VUART_TX_SPACE:
+		pthread_mutex_lock(&priv->lock);
+		val = vuart_fifo_space(&priv->tx);
+		pthread_mutex_unlock(&priv->lock);
+		return val;
+	case VUART_IRQ_ENABLE:
+		return __atomic_load_n(&priv->irq_enable, __ATOMIC_RELAXED);
+	case VUART_IRQ_STATUS:
+		return __atomic_load_n(&priv->irq_status, __ATOMIC_ACQUIRE);
+	}
+
+	return 0x0;
 }
 
 static void virt_uart_writel(struct r5sim_iodev *iodev,
 		 u32 offs, u32 val)
 {
 	struct virt_uart_priv *priv = iodev->priv;
-	char c = val & 0xff;
 
-	r5sim_dbg_vv("vuart: W=%c (%u)\n", c, offs);
+	r5sim_dbg_vv("vuart: W=0x%x (%u)\n", val, offs);
 
-	if (offs != VUART_WRITE)
+	switch (offs) {
+	case VUART_WRITE:
+		virt_uart_write_char(priv, val & 0xff);
 		return;
-
-	/*
-	 * Not much we can do if it fails.
-	 */
-	r5sim_assert(write(priv->master_fd, &c, 1) == 1);
+	case VUART_IRQ_ENABLE:
+		__atomic_store_n(&priv->irq_enable, val, __ATOMIC_RELAXED);
+		return;
+	case VUART_IRQ_STATUS:
+		/*
+		 * Write 1 to clear.
+		 */
+		virt_uart_ack(priv, val);
+		return;
+	}
 }
 
 /*
@@ -81,14 +699,103 @@ static void virt_uart_writel(struct r5sim_iodev *iodev,
 static struct r5sim_iodev virtual_uart = {
 	.name      = "vuart",
 
-	.io_size   = 0x8,
+	.io_size   = VUART_MAX_REG,
 
 	.readl     = virt_uart_readl,
 	.writel    = virt_uart_writel,
 };
 
+static void vuart_open_pty(struct virt_uart_priv *priv)
+{
+	int fd;
+
+	if (openpty(&fd, &priv->pty_slave_fd, priv->pty_path, NULL, NULL)) {
+		perror("openpty");
+		r5sim_assert(false);
+	}
+
+	/*
+	 * The IO loop must never block on the pty; it has everything else
+	 * to look after, too.
+	 */
+	r5sim_assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0);
+
+	priv->in_fd  = fd;
+	priv->out_fd = fd;
+	priv->path   = priv->pty_path;
+}
+
+static void vuart_open_file(struct virt_uart_priv *priv)
+{
+	priv->out_fd = open(priv->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (priv->out_fd < 0) {
+		perror(priv->path);
+		r5sim_assert(!"Failed to open VUART output file");
+	}
+
+	priv->out_buf = malloc(VUART_FILE_BUF);
+	r5sim_assert(priv->out_buf != NULL);
+
+	priv->flush_h.fd   = timerfd_create(CLOCK_MONOTONIC,
+					    TFD_NONBLOCK | TFD_CLOEXEC);
+	priv->flush_h.func = virt_uart_flush_timeout;
+	priv->flush_h.priv = priv;
+	r5sim_assert(priv->flush_h.fd >= 0);
+	r5sim_assert(r5sim_ioloop_add(priv->mach->ioloop, &priv->flush_h,
+				      EPOLLIN) == 0);
+}
+
+static void vuart_open_unix(struct virt_uart_priv *priv)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(priv->path) >= sizeof(addr.sun_path))
+		r5sim_assert(!"VUART socket path too long");
+	strcpy(addr.sun_path, priv->path);
+
+	priv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	r5sim_assert(priv->listen_fd >= 0);
+
+	unlink(priv->path);
+
+	if (bind(priv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(priv->listen_fd, 1)) {
+		perror(priv->path);
+		r5sim_assert(!"Failed to listen on VUART socket");
+	}
+
+	/*
+	 * A client going away mid-write shouldn't take us down with it.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+}
+
+static void vuart_parse_spec(struct virt_uart_priv *priv, const char *spec)
+{
+	if (!spec || strcmp(spec, "pty") == 0) {
+		priv->backend = VUART_PTY;
+	} else if (strcmp(spec, "stdio") == 0) {
+		priv->backend = VUART_STDIO;
+	} else if (strcmp(spec, "null") == 0) {
+		priv->backend = VUART_NULL;
+	} else if (strncmp(spec, "file=", 5) == 0 && spec[5]) {
+		priv->backend = VUART_FILE;
+		priv->path    = spec + 5;
+	} else if (strncmp(spec, "unix=", 5) == 0 && spec[5]) {
+		priv->backend = VUART_UNIX;
+		priv->path    = spec + 5;
+	} else {
+		r5sim_err("Invalid VUART backend: %s\n", spec);
+		r5sim_assert(!"Invalid VUART backend");
+	}
+}
+
 struct r5sim_iodev *r5sim_vuart_load_new(struct r5sim_machine *mach,
-					 u32 io_offs)
+					 u32 io_offs, u32 irq,
+					 const char *spec)
 {
 	struct r5sim_iodev *dev;
 	struct virt_uart_priv *priv;
@@ -98,22 +805,89 @@ struct r5sim_iodev *r5sim_vuart_load_new(struct r5sim_machine *mach,
 
 	*dev = virtual_uart;
 
-	priv = malloc(sizeof(*priv));
+	priv = calloc(1, sizeof(*priv));
 	r5sim_assert(priv != NULL);
 
 	dev->mach = mach;
 	dev->io_offset = io_offs;
 	dev->priv = priv;
 
-	if (openpty(&priv->master_fd,
-		    &priv->slave_fd,
-		    priv->fd_path,
-		    NULL, NULL)) {
-		perror("openpty");
-		r5sim_assert(false);
-        }
+	priv->mach      = mach;
+	priv->irq       = irq;
+	priv->in_fd     = -1;
+	priv->out_fd    = -1;
+	priv->listen_fd = -1;
+
+	pthread_mutex_init(&priv->lock, NULL);
+	pthread_cond_init(&priv->tx_cond, NULL);
+
+	vuart_parse_spec(priv, spec);
+
+	switch (priv->backend) {
+	case VUART_PTY:
+		vuart_open_pty(priv);
+		break;
+	case VUART_STDIO:
+		/*
+		 * Guest output bypasses stdio's buffer; at least get what's
+		 * been logged so far out ahead of it.
+		 */
+		fflush(stdout);
+		priv->in_fd  = STDIN_FILENO;
+		priv->out_fd = STDOUT_FILENO;
+		break;
+	case VUART_FILE:
+		vuart_open_file(priv);
+		break;
+	case VUART_UNIX:
+		vuart_open_unix(priv);
+		break;
+	case VUART_NULL:
+		break;
+	}
+
+	r5sim_info("VUART @ 0x%x: %s%s%s\n", io_offs,
+		   vuart_backend_names[priv->backend],
+		   priv->path ? "=" : "", priv->path ? priv->path : "");
+
+	/*
+	 * Nothing to move around for the null backend.
+	 */
+	if (priv->backend == VUART_NULL)
+		return dev;
+
+	priv->in_h.fd    = priv->in_fd;
+	priv->in_h.func  = virt_uart_in_ready;
+	priv->in_h.priv  = priv;
+	priv->out_h.fd   = priv->out_fd;
+	priv->out_h.func = virt_uart_out_ready;
+	priv->out_h.priv = priv;
+
+	if (priv->in_fd >= 0)
+		priv->in_poll = virt_uart_pollable(priv, &priv->in_h);
+	if (priv->out_fd >= 0)
+		priv->out_poll = priv->out_fd == priv->in_fd ?
+			priv->in_poll : virt_uart_pollable(priv, &priv->out_h);
+
+	priv->kick.func = virt_uart_kick_work;
+	priv->kick.priv = priv;
+
+	virt_uart_kick(priv);
+
+	/*
+	 * Last, since a client may connect straight away.
+	 */
+	if (priv->listen_fd >= 0) {
+		priv->listen_h.fd   = priv->listen_fd;
+		priv->listen_h.func = virt_uart_accept;
+		priv->listen_h.priv = priv;
+		r5sim_assert(r5sim_ioloop_add(mach->ioloop, &priv->listen_h,
+					      EPOLLIN) == 0);
+	}
 
-	r5sim_info("VUART @ 0x%x: pty=%s\n", io_offs, priv->fd_path);
+	if (list_empty(&vuart_list))
+		atexit(virt_uart_drain);
+	list_add_tail(&priv->exit_node, &vuart_list);
 
 	return dev;
 }
@@ -0,0 +1,283 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ * Discrete event queue; see event.h.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
+#include <r5sim/ioloop.h>
+#include <r5sim/machine.h>
+
+struct r5sim_event_queue {
+	struct r5sim_machine   *mach;
+
+	/*
+	 * The heap; heap[0] is the soonest event. The lock covers the
+	 * heap and every queued event's when and slot.
+	 */
+	pthread_mutex_t         lock;
+	struct r5sim_event    **heap;
+	u32                     nr;
+	u32                     size;
+
+	/*
+	 * Host clock only: the timerfd and the deadline it's armed for.
+	 */
+	struct r5sim_io_handler timer;
+	u64                     armed;
+};
+
+static void evq_set(struct r5sim_event_queue *q, u32 slot,
+		    struct r5sim_event *ev)
+{
+	q->heap[slot] = ev;
+	ev->slot = slot;
+}
+
+static void evq_sift_up(struct r5sim_event_queue *q, u32 slot)
+{
+	struct r5sim_event *ev = q->heap[slot];
+
+	while (slot) {
+		u32 parent = (slot - 1) / 2;
+
+		if (q->heap[parent]->when <= ev->when)
+			break;
+
+		evq_set(q, slot, q->heap[parent]);
+		slot = parent;
+	}
+
+	evq_set(q, slot, ev);
+}
+
+static void evq_sift_down(struct r5sim_event_queue *q, u32 slot)
+{
+	struct r5sim_event *ev = q->heap[slot];
+
+	while (1) {
+		u32 child = slot * 2 + 1;
+
+		if (child >= q->nr)
+			break;
+
+		if (child + 1 < q->nr &&
+		    q->heap[child + 1]->when < q->heap[child]->when)
+			child++;
+
+		if (ev->when <= q->heap[child]->when)
+			break;
+
+		evq_set(q, slot, q->heap[child]);
+		slot = child;
+	}
+
+	evq_set(q, slot, ev);
+}
+
+static void evq_remove(struct r5sim_event_queue *q, struct r5sim_event *ev)
+{
+	u32 slot = ev->slot;
+	struct r5sim_event *last;
+
+	ev->slot = R5SIM_EVENT_IDLE;
+	ev->when = R5SIM_EVENT_NEVER;
+
+	last = q->heap[--q->nr];
+	if (last == ev)
+		return;
+
+	/*
+	 * Fill the hole with the last event and let it find its place;
+	 * it can only need to go one way.
+	 */
+	evq_set(q, slot, last);
+	evq_sift_up(q, slot);
+	evq_sift_down(q, last->slot);
+}
+
+/*
+ * The soonest deadline changed (maybe); publish it for the core and, on
+ * the host clock, point the timerfd at it. The caller holds the lock.
+ */
+static void evq_update(struct r5sim_event_queue *q)
+{
+	struct itimerspec spec = { };
+	u64 next = q->nr ? q->heap[0]->when : R5SIM_EVENT_NEVER;
+	u64 mono;
+
+	__atomic_store_n(&q->mach->event_next, next, __ATOMIC_RELAXED);
+
+	if (r5sim_clock_virtual() || next == q->armed)
+		return;
+
+	q->armed = next;
+
+	/*
+	 * An all zero it_value disarms the timerfd.
+	 */
+	if (next != R5SIM_EVENT_NEVER) {
+		mono = r5sim_clock_to_mono(next);
+		spec.it_value.tv_sec  = mono / 1000000000;
+		spec.it_value.tv_nsec = mono % 1000000000;
+	}
+
+	timerfd_settime(q->timer.fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void evq_timer_notify(struct r5sim_io_handler *h, u32 events)
+{
+	struct r5sim_event_queue *q = h->priv;
+	u64 expirations;
+
+	if (read(h->fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	/*
+	 * The timerfd is spent; make sure it's re-armed even if it went
+	 * off early and the soonest event is still the same one.
+	 */
+	pthread_mutex_lock(&q->lock);
+	q->armed = R5SIM_EVENT_NEVER;
+	pthread_mutex_unlock(&q->lock);
+
+	r5sim_event_run(q->mach);
+}
+
+struct r5sim_event_queue *r5sim_event_queue_new(struct r5sim_machine *mach)
+{
+	struct r5sim_event_queue *q;
+
+	q = calloc(1, sizeof(*q));
+	r5sim_assert(q != NULL);
+
+	q->mach  = mach;
+	q->armed = R5SIM_EVENT_NEVER;
+	pthread_mutex_init(&q->lock, NULL);
+
+	mach->event_next = R5SIM_EVENT_NEVER;
+
+	if (r5sim_clock_virtual())
+		return q;
+
+	q->timer.fd   = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	q->timer.func = evq_timer_notify;
+	q->timer.priv = q;
+
+	if (q->timer.fd < 0 ||
+	    r5sim_ioloop_add(mach->ioloop, &q->timer, EPOLLIN))
+		r5sim_assert(!"timerfd_create: failed!");
+
+	return q;
+}
+
+void r5sim_event_init(struct r5sim_machine *mach, struct r5sim_event *ev,
+		      void (*func)(struct r5sim_event *ev), void *priv)
+{
+	ev->func = func;
+	ev->priv = priv;
+	ev->mach = mach;
+	ev->when = R5SIM_EVENT_NEVER;
+	ev->slot = R5SIM_EVENT_IDLE;
+}
+
+void r5sim_event_schedule(struct r5sim_event *ev, u64 when)
+{
+	struct r5sim_event_queue *q = ev->mach->events;
+
+	pthread_mutex_lock(&q->lock);
+
+	if (ev->slot != R5SIM_EVENT_IDLE)
+		evq_remove(q, ev);
+
+	if (when < R5SIM_EVENT_MAX) {
+		if (q->nr == q->size) {
+			q->size = q->size ? q->size * 2 : 16;
+			q->heap = realloc(q->heap,
+					  q->size * sizeof(*q->heap));
+			r5sim_assert(q->heap != NULL);
+		}
+
+		ev->when = when;
+		evq_set(q, q->nr++, ev);
+		evq_sift_up(q, ev->slot);
+	}
+
+	evq_update(q);
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+void r5sim_event_cancel(struct r5sim_event *ev)
+{
+	r5sim_event_schedule(ev, R5SIM_EVENT_NEVER);
+}
+
+void r5sim_event_run(struct r5sim_machine *mach)
+{
+	struct r5sim_event_queue *q = mach->events;
+	struct r5sim_event *ev;
+	u64 now = r5sim_clock_ns();
+
+	while (1) {
+		pthread_mutex_lock(&q->lock);
+
+		if (!q->nr || q->heap[0]->when > now) {
+			evq_update(q);
+			pthread_mutex_unlock(&q->lock);
+			return;
+		}
+
+		ev = q->heap[0];
+		evq_remove(q, ev);
+
+		pthread_mutex_unlock(&q->lock);
+
+		/*
+		 * Called without the lock so that func can reschedule.
+		 */
+		ev->func(ev);
+	}
+}
+
+int r5sim_event_skip(struct r5sim_machine *mach)
+{
+	u64 next = __atomic_load_n(&mach->event_next, __ATOMIC_RELAXED);
+
+	if (next == R5SIM_EVENT_NEVER)
+		return 0;
+
+	r5sim_clock_skip(next);
+	r5sim_event_run(mach);
+
+	return 1;
+}
@@ -0,0 +1,216 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Host IO event loop; see ioloop.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <r5sim/log.h>
+#include <r5sim/env.h>
+#include <r5sim/ioloop.h>
+
+#define IOLOOP_MAX_EVENTS	32
+
+struct r5sim_ioloop {
+	int                   epoll_fd;
+	int                   cpu;
+
+	pthread_t             thread;
+
+	/*
+	 * Posted work is pushed onto this stack with a CAS; the loop thread
+	 * takes the whole stack at once. wake_fd kicks the loop thread when
+	 * the stack goes from empty to not empty.
+	 */
+	struct r5sim_io_work *work;
+	int                   wake_fd;
+	struct r5sim_io_handler wake_handler;
+};
+
+/*
+ * Run posted work in the order it was posted.
+ */
+static void ioloop_run_work(struct r5sim_ioloop *loop)
+{
+	struct r5sim_io_work *w, *next, *fifo = NULL;
+
+	w = __atomic_exchange_n(&loop->work, NULL, __ATOMIC_ACQUIRE);
+
+	while (w) {
+		next = w->next;
+		w->next = fifo;
+		fifo = w;
+		w = next;
+	}
+
+	for (w = fifo; w; w = next) {
+		next = w->next;
+
+		/*
+		 * Clear pending first so that anything the work does after
+		 * this point is seen by a re-post.
+		 */
+		__atomic_store_n(&w->pending, 0, __ATOMIC_SEQ_CST);
+		w->func(w);
+	}
+}
+
+static void ioloop_wake(struct r5sim_io_handler *h, u32 events)
+{
+	struct r5sim_ioloop *loop = h->priv;
+	u64 val;
+
+	r5sim_assert(read(loop->wake_fd, &val, sizeof(val)) == sizeof(val));
+
+	ioloop_run_work(loop);
+}
+
+void r5sim_ioloop_post(struct r5sim_ioloop *loop, struct r5sim_io_work *w)
+{
+	struct r5sim_io_work *head;
+	u64 one = 1;
+
+	if (__atomic_exchange_n(&w->pending, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	head = __atomic_load_n(&loop->work, __ATOMIC_RELAXED);
+	do {
+		w->next = head;
+	} while (!__atomic_compare_exchange_n(&loop->work, &head, w, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	/*
+	 * Only the first post after the loop took the stack needs to wake
+	 * it; the others ride along.
+	 */
+	if (head == NULL)
+		r5sim_assert(write(loop->wake_fd, &one, sizeof(one)) ==
+			     sizeof(one));
+}
+
+static int ioloop_ctl(struct r5sim_ioloop *loop, int op,
+		      struct r5sim_io_handler *h, u32 events)
+{
+	struct epoll_event ev = {
+		.events   = events,
+		.data.ptr = h,
+	};
+
+	return epoll_ctl(loop->epoll_fd, op, h->fd, &ev);
+}
+
+int r5sim_ioloop_add(struct r5sim_ioloop *loop,
+		     struct r5sim_io_handler *h, u32 events)
+{
+	return ioloop_ctl(loop, EPOLL_CTL_ADD, h, events);
+}
+
+int r5sim_ioloop_mod(struct r5sim_ioloop *loop,
+		     struct r5sim_io_handler *h, u32 events)
+{
+	return ioloop_ctl(loop, EPOLL_CTL_MOD, h, events);
+}
+
+void r5sim_ioloop_del(struct r5sim_ioloop *loop,
+		      struct r5sim_io_handler *h)
+{
+	ioloop_ctl(loop, EPOLL_CTL_DEL, h, 0);
+}
+
+void r5sim_ioloop_pin(struct r5sim_ioloop *loop, pthread_t thread)
+{
+	cpu_set_t set;
+
+	if (loop->cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(loop->cpu, &set);
+
+	if (pthread_setaffinity_np(thread, sizeof(set), &set))
+		r5sim_warn("Failed to pin IO thread to CPU %d\n", loop->cpu);
+}
+
+static void *ioloop_thread(void *data)
+{
+	struct r5sim_ioloop *loop = data;
+	struct epoll_event events[IOLOOP_MAX_EVENTS];
+	struct r5sim_io_handler *h;
+	int i, nr;
+
+	while (1) {
+		nr = epoll_wait(loop->epoll_fd, events, IOLOOP_MAX_EVENTS, -1);
+		if (nr < 0) {
+			r5sim_assert(errno == EINTR);
+			continue;
+		}
+
+		for (i = 0; i < nr; i++) {
+			h = events[i].data.ptr;
+			h->func(h, events[i].events);
+		}
+	}
+
+	return NULL;
+}
+
+struct r5sim_ioloop *r5sim_ioloop_new(int cpu)
+{
+	struct r5sim_ioloop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	r5sim_assert(loop != NULL);
+
+	loop->cpu = cpu;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	r5sim_assert(loop->epoll_fd >= 0);
+
+	loop->wake_fd = eventfd(0, EFD_CLOEXEC);
+	r5sim_assert(loop->wake_fd >= 0);
+
+	loop->wake_handler.fd   = loop->wake_fd;
+	loop->wake_handler.func = ioloop_wake;
+	loop->wake_handler.priv = loop;
+	r5sim_assert(r5sim_ioloop_add(loop, &loop->wake_handler,
+				      EPOLLIN) == 0);
+
+	if (pthread_create(&loop->thread, NULL, ioloop_thread, loop)) {
+		perror("pthread_create");
+		r5sim_assert(!"Failed to start IO loop");
+	}
+
+	r5sim_ioloop_pin(loop, loop->thread);
+
+	if (cpu >= 0)
+		r5sim_info("Host IO pinned to CPU %d\n", cpu);
+
+	return loop;
+}
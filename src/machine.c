@@ -28,14 +28,21 @@
 #include <r5sim/env.h>
 #include <r5sim/log.h>
 #include <r5sim/list.h>
+#include <r5sim/clock.h>
 #include <r5sim/core.h>
+#include <r5sim/event.h>
 #include <r5sim/util.h>
+#include <r5sim/sched.h>
 #include <r5sim/vdevs.h>
 #include <r5sim/iodev.h>
+#include <r5sim/ioloop.h>
 #include <r5sim/machine.h>
 #include <r5sim/hwdebug.h>
 #include <r5sim/simple_core.h>
 
+#include <r5sim/hw/plic.h>
+#include <r5sim/hw/clint.h>
+
 /*
  * Given a mask, update only the masked bits in dest with the masked bits
  * in store. This lets us do the byte and half sized loads/stores.
@@ -79,6 +86,69 @@ static void __write_byte(u8 *mem, u32 paddr,
 	mem[paddr - base] = v;
 }
 
+/*
+ * Find a mapped memory region containing paddr. Regions are page aligned
+ * and accesses are naturally aligned, so if paddr is in the region then
+ * the whole access is, too. Call with regions_lock held.
+ */
+static struct r5sim_mem_region *
+r5sim_find_region(struct r5sim_machine *mach, u32 paddr)
+{
+	struct r5sim_mem_region *region;
+
+	list_for_each_entry(region, &mach->mem_regions, region_node) {
+		if (addr_in(region->base, region->size, paddr))
+			return region;
+	}
+
+	return NULL;
+}
+
+/*
+ * Load from or store to a mapped region. Any hart can map or unmap a
+ * region (e.g by remapping a VDISK aperture), so the lookup and the
+ * access itself are done under regions_lock: a remap waits for accesses
+ * already in the old region to finish, and every access after it sees
+ * the new mapping.
+ */
+static int r5sim_region_load(struct r5sim_machine *mach, u32 paddr,
+			     void *dest, u32 bytes)
+{
+	struct r5sim_mem_region *region;
+	int err = __ACCESS_FAULT;
+
+	pthread_rwlock_rdlock(&mach->regions_lock);
+
+	region = r5sim_find_region(mach, paddr);
+	if (region) {
+		memcpy(dest, region->mem + (paddr - region->base), bytes);
+		err = __ACCESS_OK;
+	}
+
+	pthread_rwlock_unlock(&mach->regions_lock);
+
+	return err;
+}
+
+static int r5sim_region_store(struct r5sim_machine *mach, u32 paddr,
+			      const void *src, u32 bytes)
+{
+	struct r5sim_mem_region *region;
+	int err = __ACCESS_FAULT;
+
+	pthread_rwlock_rdlock(&mach->regions_lock);
+
+	region = r5sim_find_region(mach, paddr);
+	if (region && (region->flags & R5SIM_MEM_WRITE)) {
+		memcpy(region->mem + (paddr - region->base), src, bytes);
+		err = __ACCESS_OK;
+	}
+
+	pthread_rwlock_unlock(&mach->regions_lock);
+
+	return err;
+}
+
 /*
  * IO memory is always accessed at 4 byte boundaries.
  */
@@ -161,7 +231,7 @@ static int r5sim_default_memload32(struct r5sim_machine *mach,
 			 paddr))
 		return r5sim_default_io_memload(mach, paddr, dest);
 	else
-		return __ACCESS_FAULT;
+		return r5sim_region_load(mach, paddr, dest, sizeof(*dest));
 
 	return 0;
 }
@@ -185,7 +255,7 @@ static int r5sim_default_memload16(struct r5sim_machine *mach,
 		*dest = __load_half((u16 *)mach->brom,
 				    paddr, mach->brom_base);
 	else
-		return __ACCESS_FAULT;
+		return r5sim_region_load(mach, paddr, dest, sizeof(*dest));
 
 	return 0;
 }
@@ -206,7 +276,7 @@ static int r5sim_default_memload8(struct r5sim_machine *mach,
 		*dest = __load_byte(mach->brom,
 				    paddr, mach->brom_base);
 	else
-		return __ACCESS_FAULT;
+		return r5sim_region_load(mach, paddr, dest, sizeof(*dest));
 
 	return 0;
 }
@@ -231,7 +301,7 @@ static int r5sim_default_memstore32(struct r5sim_machine *mach,
 			 paddr))
 		return r5sim_default_io_memstore(mach, paddr, value);
 	else
-		return __ACCESS_FAULT;
+		return r5sim_region_store(mach, paddr, &value, sizeof(value));
 
 	return 0;
 }
@@ -252,7 +322,7 @@ static int r5sim_default_memstore16(struct r5sim_machine *mach,
 		__write_half((u16 *)mach->memory, paddr,
 			     mach->memory_base, value);
 	else
-		return __ACCESS_FAULT;
+		return r5sim_region_store(mach, paddr, &value, sizeof(value));
 
 	return 0;
 }
@@ -270,11 +340,50 @@ static int r5sim_default_memstore8(struct r5sim_machine *mach,
 		__write_byte(mach->memory, paddr,
 			     mach->memory_base, value);
 	else
-		return __ACCESS_FAULT;
+		return r5sim_region_store(mach, paddr, &value, sizeof(value));
 
 	return 0;
 }
 
+static int r5sim_default_mematomic32(struct r5sim_machine *mach,
+				     u32 paddr,
+				     u32 **ptr)
+{
+	struct r5sim_mem_region *region;
+	int err = __ACCESS_FAULT;
+
+	if (paddr & 0x3)
+		return __ACCESS_MISALIGN;
+
+	/*
+	 * No atomics on the BROM or IO mem.
+	 */
+	if (addr_in(mach->memory_base,
+		    mach->memory_size,
+		    paddr)) {
+		*ptr = (u32 *)(mach->memory + (paddr - mach->memory_base));
+		return 0;
+	}
+
+	/*
+	 * The caller uses the pointer after regions_lock is dropped, so an
+	 * AMO racing with a remap may still land in the old region. That's
+	 * fine since it's ordered before the remap, and region memory stays
+	 * valid after an unmap (see r5sim_machine_unmap_region()).
+	 */
+	pthread_rwlock_rdlock(&mach->regions_lock);
+
+	region = r5sim_find_region(mach, paddr);
+	if (region && (region->flags & R5SIM_MEM_WRITE)) {
+		*ptr = (u32 *)(region->mem + (paddr - region->base));
+		err = __ACCESS_OK;
+	}
+
+	pthread_rwlock_unlock(&mach->regions_lock);
+
+	return err;
+}
+
 /*
  * A default R5 based machine. Some day these should be loadable and
  * configurable.
@@ -307,6 +416,7 @@ static struct r5sim_machine default_machine = {
 	.memstore32  = r5sim_default_memstore32,
 	.memstore16  = r5sim_default_memstore16,
 	.memstore8   = r5sim_default_memstore8,
+	.mematomic32 = r5sim_default_mematomic32,
 
 };
 
@@ -323,9 +433,33 @@ struct r5sim_machine *r5sim_machine_load_default(void)
 {
 	struct r5sim_app_args *args = r5sim_app_get_args();
 	struct r5sim_machine *mach = &default_machine;
-	struct r5sim_iodev *vuart, *vsys;
+	struct r5sim_iodev *vuart, *vsys, *clint, *plic;
+	int i;
 
-	mach->core = r5sim_simple_core_instance(mach);
+	if (args->virtual_time > 0)
+		r5sim_clock_init_virtual(args->virtual_time);
+	else
+		r5sim_clock_init();
+
+	for (i = 0; i < args->nr_harts; i++)
+		mach->cores[i] = r5sim_simple_core_instance(mach, i);
+
+	mach->core = mach->cores[0];
+	mach->nr_cores = args->nr_harts;
+
+	/*
+	 * With a hart quantum the harts take turns on one thread (see
+	 * sched.c); a kick to any of them has to wake that thread.
+	 */
+	if (args->hart_quantum) {
+		for (i = 0; i < args->nr_harts; i++) {
+			mach->cores[i]->shared = 1;
+			mach->cores[i]->waker  = &mach->core->wake;
+		}
+	}
+
+	pthread_mutex_init(&mach->run_lock, NULL);
+	pthread_cond_init(&mach->run_cond, NULL);
 
 	mach->memory = malloc(mach->memory_size);
 	r5sim_assert(mach->memory != NULL);
@@ -334,11 +468,25 @@ struct r5sim_machine *r5sim_machine_load_default(void)
 	r5sim_assert(mach->brom != NULL);
 
 	INIT_LIST_HEAD(&mach->io_devs);
+	INIT_LIST_HEAD(&mach->mem_regions);
+	pthread_rwlock_init(&mach->regions_lock, NULL);
+
+	mach->ioloop = r5sim_ioloop_new(args->io_cpu);
+
+	mach->events = r5sim_event_queue_new(mach);
+
+	/*
+	 * PLIC at IO + 0x400000. This goes first; the other devices raise
+	 * their interrupts through it.
+	 */
+	plic = r5sim_plic_load_new(mach, PLIC_IO_OFFSET);
+	r5sim_assert(plic != NULL);
+	r5sim_assert(r5sim_machine_add_device(mach, plic) == 0);
 
 	/*
 	 * VUART device at IO + 0x0.
 	 */
-	vuart = r5sim_vuart_load_new(mach, 0x0);
+	vuart = r5sim_vuart_load_new(mach, 0x0, PLIC_IRQ_VUART, args->uart);
 	r5sim_assert(vuart != NULL);
 	r5sim_assert(r5sim_machine_add_device(mach, vuart) == 0);
 
@@ -350,18 +498,95 @@ struct r5sim_machine *r5sim_machine_load_default(void)
 	r5sim_assert(r5sim_machine_add_device(mach, vsys) == 0);
 
 	/*
-	 * VDISK device at IO + 0x1000.
+	 * CLINT at IO + 0x20000.
 	 */
-	if (args->disk_file) {
+	clint = r5sim_clint_load_new(mach, CLINT_IO_OFFSET);
+	r5sim_assert(clint != NULL);
+	r5sim_assert(r5sim_machine_add_device(mach, clint) == 0);
+
+	/*
+	 * VDISK devices at IO + 0x1000, IO + 0x2000, etc.
+	 */
+	for (i = 0; i < args->nr_disks; i++) {
 		struct r5sim_iodev *vdisk =
-			r5sim_vdisk_load_new(mach, 0x1000, args->disk_file);
+			r5sim_vdisk_load_new(mach,
+					     VDISK_IO_OFFSET +
+					     i * VDISK_IO_STRIDE,
+					     PLIC_IRQ_VDISK(i),
+					     args->disk_files[i]);
 
 		r5sim_assert(r5sim_machine_add_device(mach, vdisk) == 0);
 	}
 
+	/*
+	 * virtio-blk device at IO + 0x10000.
+	 */
+	if (args->vblk_file) {
+		struct r5sim_iodev *vblk =
+			r5sim_vblk_load_new(mach, 0x10000, PLIC_IRQ_VBLK,
+					    args->vblk_file);
+
+		r5sim_assert(r5sim_machine_add_device(mach, vblk) == 0);
+	}
+
 	return mach;
 }
 
+static int ranges_overlap(u64 base_a, u64 size_a, u64 base_b, u64 size_b)
+{
+	return base_a < base_b + size_b && base_b < base_a + size_a;
+}
+
+int r5sim_machine_map_region(struct r5sim_machine *mach,
+			     struct r5sim_mem_region *region)
+{
+	struct r5sim_mem_region *other;
+
+	if ((region->base & (KB(4) - 1)) || (region->size & (KB(4) - 1)) ||
+	    region->size == 0 ||
+	    (u64)region->base + region->size > 0x100000000ULL)
+		return -1;
+
+	if (ranges_overlap(region->base, region->size,
+			   mach->memory_base, mach->memory_size) ||
+	    ranges_overlap(region->base, region->size,
+			   mach->brom_base, mach->brom_size) ||
+	    ranges_overlap(region->base, region->size,
+			   mach->iomem_base, mach->iomem_size))
+		return -1;
+
+	pthread_rwlock_wrlock(&mach->regions_lock);
+
+	list_for_each_entry(other, &mach->mem_regions, region_node) {
+		if (ranges_overlap(region->base, region->size,
+				   other->base, other->size)) {
+			pthread_rwlock_unlock(&mach->regions_lock);
+			return -1;
+		}
+	}
+
+	list_add_tail(&region->region_node, &mach->mem_regions);
+
+	pthread_rwlock_unlock(&mach->regions_lock);
+
+	r5sim_dbg("Mapped region %s @ 0x%08x + 0x%08x (%s)\n",
+		  region->name, region->base, region->size,
+		  region->flags & R5SIM_MEM_WRITE ? "RW" : "RO");
+
+	return 0;
+}
+
+void r5sim_machine_unmap_region(struct r5sim_machine *mach,
+				struct r5sim_mem_region *region)
+{
+	pthread_rwlock_wrlock(&mach->regions_lock);
+	list_del(&region->region_node);
+	pthread_rwlock_unlock(&mach->regions_lock);
+
+	r5sim_dbg("Unmapped region %s @ 0x%08x\n",
+		  region->name, region->base);
+}
+
 void r5sim_machine_load_brom(struct r5sim_machine *mach)
 {
 	struct r5sim_app_args *args = r5sim_app_get_args();
@@ -404,25 +629,84 @@ void r5sim_machine_load_brom(struct r5sim_machine *mach)
 	close(brom_fd);
 }
 
+void r5sim_machine_kick(struct r5sim_machine *mach)
+{
+	u32 i;
+
+	for (i = 0; i < mach->nr_cores; i++)
+		r5sim_core_kick(mach->cores[i]);
+}
+
+/*
+ * Thread for each hart other than hart 0. When the debugger takes the
+ * machine the hart stops and waits here until it's let go.
+ */
+static void *r5sim_machine_hart_thread(void *arg)
+{
+	struct r5sim_core *core = arg;
+	struct r5sim_machine *mach = core->mach;
+
+	while (1) {
+		r5sim_core_exec(mach, core, 0);
+
+		pthread_mutex_lock(&mach->run_lock);
+		while (mach->debug)
+			pthread_cond_wait(&mach->run_cond, &mach->run_lock);
+		pthread_mutex_unlock(&mach->run_lock);
+	}
+
+	return NULL;
+}
+
 void r5sim_machine_run(struct r5sim_machine *mach)
 {
-	r5sim_info("Execution begins @ 0x%08x\n", mach->brom_base);
+	struct r5sim_app_args *args = r5sim_app_get_args();
+	pthread_t thread;
+	u32 i;
+
+	r5sim_info("Execution begins @ 0x%08x on %u hart(s)\n",
+		   mach->brom_base, mach->nr_cores);
 
 	/*
 	 * We assume that the brom has been loaded. The starting PC is address
-	 * 0x0 of the bootrom.
+	 * 0x0 of the bootrom for every hart; it's up to the BROM to sort the
+	 * harts out by mhartid.
 	 */
-	mach->core->pc = mach->brom_base;
+	for (i = 0; i < mach->nr_cores; i++)
+		mach->cores[i]->pc = mach->brom_base;
+
+	if (args->hart_quantum) {
+		r5sim_info("Harts share one thread; quantum: %u\n",
+			   args->hart_quantum);
+		r5sim_sched_run(mach);
+		return;
+	}
+
+	for (i = 1; i < mach->nr_cores; i++) {
+		if (pthread_create(&thread, NULL, r5sim_machine_hart_thread,
+				   mach->cores[i])) {
+			perror("pthread_create");
+			r5sim_assert(!"Failed to start hart thread");
+		}
+	}
 
 	while (1) {
 		r5sim_core_exec(mach, mach->core, 0);
 		r5sim_debug_do_session(mach);
+
+		/*
+		 * The debugger cleared debug; start the other harts again.
+		 */
+		pthread_mutex_lock(&mach->run_lock);
+		pthread_cond_broadcast(&mach->run_cond);
+		pthread_mutex_unlock(&mach->run_lock);
 	}
 }
 
 void r5sim_machine_print(struct r5sim_machine *mach)
 {
 	struct r5sim_iodev *dev;
+	u32 i;
 
 	r5sim_info("Machine description: %s\n", mach->descr.name);
 	r5sim_info("  DRAM:        0x%08x + 0x%08x)\n",
@@ -430,7 +714,8 @@ void r5sim_machine_print(struct r5sim_machine *mach)
 	r5sim_info("  IO Aperture: 0x%08x + 0x%08x)\n",
 		   mach->iomem_base, mach->iomem_size);
 
-	r5sim_core_describe(mach->core);
+	for (i = 0; i < mach->nr_cores; i++)
+		r5sim_core_describe(mach->cores[i]);
 
 	list_for_each_entry(dev, &mach->io_devs, mach_node) {
 		r5sim_iodev_describe(dev);
@@ -105,13 +105,26 @@ int r5sim_default_store32(struct r5sim_mmu *mmu,
 	return mach->memstore32(mach, addr, value);
 }
 
+int r5sim_default_atomic32(struct r5sim_mmu *mmu,
+			   u32 addr, u32 **ptr)
+{
+	struct r5sim_machine *mach = mmu_to_mach(mmu);
+
+	if (r5sim_pmp_load_allowed(mmu_to_core(mmu), addr) ||
+	    r5sim_pmp_store_allowed(mmu_to_core(mmu), addr))
+		return __ACCESS_FAULT;
+
+	return mach->mematomic32(mach, addr, ptr);
+}
+
 void r5sim_mmu_use_default(struct r5sim_core *core)
 {
-	core->mmu.load8   = r5sim_default_load8;
-	core->mmu.load16  = r5sim_default_load16;
-	core->mmu.load32  = r5sim_default_load32;
-	core->mmu.iload   = r5sim_default_iload;
-	core->mmu.store8  = r5sim_default_store8;
-	core->mmu.store16 = r5sim_default_store16;
-	core->mmu.store32 = r5sim_default_store32;
+	core->mmu.load8    = r5sim_default_load8;
+	core->mmu.load16   = r5sim_default_load16;
+	core->mmu.load32   = r5sim_default_load32;
+	core->mmu.iload    = r5sim_default_iload;
+	core->mmu.store8   = r5sim_default_store8;
+	core->mmu.store16  = r5sim_default_store16;
+	core->mmu.store32  = r5sim_default_store32;
+	core->mmu.atomic32 = r5sim_default_atomic32;
 }
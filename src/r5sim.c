@@ -20,6 +20,8 @@
 
 #include <stdio.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #include <r5sim/log.h>
 #include <r5sim/app.h>
@@ -34,20 +36,31 @@ static struct option app_opts[] = {
 	{ "quiet",		0, NULL, 'q' },
 	{ "bootrom",		1, NULL, 'b' },
 	{ "disk",		1, NULL, 'd' },
+	{ "virtio-blk",		1, NULL, 'k' },
+	{ "uart",		1, NULL, 'u' },
+	{ "io-cpu",		1, NULL, 'I' },
+	{ "time-quantum",	1, NULL, 't' },
+	{ "virtual-time",	1, NULL, 'V' },
 	{ "itrace",		1, NULL, 'T' },
 	{ "script",		1, NULL, 's' },
+	{ "harts",		1, NULL, 'H' },
+	{ "hart-quantum",	1, NULL, 'Q' },
+	{ "hart-weights",	1, NULL, 'W' },
 
 	{ NULL,			0, NULL,  0  }
 };
 
-static const char *app_opts_str = "hvb:d:Ts:";
+static const char *app_opts_str = "hvqb:d:k:u:I:t:V:Ts:H:Q:W:";
 
 static void r5sim_help(void) {
 
 	fprintf(stderr,
 "R5 Simulator help. General usage:\n"
 "\n"
-"  $ r5sim [-hvqT] <-b BOOTROM> [-d <DISK>] [-s <SCRIPT>]\n"
+"  $ r5sim [-hvqT] <-b BOOTROM> [-d <DISK>] [-k <DISK>]\n"
+"                [-u <UART>] [-I <CPU>]\n"
+"                [-s <SCRIPT>] [-H <HARTS>] [-Q <INSNS>]\n"
+"                [-W <WEIGHTS>]\n"
 "\n"
 "Options:\n"
 "\n"
@@ -58,9 +71,51 @@ static void r5sim_help(void) {
 "                        times.\n"
 "  -b,--bootrom          Specify a bootrom to load/execute.\n"
 "  -d,--disk             Specify a file to treat as a disk. This will be loaded\n"
-"                        as a VDISK device.\n"
+"                        as a VDISK device. Can be specified up to 15 times;\n"
+"                        each disk gets its own 4KB IO window. The file may\n"
+"                        be followed by comma separated options:\n"
+"                          overlay=<DELTA>  Don't modify the disk; writes go\n"
+"                                           to the sparse file DELTA.\n"
+"                          snapshot         Don't modify the disk; writes are\n"
+"                                           kept in memory and discarded.\n"
+"                          backend=<NAME>   Storage backend: mmap (default),\n"
+"                                           pio or uring.\n"
+"                          cache=<PAGES>    pio page cache size.\n"
+"                          readahead=<PAGES> pio readahead on a miss.\n"
+"                          qd=<N>           uring queue depth.\n"
+"                          writeback[=<PAGES>] Batch write-back; push out\n"
+"                                           dirty data every PAGES.\n"
+"                          latency=<NS>     Complete each op no sooner\n"
+"                                           than NS after it's started.\n"
+"  -k,--virtio-blk       Specify a file to treat as a virtio-blk disk. This\n"
+"                        is attached as a virtio-mmio device.\n"
+"  -u,--uart             Pick where the VUART's input and output go:\n"
+"                          pty              A pseudo terminal (default).\n"
+"                          stdio            stdin and stdout.\n"
+"                          file=<PATH>      Buffered output to PATH; no\n"
+"                                           input.\n"
+"                          unix=<PATH>      A listening unix socket.\n"
+"                          null             Discard output; no input.\n"
+"  -I,--io-cpu           Pin host IO (device event loop and disk workers)\n"
+"                        to host CPU number CPU.\n"
+"  -t,--time-quantum     Reuse a TIME CSR sample for up to INSNS retired\n"
+"                        instructions. 0 (the default) samples the host\n"
+"                        clock on every read.\n"
+"  -V,--virtual-time     Run on virtual time: the clock advances RATE ns\n"
+"                        per instruction rather than following the host,\n"
+"                        and WFI skips straight to the next timer. RATE\n"
+"                        is in instructions per ns; e.g 0.1 for 100 MIPS.\n"
 "  -T,--itrace           Turn on instruction tracing; this is _very_ verbose.\n"
 "  -s,--script           Execute a script before jumping to the BROM.\n"
+"  -H,--harts            Number of harts, each on its own host thread;\n"
+"                        1 to 32, default 1. Every hart starts in the BROM\n"
+"                        and can tell itself apart by its mhartid.\n"
+"  -Q,--hart-quantum     Rather than a thread per hart, take turns running\n"
+"                        the harts on one thread, INSNS instructions at a\n"
+"                        time. The interleaving is the same every run.\n"
+"  -W,--hart-weights     Comma separated weight for each hart with -Q; hart\n"
+"                        h runs INSNS times its weight per turn. Harts\n"
+"                        without a weight get 1.\n"
 "\n"
 "Execute the R5 simulator; BOOTROM is a binary blob of instructions/data\n"
 "that should be loaded into memory and executed. This will be the first\n"
@@ -72,11 +127,44 @@ static void r5sim_help(void) {
 static void r5sim_set_default_opts(void)
 {
 	app_args.verbose = INFO;
+	app_args.io_cpu  = -1;
+	app_args.nr_harts = 1;
+}
+
+/*
+ * Parse a -W list: W0,W1,... for harts 0, 1, ...
+ */
+static int r5sim_parse_weights(const char *str)
+{
+	const char *p = str;
+	unsigned long weight;
+	char *end;
+	int i;
+
+	for (i = 0; i < R5SIM_MAX_HARTS; i++) {
+		weight = strtoul(p, &end, 0);
+		if (end == p || !weight || weight > UINT_MAX)
+			break;
+
+		app_args.hart_weights[i] = weight;
+
+		if (*end == '\0')
+			return 0;
+		if (*end != ',')
+			break;
+
+		p = end + 1;
+	}
+
+	r5sim_err("Invalid hart weights: %s\n", str);
+	return -1;
 }
 
 static int r5sim_getopts(int argc, char * const argv[])
 {
-	int c, opt_index;
+	unsigned long quantum;
+	unsigned weight;
+	int c, i, opt_index;
 
 	r5sim_set_default_opts();
 
@@ -101,7 +189,32 @@ static int r5sim_getopts(int argc, char * const argv[])
 			app_args.bootrom = optarg;
 			break;
 		case 'd':
-			app_args.disk_file = optarg;
+			if (app_args.nr_disks == VDISK_MAX_DISKS) {
+				r5sim_err("Too many disks; max is %d\n",
+					  VDISK_MAX_DISKS);
+				return -1;
+			}
+			app_args.disk_files[app_args.nr_disks++] = optarg;
+			break;
+		case 'k':
+			app_args.vblk_file = optarg;
+			break;
+		case 'u':
+			app_args.uart = optarg;
+			break;
+		case 'I':
+			app_args.io_cpu = atoi(optarg);
+			break;
+		case 't':
+			app_args.time_quantum = strtoul(optarg, NULL, 0);
+			break;
+		case 'V':
+			app_args.virtual_time = strtod(optarg, NULL);
+			if (app_args.virtual_time <= 0) {
+				r5sim_err("Invalid virtual time rate: %s\n",
+					  optarg);
+				return -1;
+			}
 			break;
 		case 'T':
 			app_args.itrace = 1;
@@ -109,6 +222,28 @@ static int r5sim_getopts(int argc, char * const argv[])
 		case 's':
 			app_args.script = optarg;
 			break;
+		case 'H':
+			app_args.nr_harts = strtoul(optarg, NULL, 0);
+			if (app_args.nr_harts < 1 ||
+			    app_args.nr_harts > R5SIM_MAX_HARTS) {
+				r5sim_err("Invalid number of harts: %s\n",
+					  optarg);
+				return -1;
+			}
+			break;
+		case 'Q':
+			quantum = strtoul(optarg, NULL, 0);
+			if (!quantum || quantum > UINT_MAX) {
+				r5sim_err("Invalid hart quantum: %s\n",
+					  optarg);
+				return -1;
+			}
+			app_args.hart_quantum = quantum;
+			break;
+		case 'W':
+			if (r5sim_parse_weights(optarg))
+				return -1;
+			break;
 		case '?':
 			app_args.help = 1;
 			return -1;
@@ -118,6 +253,30 @@ static int r5sim_getopts(int argc, char * const argv[])
 		}
 	}
 
+	/*
+	 * With a thread per hart every hart would drive the one virtual
+	 * clock from its own thread.
+	 */
+	if (app_args.nr_harts > 1 && app_args.virtual_time > 0 &&
+	    !app_args.hart_quantum) {
+		r5sim_err("Virtual time with more than one hart needs -Q\n");
+		return -1;
+	}
+
+	/*
+	 * Each hart's turn is INSNS times its weight instructions, counted
+	 * in 32 bits; and a turn of 0 would never end.
+	 */
+	for (i = 0; i < R5SIM_MAX_HARTS; i++) {
+		weight = app_args.hart_weights[i] ? app_args.hart_weights[i] : 1;
+		if ((unsigned long long)app_args.hart_quantum * weight >
+		    UINT_MAX) {
+			r5sim_err("Hart quantum too big: %u times weight %u\n",
+				  app_args.hart_quantum, weight);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,144 @@
+/* Copyright 2021, Alex Waterman <imnotlistening@gmail.com>
+ *
+ * This file is part of r5sim.
+ *
+ * r5sim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * r5sim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with r5sim.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Hart scheduler: every hart takes turns on one host thread, round robin,
+ * each running a quantum of instructions a turn; hart h's quantum is the
+ * base quantum times its weight. Where one hart stops and the next starts
+ * depends only on instruction counts, so the interleaving is the same
+ * from run to run; on virtual time the whole machine is. Switching harts
+ * is just a return from r5sim_core_exec() and a call with the next core.
+ *
+ * Harts never block here. Where a hart would - WFI, an idle loop, WRS -
+ * it sets its yield and ends its turn early (see core.h). Once a round
+ * goes by with no hart getting anything done the scheduler does the
+ * waiting: on virtual time it skips ahead to the next event, otherwise it
+ * sleeps until a hart is kicked. Every hart's kicks go to hart 0's waker
+ * so any of them wakes the thread.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <r5sim/app.h>
+#include <r5sim/log.h>
+#include <r5sim/core.h>
+#include <r5sim/util.h>
+#include <r5sim/clock.h>
+#include <r5sim/event.h>
+#include <r5sim/sched.h>
+#include <r5sim/hwdebug.h>
+#include <r5sim/machine.h>
+
+/*
+ * With only idle loops left (polling, say, for a DMA that doesn't kick)
+ * sleep in naps that start short and double while nothing changes.
+ */
+#define SCHED_NAP_MIN_NS	1000
+#define SCHED_NAP_NS		1000000
+
+static bool sched_runnable(struct r5sim_core *core)
+{
+	switch (core->yield) {
+	case R5SIM_YIELD_HUNG:
+		return false;
+	case R5SIM_YIELD_WFI:
+		r5sim_core_intr_sync(core);
+		return core->mip != 0;
+	}
+
+	return true;
+}
+
+/*
+ * Nothing is runnable or everything runnable is idle. seq is the waker's
+ * seq from before the round, so a kick during the round isn't lost.
+ */
+static void sched_wait(struct r5sim_machine *mach, u32 seq, bool idle,
+		       long *nap_ns)
+{
+	struct r5sim_waker *waker = mach->core->waker;
+	struct timespec ts = {
+		.tv_sec  = 0,
+		.tv_nsec = *nap_ns,
+	};
+
+	if (r5sim_clock_virtual() && r5sim_event_skip(mach))
+		return;
+
+	__atomic_store_n(&waker->waiting, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &waker->seq, FUTEX_WAIT_PRIVATE,
+		seq, idle ? &ts : NULL, NULL, 0);
+	__atomic_store_n(&waker->waiting, 0, __ATOMIC_SEQ_CST);
+
+	if (idle)
+		*nap_ns = min(*nap_ns * 2, (long)SCHED_NAP_NS);
+}
+
+void r5sim_sched_run(struct r5sim_machine *mach)
+{
+	struct r5sim_app_args *args = r5sim_app_get_args();
+	struct r5sim_waker *waker = mach->core->waker;
+	u32 quantum[R5SIM_MAX_HARTS];
+	long nap_ns = SCHED_NAP_MIN_NS;
+	bool busy, idle;
+	u32 i, seq;
+
+	for (i = 0; i < mach->nr_cores; i++)
+		quantum[i] = args->hart_quantum *
+			(args->hart_weights[i] ? args->hart_weights[i] : 1);
+
+	while (1) {
+		seq = __atomic_load_n(&waker->seq, __ATOMIC_SEQ_CST);
+		busy = false;
+		idle = false;
+
+		for (i = 0; i < mach->nr_cores && !mach->debug; i++) {
+			struct r5sim_core *core = mach->cores[i];
+
+			if (!sched_runnable(core))
+				continue;
+
+			r5sim_core_exec(mach, core, quantum[i]);
+
+			switch (core->yield) {
+			case R5SIM_YIELD_NONE:
+			case R5SIM_YIELD_PAUSE:
+				busy = true;
+				break;
+			case R5SIM_YIELD_IDLE:
+				idle = true;
+				break;
+			}
+		}
+
+		if (mach->debug) {
+			r5sim_debug_do_session(mach);
+			continue;
+		}
+
+		if (busy) {
+			nap_ns = SCHED_NAP_MIN_NS;
+			continue;
+		}
+
+		sched_wait(mach, seq, idle, &nap_ns);
+	}
+}
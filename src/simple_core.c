@@ -23,6 +23,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 #include <r5sim/app.h>
 #include <r5sim/log.h>
@@ -39,6 +40,20 @@ static int exec_misc_mem(struct r5sim_machine *mach,
 			 struct r5sim_core *core,
 			 const r5_inst *__inst)
 {
+	/*
+	 * PAUSE (Zihintpause) is a FENCE W,0; let the host CPU know we're
+	 * spinning, or with a shared thread let the other harts run. Long
+	 * spins are caught by the idle loop detection.
+	 */
+	if (*(const u32 *)__inst == 0x0100000f) {
+		r5sim_itrace(core, "PAUSE\n");
+		if (core->shared)
+			core->yield = R5SIM_YIELD_PAUSE;
+		else
+			cpu_relax();
+		return TRAP_ALL_GOOD;
+	}
+
 	r5sim_itrace(core, "NO-OP\n");
 
 	/*
@@ -59,6 +74,8 @@ static int exec_load(struct r5sim_machine *mach,
 	paddr_src = core->reg_file[inst->rs1] +
 		sign_extend(inst->imm_11_0, 11);
 
+	core->idle.loaded = 1;
+
 	/*
 	 * Handle the various forms of load.
 	 */
@@ -168,6 +185,8 @@ static int exec_store(struct r5sim_machine *mach,
 	imm = sign_extend((inst->imm_11_5 << 5) | inst->imm_4_0, 11);
 	paddr_dst = __get_reg(core, inst->rs1) + imm;
 
+	core->idle.dirty = 1;
+
 	switch (inst->func3) {
 	case 0x0: /* SB */
 		err = core->mmu.store8(&core->mmu, paddr_dst,
@@ -229,6 +248,181 @@ static int exec_store(struct r5sim_machine *mach,
 	return TRAP_ALL_GOOD;
 }
 
+/*
+ * RV32A. LR/SC sits on top of host atomics: LR remembers the word it
+ * loaded and the generation of the word's reservation granule. SC only
+ * succeeds if the granule's generation hasn't moved and a host CAS finds
+ * the word still holding what LR loaded. Every SC and AMO bumps its
+ * granule's generation, so another hart's atomic update is noticed even
+ * if it puts the old value back; plain stores are caught by the CAS.
+ * Plain loads and stores track nothing, so a single hart pays nothing.
+ */
+static int exec_lr(struct r5sim_machine *mach,
+		   struct r5sim_core *core,
+		   const r5_inst_r *inst)
+{
+	u32 addr = __get_reg(core, inst->rs1);
+	u32 gen;
+	u32 w;
+	int err;
+
+	if (inst->rs2 != 0)
+		return TRAP_ILLEGAL_INST;
+
+	core->idle.loaded = 1;
+
+	/*
+	 * Sample the generation before the load so an update that lands
+	 * in between makes the SC fail.
+	 */
+	gen = __atomic_load_n(r5sim_machine_resv_gen(mach, addr),
+			      __ATOMIC_ACQUIRE);
+
+	err = core->mmu.load32(&core->mmu, addr, &w);
+	switch (err) {
+	case __ACCESS_MISALIGN:
+		return TRAP_LD_ADDR_MISALIGN;
+	case __ACCESS_FAULT:
+		return TRAP_LD_ACCESS_FAULT;
+	case __ACCESS_OK:
+		break;
+	default:
+		r5sim_assert(!"Invalid memload return!");
+	}
+
+	core->resv_valid = 1;
+	core->resv_addr = addr;
+	core->resv_value = w;
+	core->resv_gen = gen;
+
+	__set_reg(core, inst->rd, w);
+
+	r5sim_itrace(core,
+		     "%-9s %-3s <- [%s]\n",
+		     "LR.W",
+		     r5sim_reg_to_str(inst->rd),
+		     r5sim_reg_to_str(inst->rs1));
+
+	return TRAP_ALL_GOOD;
+}
+
+static u32 amo_minmax(u32 *ptr, u32 src, u32 func5)
+{
+	u32 old = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+	u32 new;
+
+	do {
+		switch (func5) {
+		case 0x10: /* AMOMIN.W */
+			new = (s32)old < (s32)src ? old : src;
+			break;
+		case 0x14: /* AMOMAX.W */
+			new = (s32)old > (s32)src ? old : src;
+			break;
+		case 0x18: /* AMOMINU.W */
+			new = old < src ? old : src;
+			break;
+		default:   /* AMOMAXU.W */
+			new = old > src ? old : src;
+			break;
+		}
+	} while (!__atomic_compare_exchange_n(ptr, &old, new, true,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+
+	return old;
+}
+
+static int exec_amo(struct r5sim_machine *mach,
+		    struct r5sim_core *core,
+		    const r5_inst *__inst)
+{
+	const r5_inst_r *inst = (const r5_inst_r *)__inst;
+	u32 func5 = inst->func7 >> 2;
+	u32 addr, src, old, expect;
+	u32 *gen, *ptr;
+	int err;
+
+	if (inst->func3 != 0x2)
+		return TRAP_ILLEGAL_INST;
+
+	if (func5 == 0x02)
+		return exec_lr(mach, core, inst);
+
+	addr = __get_reg(core, inst->rs1);
+	src = __get_reg(core, inst->rs2);
+
+	core->idle.dirty = 1;
+
+	err = core->mmu.atomic32(&core->mmu, addr, &ptr);
+	switch (err) {
+	case __ACCESS_MISALIGN:
+		return TRAP_ST_ADDR_MISALIGN;
+	case __ACCESS_FAULT:
+		return TRAP_ST_ACCESS_FAULT;
+	case __ACCESS_OK:
+		break;
+	default:
+		r5sim_assert(!"Invalid mematomic return!");
+	}
+
+	gen = r5sim_machine_resv_gen(mach, addr);
+
+	switch (func5) {
+	case 0x03: /* SC.W */
+		expect = core->resv_value;
+		old = 1;
+		if (core->resv_valid && core->resv_addr == addr &&
+		    __atomic_load_n(gen, __ATOMIC_ACQUIRE) == core->resv_gen &&
+		    __atomic_compare_exchange_n(ptr, &expect, src, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED)) {
+			__atomic_add_fetch(gen, 1, __ATOMIC_RELEASE);
+			old = 0;
+		}
+
+		core->resv_valid = 0;
+		break;
+	case 0x00: /* AMOADD.W */
+		old = __atomic_fetch_add(ptr, src, __ATOMIC_SEQ_CST);
+		break;
+	case 0x01: /* AMOSWAP.W */
+		old = __atomic_exchange_n(ptr, src, __ATOMIC_SEQ_CST);
+		break;
+	case 0x04: /* AMOXOR.W */
+		old = __atomic_fetch_xor(ptr, src, __ATOMIC_SEQ_CST);
+		break;
+	case 0x08: /* AMOOR.W */
+		old = __atomic_fetch_or(ptr, src, __ATOMIC_SEQ_CST);
+		break;
+	case 0x0c: /* AMOAND.W */
+		old = __atomic_fetch_and(ptr, src, __ATOMIC_SEQ_CST);
+		break;
+	case 0x10: /* AMOMIN.W */
+	case 0x14: /* AMOMAX.W */
+	case 0x18: /* AMOMINU.W */
+	case 0x1c: /* AMOMAXU.W */
+		old = amo_minmax(ptr, src, func5);
+		break;
+	default:
+		return TRAP_ILLEGAL_INST;
+	}
+
+	if (func5 != 0x03)
+		__atomic_add_fetch(gen, 1, __ATOMIC_RELEASE);
+
+	__set_reg(core, inst->rd, old);
+
+	r5sim_itrace(core,
+		     "%-9s %-3s <- [%s] %s\n",
+		     r5sim_amo_func5_to_str(func5),
+		     r5sim_reg_to_str(inst->rd),
+		     r5sim_reg_to_str(inst->rs1),
+		     r5sim_reg_to_str(inst->rs2));
+
+	return TRAP_ALL_GOOD;
+}
+
 static int exec_op_imm(struct r5sim_machine *mach,
 		       struct r5sim_core *core,
 		       const r5_inst *__inst)
@@ -605,6 +799,11 @@ static int exec_system(struct r5sim_machine *mach,
 	const u32 csr = inst->imm_11_0;
 	int ret = TRAP_ALL_GOOD;
 
+	/*
+	 * CSRs have side effects, and the counters change on every read.
+	 */
+	core->idle.dirty = 1;
+
 	switch (inst->func3) {
 	case 0x0: /* ECALL/EBREAK/etc. */
 		switch (csr) {
@@ -653,6 +852,15 @@ static int exec_system(struct r5sim_machine *mach,
 		case 0x105: /* WFI */
 			r5sim_core_wfi(core);
 			break;
+		case 0x00d: /* WRS.NTO */
+		case 0x01d: /* WRS.STO */
+			if (inst->rs1 || inst->rd) {
+				ret = TRAP_ILLEGAL_INST;
+				goto done;
+			}
+
+			r5sim_core_wrs(core, csr == 0x01d);
+			break;
 		}
 		break;
 	case 0x1: /* CSRRW */
@@ -726,7 +934,7 @@ static struct r5_op_family op_families[32] = {
 	[8]  = R5_OP_FAMILY("STORE",    R5_OP_TYPE_S, exec_store, 1),
 	[9]  = { 0 },
 	[10] = { 0 },
-	[11] = { 0 },
+	[11] = R5_OP_FAMILY("AMO",      R5_OP_TYPE_R, exec_amo, 1),
 	[12] = R5_OP_FAMILY("OP",       R5_OP_TYPE_R, exec_op, 1),
 	[13] = R5_OP_FAMILY("LUI",      R5_OP_TYPE_U, exec_lui, 1),
 	[14] = { 0 },
@@ -828,7 +1036,7 @@ static int simple_core_exec_one(struct r5sim_machine *mach,
 }
 
 struct r5sim_core *r5sim_simple_core_instance(
-	struct r5sim_machine *mach)
+	struct r5sim_machine *mach, u32 hartid)
 {
 	struct r5sim_core *core;
 
@@ -840,6 +1048,7 @@ struct r5sim_core *r5sim_simple_core_instance(
 	core->exec_one = simple_core_exec_one;
 	core->mach     = mach;
 	core->name     = "simple-core-r5";
+	core->hartid   = hartid;
 
 	r5sim_core_init_common(core);
 